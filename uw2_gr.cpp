@@ -0,0 +1,4557 @@
+/*
+    uw2_gr_tool: "Ultima Underworld II" .GR extracter/rebuilder.
+    Copyright (C) 2014, Boris I. Bendovsky <bibendovsky@hotmail.com>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. 
+*/
+
+
+#include "uw2_gr.h"
+
+#ifdef _WIN32
+#include <direct.h>
+
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif // NOMINMAX
+
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif // _WIN32
+
+// Define UW2_GR_TOOL_NO_SIMD to use only portable code.
+//
+// GCC and Clang compile SIMD code for x86 regardless of the target
+// of the build and pick it at run time by features of the CPU. Other
+// compilers use it only if the target of the build has the features.
+#ifndef UW2_GR_TOOL_NO_SIMD
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define UW2_GR_TOOL_AVX2
+#define UW2_GR_TOOL_SSSE3
+#define UW2_GR_TOOL_SIMD_DISPATCH
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define UW2_GR_TOOL_AVX2
+#define UW2_GR_TOOL_SSSE3
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#define UW2_GR_TOOL_SSSE3
+#endif // __GNUC__
+#endif // UW2_GR_TOOL_NO_SIMD
+
+#ifdef UW2_GR_TOOL_SIMD_DISPATCH
+#define UW2_GR_TOOL_TARGET(features) __attribute__((target(features)))
+#else
+#define UW2_GR_TOOL_TARGET(features)
+#endif // UW2_GR_TOOL_SIMD_DISPATCH
+
+#include <cassert>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <iterator>
+#include <locale>
+
+
+namespace uw2_gr {
+
+
+namespace {
+
+
+class BmpHeader {
+public:
+    unsigned short bfType;
+    unsigned int bfSize;
+    unsigned short bfReserved1;
+    unsigned short bfReserved2;
+    unsigned int bfOffBits;
+
+    unsigned char* save_to_buffer(
+        unsigned char* data) const
+    {
+        data = put_value(bfType, data);
+        data = put_value(bfSize, data);
+        data = put_value(bfReserved1, data);
+        data = put_value(bfReserved2, data);
+        data = put_value(bfOffBits, data);
+        return data;
+    }
+
+    void load_from_stream(
+        std::istream& stream)
+    {
+        read_value(bfType, stream);
+        read_value(bfSize, stream);
+        read_value(bfReserved1, stream);
+        read_value(bfReserved2, stream);
+        read_value(bfOffBits, stream);
+    }
+
+    static int get_size()
+    {
+        return 14;
+    }
+}; // class BmpHeader
+
+class BmpInfoHeader {
+public:
+    enum Compression {
+        e_rgb = 0, // BI_RGB
+        e_rle8 = 1 // BI_RLE8
+    }; // enum Compression
+
+    unsigned int biSize;
+    int biWidth;
+    int biHeight;
+    unsigned short biPlanes;
+    unsigned short biBitCount;
+    unsigned int biCompression;
+    unsigned int biSizeImage;
+    int biXPelsPerMeter;
+    int biYPelsPerMeter;
+    unsigned int biClrUsed;
+    unsigned int biClrImportant;
+
+    unsigned char* save_to_buffer(
+        unsigned char* data) const
+    {
+        data = put_value(biSize, data);
+        data = put_value(biWidth, data);
+        data = put_value(biHeight, data);
+        data = put_value(biPlanes, data);
+        data = put_value(biBitCount, data);
+        data = put_value(biCompression, data);
+        data = put_value(biSizeImage, data);
+        data = put_value(biXPelsPerMeter, data);
+        data = put_value(biYPelsPerMeter, data);
+        data = put_value(biClrUsed, data);
+        data = put_value(biClrImportant, data);
+        return data;
+    }
+
+    void load_from_stream(
+        std::istream& stream)
+    {
+        read_value(biSize, stream);
+        read_value(biWidth, stream);
+        read_value(biHeight, stream);
+        read_value(biPlanes, stream);
+        read_value(biBitCount, stream);
+        read_value(biCompression, stream);
+        read_value(biSizeImage, stream);
+        read_value(biXPelsPerMeter, stream);
+        read_value(biYPelsPerMeter, stream);
+        read_value(biClrUsed, stream);
+        read_value(biClrImportant, stream);
+    }
+
+    bool is_compressed() const
+    {
+        return biCompression != e_rgb;
+    }
+
+    static int get_size()
+    {
+        return 40;
+    }
+}; // class BmpInfoHeader
+
+// Stores a value in big-endian byte order.
+// Returns a pointer past the stored value.
+template<typename T>
+unsigned char* put_be_value(
+    T value,
+    unsigned char* data)
+{
+    for (size_t i = sizeof(T); i > 0; --i) {
+        data[i - 1] = static_cast<unsigned char>(value & 0xFF);
+        value = static_cast<T>(value >> 8);
+    }
+
+    return data + sizeof(T);
+}
+
+unsigned int get_be_u32(
+    const unsigned char* data)
+{
+    return
+        (static_cast<unsigned int>(data[0]) << 24) |
+        (static_cast<unsigned int>(data[1]) << 16) |
+        (static_cast<unsigned int>(data[2]) << 8) |
+        static_cast<unsigned int>(data[3]);
+}
+
+// Updates CRC-32 (ISO 3309) of chunks of a PNG file.
+unsigned int update_crc32(
+    unsigned int crc,
+    const unsigned char* data,
+    size_t size)
+{
+    class Table {
+    public:
+        unsigned int values[256];
+
+        Table()
+        {
+            for (unsigned int i = 0; i < 256; ++i) {
+                unsigned int value = i;
+
+                for (int j = 0; j < 8; ++j) {
+                    if ((value & 1) != 0)
+                        value = 0xEDB88320U ^ (value >> 1);
+                    else
+                        value >>= 1;
+                }
+
+                values[i] = value;
+            }
+        }
+    }; // class Table
+
+    static const Table table;
+
+    crc = ~crc;
+
+    for (size_t i = 0; i < size; ++i)
+        crc = table.values[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+// Updates Adler-32 checksum of a zlib stream.
+unsigned int update_adler32(
+    unsigned int adler,
+    const unsigned char* data,
+    size_t size)
+{
+    unsigned int a = adler & 0xFFFF;
+    unsigned int b = adler >> 16;
+
+    while (size > 0) {
+        // The largest block which can not overflow the sums.
+        size_t block_size = std::min(size, static_cast<size_t>(5552));
+        size -= block_size;
+
+        for (size_t i = 0; i < block_size; ++i) {
+            a += data[i];
+            b += a;
+        }
+
+        data += block_size;
+        a %= 65521;
+        b %= 65521;
+    }
+
+    return (b << 16) | a;
+}
+
+
+// Constants of a deflate stream (RFC 1951).
+//
+
+const int k_deflate_max_bits = 15;
+const int k_deflate_max_code_length_bits = 7;
+const int k_deflate_literal_count = 286;
+const int k_deflate_distance_count = 30;
+const int k_deflate_code_length_count = 19;
+const int k_deflate_end_of_block = 256;
+const int k_deflate_min_match = 3;
+const int k_deflate_max_match = 258;
+const int k_deflate_window_size = 32768;
+
+const int k_deflate_length_bases[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+const int k_deflate_length_extra_bits[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+const int k_deflate_distance_bases[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577
+};
+
+const int k_deflate_distance_extra_bits[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// Order of code lengths of the code length alphabet.
+const int k_deflate_code_length_order[k_deflate_code_length_count] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+
+// Writes bits starting from the least significant one.
+class BitWriter {
+public:
+    explicit BitWriter(
+        Buffer& buffer) :
+            buffer_(buffer),
+            bits_(),
+            bit_count_()
+    {
+    }
+
+    ~BitWriter()
+    {
+    }
+
+    // Writes up to 16 bits.
+    void write(
+        unsigned int value,
+        int count)
+    {
+        bits_ |= value << bit_count_;
+        bit_count_ += count;
+
+        while (bit_count_ >= 8) {
+            buffer_.push_back(static_cast<unsigned char>(bits_ & 0xFF));
+            bits_ >>= 8;
+            bit_count_ -= 8;
+        }
+    }
+
+    // Pads the last byte with zero bits.
+    void flush()
+    {
+        if (bit_count_ > 0) {
+            buffer_.push_back(static_cast<unsigned char>(bits_ & 0xFF));
+            bits_ = 0;
+            bit_count_ = 0;
+        }
+    }
+
+private:
+    Buffer& buffer_;
+    unsigned int bits_;
+    int bit_count_;
+
+    BitWriter(
+        const BitWriter& that);
+
+    BitWriter& operator=(
+        const BitWriter& that);
+}; // class BitWriter
+
+
+} // namespace
+
+
+// Compresses data into a zlib stream (RFC 1950) with a single
+// deflate block of dynamic Huffman codes (RFC 1951). The tables are
+// kept between streams, so encoding a stream no larger than the previous
+// ones does not allocate memory.
+class ZlibEncoder {
+public:
+    ZlibEncoder()
+    {
+    }
+
+    ~ZlibEncoder()
+    {
+    }
+
+    // Appends compressed data to the stream.
+    void encode(
+        const unsigned char* data,
+        int size,
+        Buffer& stream)
+    {
+        assert(data || size == 0);
+        assert(size >= 0);
+
+        find_matches(data, size);
+
+        // Deflate with 32K window; level "default".
+        stream.push_back(0x78);
+        stream.push_back(0x9C);
+
+        BitWriter writer(stream);
+        write_block(writer);
+        writer.flush();
+
+        unsigned char adler[4];
+        put_be_value(update_adler32(1, data, size), adler);
+        stream.insert(stream.end(), adler, adler + 4);
+    }
+
+    // Builds lengths of a Huffman code no longer than max_length bits.
+    // Symbols with zero frequency get zero length.
+    void build_lengths(
+        const std::vector<int>& frequencies,
+        int max_length,
+        std::vector<int>& lengths)
+    {
+        int symbol_count = static_cast<int>(frequencies.size());
+
+        lengths.assign(symbol_count, 0);
+
+        // Leaves in ascending order of frequency.
+        std::vector<std::pair<int, int> >& leaves = leaves_;
+        leaves.clear();
+
+        for (int i = 0; i < symbol_count; ++i) {
+            if (frequencies[i] > 0)
+                leaves.push_back(std::make_pair(frequencies[i], i));
+        }
+
+        int leaf_count = static_cast<int>(leaves.size());
+
+        if (leaf_count == 0)
+            return;
+
+        if (leaf_count == 1) {
+            lengths[leaves[0].second] = 1;
+            return;
+        }
+
+        std::sort(leaves.begin(), leaves.end());
+
+        // Leaves go first, then internal nodes in order of creation,
+        // so the nodes being merged always come from two sorted queues.
+        int node_count = (2 * leaf_count) - 1;
+        std::vector<long>& weights = weights_;
+        std::vector<int>& parents = parents_;
+        weights.assign(node_count, 0);
+        parents.assign(node_count, 0);
+
+        for (int i = 0; i < leaf_count; ++i)
+            weights[i] = leaves[i].first;
+
+        int leaf_index = 0;
+        int node_index = leaf_count;
+
+        for (int i = leaf_count; i < node_count; ++i) {
+            int children[2];
+
+            for (int j = 0; j < 2; ++j) {
+                if (node_index < i &&
+                    (leaf_index == leaf_count ||
+                        weights[node_index] < weights[leaf_index]))
+                {
+                    children[j] = node_index++;
+                } else
+                    children[j] = leaf_index++;
+            }
+
+            weights[i] = weights[children[0]] + weights[children[1]];
+            parents[children[0]] = i;
+            parents[children[1]] = i;
+        }
+
+        std::vector<int>& depths = depths_;
+        depths.assign(node_count, 0);
+
+        for (int i = node_count - 2; i >= 0; --i)
+            depths[i] = depths[parents[i]] + 1;
+
+        // Shorten too long codes, then lengthen the rarest codes
+        // until the code fits, and fill up any free space.
+        long capacity = 1L << max_length;
+        long kraft_sum = 0;
+
+        for (int i = 0; i < leaf_count; ++i) {
+            depths[i] = std::min(depths[i], max_length);
+            kraft_sum += 1L << (max_length - depths[i]);
+        }
+
+        while (kraft_sum > capacity) {
+            int best_index = -1;
+
+            for (int i = 0; i < leaf_count; ++i) {
+                if (depths[i] < max_length &&
+                    (best_index < 0 || depths[i] > depths[best_index]))
+                {
+                    best_index = i;
+                }
+            }
+
+            ++depths[best_index];
+            kraft_sum -= 1L << (max_length - depths[best_index]);
+        }
+
+        for (int i = leaf_count - 1; i >= 0 && kraft_sum < capacity; ) {
+            long gain = 1L << (max_length - depths[i]);
+
+            if (depths[i] > 1 && kraft_sum + gain <= capacity) {
+                --depths[i];
+                kraft_sum += gain;
+            } else
+                --i;
+        }
+
+        for (int i = 0; i < leaf_count; ++i)
+            lengths[leaves[i].second] = depths[i];
+    }
+
+    // Builds canonical codes with reversed bits out of code lengths.
+    static void build_codes(
+        const std::vector<int>& lengths,
+        std::vector<unsigned int>& codes)
+    {
+        int length_counts[k_deflate_max_bits + 1];
+        unsigned int next_codes[k_deflate_max_bits + 1];
+
+        std::fill_n(length_counts, k_deflate_max_bits + 1, 0);
+
+        for (size_t i = 0; i < lengths.size(); ++i)
+            ++length_counts[lengths[i]];
+
+        length_counts[0] = 0;
+
+        unsigned int code = 0;
+
+        for (int i = 1; i <= k_deflate_max_bits; ++i) {
+            code = (code + length_counts[i - 1]) << 1;
+            next_codes[i] = code;
+        }
+
+        codes.assign(lengths.size(), 0);
+
+        for (size_t i = 0; i < lengths.size(); ++i) {
+            int length = lengths[i];
+
+            if (length == 0)
+                continue;
+
+            unsigned int value = next_codes[length]++;
+            unsigned int reversed_value = 0;
+
+            for (int j = 0; j < length; ++j) {
+                reversed_value = (reversed_value << 1) | (value & 1);
+                value >>= 1;
+            }
+
+            codes[i] = reversed_value;
+        }
+    }
+
+private:
+    // A literal if length is zero, or a match.
+    class Token {
+    public:
+        unsigned short length;
+        unsigned short value; // literal or distance
+
+        Token(
+            int length,
+            int value) :
+                length(static_cast<unsigned short>(length)),
+                value(static_cast<unsigned short>(value))
+        {
+        }
+    }; // class Token
+
+    typedef std::vector<Token> Tokens;
+    typedef std::vector<int> Ints;
+    typedef std::vector<unsigned int> Codes;
+
+    static const int k_hash_bits = 15;
+    static const int k_max_chain_length = 128;
+
+    Tokens tokens_;
+
+    // Hash chains of find_matches.
+    Ints heads_;
+    Ints previous_;
+
+    // Codes of write_block.
+    Ints literal_frequencies_;
+    Ints distance_frequencies_;
+    Ints code_length_frequencies_;
+    Ints literal_lengths_;
+    Ints distance_lengths_;
+    Ints code_length_lengths_;
+    Ints all_lengths_;
+    Ints symbols_;
+    Codes literal_codes_;
+    Codes distance_codes_;
+    Codes code_length_codes_;
+
+    // Trees of build_lengths.
+    std::vector<std::pair<int, int> > leaves_;
+    std::vector<long> weights_;
+    Ints parents_;
+    Ints depths_;
+
+    ZlibEncoder(
+        const ZlibEncoder& that);
+
+    ZlibEncoder& operator=(
+        const ZlibEncoder& that);
+
+    static int get_hash(
+        const unsigned char* data)
+    {
+        return
+            ((data[0] << 10) ^ (data[1] << 5) ^ data[2]) &
+            ((1 << k_hash_bits) - 1);
+    }
+
+    // Finds the longest code with a base not greater than the value.
+    static int find_code(
+        const int* bases,
+        int base_count,
+        int value)
+    {
+        return static_cast<int>(
+            std::upper_bound(bases, bases + base_count, value) - bases) - 1;
+    }
+
+    // Splits data into literals and matches (greedy LZ77 over hash chains).
+    void find_matches(
+        const unsigned char* data,
+        int size)
+    {
+        tokens_.clear();
+
+        Ints& heads = heads_;
+        Ints& previous = previous_;
+        heads.assign(1 << k_hash_bits, -1);
+        previous.assign(size, -1);
+
+        int position = 0;
+
+        while (position < size) {
+            int max_length = std::min(k_deflate_max_match, size - position);
+            int best_length = 0;
+            int best_distance = 0;
+
+            if (max_length >= k_deflate_min_match) {
+                int hash = get_hash(&data[position]);
+                int candidate = heads[hash];
+
+                for (int chain_length = 0;
+                    candidate >= 0 &&
+                        chain_length < k_max_chain_length &&
+                        (position - candidate) <= k_deflate_window_size;
+                    ++chain_length)
+                {
+                    if (data[candidate + best_length] ==
+                        data[position + best_length])
+                    {
+                        int length = 0;
+
+                        while (length < max_length &&
+                            data[candidate + length] == data[position + length])
+                        {
+                            ++length;
+                        }
+
+                        if (length > best_length) {
+                            best_length = length;
+                            best_distance = position - candidate;
+
+                            if (length == max_length)
+                                break;
+                        }
+                    }
+
+                    candidate = previous[candidate];
+                }
+
+                previous[position] = heads[hash];
+                heads[hash] = position;
+            }
+
+            if (best_length < k_deflate_min_match) {
+                tokens_.push_back(Token(0, data[position]));
+                ++position;
+                continue;
+            }
+
+            tokens_.push_back(Token(best_length, best_distance));
+
+            int end_position = position + best_length;
+
+            for (++position; position < end_position; ++position) {
+                if ((size - position) >= k_deflate_min_match) {
+                    int hash = get_hash(&data[position]);
+                    previous[position] = heads[hash];
+                    heads[hash] = position;
+                }
+            }
+        }
+    }
+
+    // Makes sure a code has at least two symbols.
+    static void add_dummy_symbols(
+        std::vector<int>& frequencies)
+    {
+        int used_count = 0;
+
+        for (size_t i = 0; i < frequencies.size(); ++i) {
+            if (frequencies[i] > 0)
+                ++used_count;
+        }
+
+        for (size_t i = 0; i < frequencies.size() && used_count < 2; ++i) {
+            if (frequencies[i] == 0) {
+                frequencies[i] = 1;
+                ++used_count;
+            }
+        }
+    }
+
+    void write_block(
+        BitWriter& writer)
+    {
+        Ints& literal_frequencies = literal_frequencies_;
+        Ints& distance_frequencies = distance_frequencies_;
+        literal_frequencies.assign(k_deflate_literal_count, 0);
+        distance_frequencies.assign(k_deflate_distance_count, 0);
+
+        for (Tokens::const_iterator i = tokens_.begin();
+            i != tokens_.end(); ++i)
+        {
+            if (i->length == 0)
+                ++literal_frequencies[i->value];
+            else {
+                ++literal_frequencies[257 +
+                    find_code(k_deflate_length_bases, 29, i->length)];
+                ++distance_frequencies[
+                    find_code(k_deflate_distance_bases, 30, i->value)];
+            }
+        }
+
+        ++literal_frequencies[k_deflate_end_of_block];
+
+        add_dummy_symbols(literal_frequencies);
+        add_dummy_symbols(distance_frequencies);
+
+        Ints& literal_lengths = literal_lengths_;
+        Ints& distance_lengths = distance_lengths_;
+
+        build_lengths(
+            literal_frequencies, k_deflate_max_bits, literal_lengths);
+        build_lengths(
+            distance_frequencies, k_deflate_max_bits, distance_lengths);
+
+        int literal_count = k_deflate_literal_count;
+
+        while (literal_count > 257 && literal_lengths[literal_count - 1] == 0)
+            --literal_count;
+
+        int distance_count = k_deflate_distance_count;
+
+        while (distance_count > 1 && distance_lengths[distance_count - 1] == 0)
+            --distance_count;
+
+        // Run-length encode both sets of code lengths together.
+        Ints& all_lengths = all_lengths_;
+        all_lengths.assign(
+            literal_lengths.begin(), literal_lengths.begin() + literal_count);
+
+        all_lengths.insert(
+            all_lengths.end(),
+            distance_lengths.begin(),
+            distance_lengths.begin() + distance_count);
+
+        Ints& symbols = symbols_; // pairs of a symbol and its extra bits
+        Ints& code_length_frequencies = code_length_frequencies_;
+        symbols.clear();
+        code_length_frequencies.assign(k_deflate_code_length_count, 0);
+
+        int total_count = static_cast<int>(all_lengths.size());
+
+        for (int i = 0; i < total_count; ) {
+            int length = all_lengths[i];
+            int run_length = 1;
+
+            while ((i + run_length) < total_count &&
+                all_lengths[i + run_length] == length)
+            {
+                ++run_length;
+            }
+
+            if (length == 0 && run_length >= 11) {
+                run_length = std::min(run_length, 138);
+                symbols.push_back(18);
+                symbols.push_back(run_length - 11);
+            } else if (length == 0 && run_length >= 3) {
+                symbols.push_back(17);
+                symbols.push_back(run_length - 3);
+            } else if (length != 0 && run_length >= 4) {
+                // The first one goes as is, the rest repeat it.
+                run_length = std::min(run_length, 7);
+                symbols.push_back(length);
+                symbols.push_back(0);
+                symbols.push_back(16);
+                symbols.push_back(run_length - 4);
+                ++code_length_frequencies[length];
+            } else {
+                run_length = 1;
+                symbols.push_back(length);
+                symbols.push_back(0);
+            }
+
+            ++code_length_frequencies[symbols[symbols.size() - 2]];
+            i += run_length;
+        }
+
+        add_dummy_symbols(code_length_frequencies);
+
+        Ints& code_length_lengths = code_length_lengths_;
+
+        build_lengths(
+            code_length_frequencies,
+            k_deflate_max_code_length_bits,
+            code_length_lengths);
+
+        int code_length_count = k_deflate_code_length_count;
+
+        while (code_length_count > 4 &&
+            code_length_lengths[
+                k_deflate_code_length_order[code_length_count - 1]] == 0)
+        {
+            --code_length_count;
+        }
+
+        Codes& literal_codes = literal_codes_;
+        Codes& distance_codes = distance_codes_;
+        Codes& code_length_codes = code_length_codes_;
+
+        build_codes(literal_lengths, literal_codes);
+        build_codes(distance_lengths, distance_codes);
+        build_codes(code_length_lengths, code_length_codes);
+
+        // Header of the last block with dynamic codes.
+        writer.write(1, 1);
+        writer.write(2, 2);
+        writer.write(literal_count - 257, 5);
+        writer.write(distance_count - 1, 5);
+        writer.write(code_length_count - 4, 4);
+
+        for (int i = 0; i < code_length_count; ++i) {
+            writer.write(
+                code_length_lengths[k_deflate_code_length_order[i]], 3);
+        }
+
+        for (size_t i = 0; i < symbols.size(); i += 2) {
+            int symbol = symbols[i];
+
+            writer.write(
+                code_length_codes[symbol], code_length_lengths[symbol]);
+
+            switch (symbol) {
+            case 16:
+                writer.write(symbols[i + 1], 2);
+                break;
+
+            case 17:
+                writer.write(symbols[i + 1], 3);
+                break;
+
+            case 18:
+                writer.write(symbols[i + 1], 7);
+                break;
+            }
+        }
+
+        for (Tokens::const_iterator i = tokens_.begin();
+            i != tokens_.end(); ++i)
+        {
+            if (i->length == 0) {
+                writer.write(
+                    literal_codes[i->value], literal_lengths[i->value]);
+                continue;
+            }
+
+            int length_code = find_code(k_deflate_length_bases, 29, i->length);
+            int symbol = 257 + length_code;
+
+            writer.write(literal_codes[symbol], literal_lengths[symbol]);
+            writer.write(
+                i->length - k_deflate_length_bases[length_code],
+                k_deflate_length_extra_bits[length_code]);
+
+            int distance_code =
+                find_code(k_deflate_distance_bases, 30, i->value);
+
+            writer.write(
+                distance_codes[distance_code],
+                distance_lengths[distance_code]);
+            writer.write(
+                i->value - k_deflate_distance_bases[distance_code],
+                k_deflate_distance_extra_bits[distance_code]);
+        }
+
+        writer.write(
+            literal_codes[k_deflate_end_of_block],
+            literal_lengths[k_deflate_end_of_block]);
+    }
+}; // class ZlibEncoder
+
+
+namespace {
+
+
+// Decompresses a zlib stream (RFC 1950, 1951).
+class ZlibDecoder {
+public:
+    ZlibDecoder() :
+        data_(),
+        size_(),
+        offset_(),
+        bits_(),
+        bit_count_(),
+        max_size_(),
+        output_()
+    {
+    }
+
+    ~ZlibDecoder()
+    {
+    }
+
+    // Returns false if the stream is malformed or decompressed data
+    // does not fit into max_size bytes.
+    bool decode(
+        const unsigned char* data,
+        size_t size,
+        size_t max_size,
+        Buffer& output)
+    {
+        data_ = data;
+        size_ = size;
+        offset_ = 2;
+        bits_ = 0;
+        bit_count_ = 0;
+        max_size_ = max_size;
+        output_ = &output;
+
+        output.clear();
+
+        if (size < 6)
+            return false;
+
+        int method = data[0] & 0x0F;
+        int window_bits = (data[0] >> 4) + 8;
+        bool has_dictionary = ((data[1] & 0x20) != 0);
+
+        if (method != 8 || window_bits > 15 || has_dictionary ||
+            (((data[0] << 8) | data[1]) % 31) != 0)
+        {
+            return false;
+        }
+
+        bool is_last_block = false;
+
+        while (!is_last_block) {
+            int value;
+
+            if (!read_bits(1, value))
+                return false;
+
+            is_last_block = (value != 0);
+
+            if (!read_bits(2, value))
+                return false;
+
+            bool is_succeed = false;
+
+            switch (value) {
+            case 0:
+                is_succeed = decode_stored_block();
+                break;
+
+            case 1:
+                is_succeed = decode_fixed_block();
+                break;
+
+            case 2:
+                is_succeed = decode_dynamic_block();
+                break;
+            }
+
+            if (!is_succeed)
+                return false;
+        }
+
+        // Adler-32 follows the last byte of deflate data.
+        if ((size_ - offset_) < 4)
+            return false;
+
+        unsigned int adler = update_adler32(
+            1, output.empty() ? NULL : &output[0], output.size());
+
+        return get_be_u32(&data_[offset_]) == adler;
+    }
+
+private:
+    // A canonical Huffman code.
+    class Code {
+    public:
+        int counts[k_deflate_max_bits + 1]; // number of codes of each length
+        int symbols[k_deflate_literal_count + 2]; // ordered by code
+
+        // Returns false if the lengths are over-subscribed.
+        bool build(
+            const int* lengths,
+            int count)
+        {
+            std::fill_n(counts, k_deflate_max_bits + 1, 0);
+
+            for (int i = 0; i < count; ++i)
+                ++counts[lengths[i]];
+
+            int left = 1;
+
+            for (int i = 1; i <= k_deflate_max_bits; ++i) {
+                left = (left << 1) - counts[i];
+
+                if (left < 0)
+                    return false;
+            }
+
+            int offsets[k_deflate_max_bits + 1];
+            offsets[1] = 0;
+
+            for (int i = 1; i < k_deflate_max_bits; ++i)
+                offsets[i + 1] = offsets[i] + counts[i];
+
+            for (int i = 0; i < count; ++i) {
+                if (lengths[i] != 0)
+                    symbols[offsets[lengths[i]]++] = i;
+            }
+
+            return true;
+        }
+    }; // class Code
+
+    const unsigned char* data_;
+    size_t size_;
+    size_t offset_;
+    unsigned int bits_;
+    int bit_count_;
+    size_t max_size_;
+    Buffer* output_;
+
+    ZlibDecoder(
+        const ZlibDecoder& that);
+
+    ZlibDecoder& operator=(
+        const ZlibDecoder& that);
+
+    bool read_bits(
+        int count,
+        int& value)
+    {
+        while (bit_count_ < count) {
+            if (offset_ == size_)
+                return false;
+
+            bits_ |= static_cast<unsigned int>(data_[offset_++]) << bit_count_;
+            bit_count_ += 8;
+        }
+
+        value = static_cast<int>(bits_ & ((1U << count) - 1));
+        bits_ >>= count;
+        bit_count_ -= count;
+
+        return true;
+    }
+
+    bool read_symbol(
+        const Code& code,
+        int& symbol)
+    {
+        int value = 0; // bits of a code so far
+        int first = 0; // the first code of the current length
+        int index = 0; // index of the first code of the current length
+
+        for (int i = 1; i <= k_deflate_max_bits; ++i) {
+            int bit;
+
+            if (!read_bits(1, bit))
+                return false;
+
+            value |= bit;
+
+            int count = code.counts[i];
+
+            if ((value - first) < count) {
+                symbol = code.symbols[index + (value - first)];
+                return true;
+            }
+
+            index += count;
+            first = (first + count) << 1;
+            value <<= 1;
+        }
+
+        return false;
+    }
+
+    bool decode_stored_block()
+    {
+        // Skip to a byte boundary.
+        bits_ = 0;
+        bit_count_ = 0;
+
+        if ((size_ - offset_) < 4)
+            return false;
+
+        int length = data_[offset_] | (data_[offset_ + 1] << 8);
+        int inverted_length = data_[offset_ + 2] | (data_[offset_ + 3] << 8);
+        offset_ += 4;
+
+        if (length != (~inverted_length & 0xFFFF))
+            return false;
+
+        if ((size_ - offset_) < static_cast<size_t>(length) ||
+            (max_size_ - output_->size()) < static_cast<size_t>(length))
+        {
+            return false;
+        }
+
+        output_->insert(
+            output_->end(), &data_[offset_], &data_[offset_] + length);
+        offset_ += length;
+
+        return true;
+    }
+
+    bool decode_fixed_block()
+    {
+        int lengths[k_deflate_literal_count + 2];
+
+        std::fill_n(&lengths[0], 144, 8);
+        std::fill_n(&lengths[144], 112, 9);
+        std::fill_n(&lengths[256], 24, 7);
+        std::fill_n(&lengths[280], 8, 8);
+
+        Code literal_code;
+        literal_code.build(lengths, k_deflate_literal_count + 2);
+
+        std::fill_n(lengths, k_deflate_distance_count, 5);
+
+        Code distance_code;
+        distance_code.build(lengths, k_deflate_distance_count);
+
+        return decode_codes(literal_code, distance_code);
+    }
+
+    bool decode_dynamic_block()
+    {
+        int literal_count;
+        int distance_count;
+        int code_length_count;
+
+        if (!read_bits(5, literal_count) ||
+            !read_bits(5, distance_count) ||
+            !read_bits(4, code_length_count))
+        {
+            return false;
+        }
+
+        literal_count += 257;
+        distance_count += 1;
+        code_length_count += 4;
+
+        if (literal_count > k_deflate_literal_count ||
+            distance_count > k_deflate_distance_count)
+        {
+            return false;
+        }
+
+        int lengths[k_deflate_literal_count + k_deflate_distance_count];
+
+        std::fill_n(lengths, k_deflate_code_length_count, 0);
+
+        for (int i = 0; i < code_length_count; ++i) {
+            if (!read_bits(3, lengths[k_deflate_code_length_order[i]]))
+                return false;
+        }
+
+        Code code_length_code;
+
+        if (!code_length_code.build(lengths, k_deflate_code_length_count))
+            return false;
+
+        int total_count = literal_count + distance_count;
+
+        for (int i = 0; i < total_count; ) {
+            int symbol;
+
+            if (!read_symbol(code_length_code, symbol))
+                return false;
+
+            if (symbol < 16) {
+                lengths[i++] = symbol;
+                continue;
+            }
+
+            int length = 0;
+            int repeat_count;
+
+            if (symbol == 16) {
+                if (i == 0)
+                    return false;
+
+                length = lengths[i - 1];
+
+                if (!read_bits(2, repeat_count))
+                    return false;
+
+                repeat_count += 3;
+            } else if (symbol == 17) {
+                if (!read_bits(3, repeat_count))
+                    return false;
+
+                repeat_count += 3;
+            } else {
+                if (!read_bits(7, repeat_count))
+                    return false;
+
+                repeat_count += 11;
+            }
+
+            if ((i + repeat_count) > total_count)
+                return false;
+
+            std::fill_n(&lengths[i], repeat_count, length);
+            i += repeat_count;
+        }
+
+        if (lengths[k_deflate_end_of_block] == 0)
+            return false;
+
+        Code literal_code;
+        Code distance_code;
+
+        if (!literal_code.build(lengths, literal_count) ||
+            !distance_code.build(&lengths[literal_count], distance_count))
+        {
+            return false;
+        }
+
+        return decode_codes(literal_code, distance_code);
+    }
+
+    bool decode_codes(
+        const Code& literal_code,
+        const Code& distance_code)
+    {
+        Buffer& output = *output_;
+
+        while (true) {
+            int symbol;
+
+            if (!read_symbol(literal_code, symbol))
+                return false;
+
+            if (symbol == k_deflate_end_of_block)
+                return true;
+
+            if (output.size() == max_size_)
+                return false;
+
+            if (symbol < 256) {
+                output.push_back(static_cast<unsigned char>(symbol));
+                continue;
+            }
+
+            symbol -= 257;
+
+            if (symbol >= 29)
+                return false;
+
+            int extra_value;
+
+            if (!read_bits(k_deflate_length_extra_bits[symbol], extra_value))
+                return false;
+
+            int length = k_deflate_length_bases[symbol] + extra_value;
+
+            if (!read_symbol(distance_code, symbol) ||
+                symbol >= k_deflate_distance_count ||
+                !read_bits(k_deflate_distance_extra_bits[symbol], extra_value))
+            {
+                return false;
+            }
+
+            size_t distance = k_deflate_distance_bases[symbol] + extra_value;
+
+            if (distance > output.size() ||
+                (max_size_ - output.size()) < static_cast<size_t>(length))
+            {
+                return false;
+            }
+
+            // Byte by byte since a match may overlap itself.
+            size_t source = output.size() - distance;
+
+            for (int i = 0; i < length; ++i)
+                output.push_back(output[source + i]);
+        }
+    }
+}; // class ZlibDecoder
+
+const unsigned char k_png_signature[8] = {
+    0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'
+};
+
+// Appends a chunk with its length and CRC to a PNG file.
+void append_png_chunk(
+    const char* type,
+    const unsigned char* data,
+    size_t size,
+    Buffer& png_file)
+{
+    unsigned char prefix[8];
+    put_be_value(static_cast<unsigned int>(size), prefix);
+    std::copy(type, type + 4, &prefix[4]);
+
+    png_file.insert(png_file.end(), prefix, prefix + 8);
+
+    if (size > 0)
+        png_file.insert(png_file.end(), data, data + size);
+
+    unsigned int crc = update_crc32(0, &prefix[4], 4);
+    crc = update_crc32(crc, data, size);
+
+    unsigned char suffix[4];
+    put_be_value(crc, suffix);
+
+    png_file.insert(png_file.end(), suffix, suffix + 4);
+}
+
+#ifdef UW2_GR_TOOL_AVX2
+bool has_avx2()
+{
+#ifdef UW2_GR_TOOL_SIMD_DISPATCH
+    static const bool result = (__builtin_cpu_supports("avx2") != 0);
+    return result;
+#else
+    return true;
+#endif // UW2_GR_TOOL_SIMD_DISPATCH
+}
+
+// Expands 64 nibbles at a time; returns the number of expanded ones.
+UW2_GR_TOOL_TARGET("avx2")
+int unpack_nibbles_avx2(
+    const unsigned char* src,
+    int count,
+    const AuxPalette& colors,
+    unsigned char* buffer)
+{
+    const __m256i table = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(colors)));
+
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+
+    int unpacked_count = 0;
+
+    for ( ; (count - unpacked_count) >= 64; unpacked_count += 64) {
+        __m256i octets = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i*>(src));
+
+        __m256i high = _mm256_and_si256(
+            _mm256_srli_epi16(octets, 4), mask);
+
+        __m256i low = _mm256_and_si256(octets, mask);
+
+        // Interleaving is done within 128-bit lanes, so pixels
+        // are in order 0-15, 32-47 and 16-31, 48-63.
+        __m256i first = _mm256_shuffle_epi8(
+            table, _mm256_unpacklo_epi8(high, low));
+
+        __m256i second = _mm256_shuffle_epi8(
+            table, _mm256_unpackhi_epi8(high, low));
+
+        _mm256_storeu_si256(
+            reinterpret_cast<__m256i*>(buffer),
+            _mm256_permute2x128_si256(first, second, 0x20));
+
+        _mm256_storeu_si256(
+            reinterpret_cast<__m256i*>(buffer + 32),
+            _mm256_permute2x128_si256(first, second, 0x31));
+
+        src += 32;
+        buffer += 64;
+    }
+
+    return unpacked_count;
+}
+#endif // UW2_GR_TOOL_AVX2
+
+#ifdef UW2_GR_TOOL_SSSE3
+bool has_ssse3()
+{
+#ifdef UW2_GR_TOOL_SIMD_DISPATCH
+    static const bool result = (__builtin_cpu_supports("ssse3") != 0);
+    return result;
+#else
+    return true;
+#endif // UW2_GR_TOOL_SIMD_DISPATCH
+}
+
+// Expands 32 nibbles at a time; returns the number of expanded ones.
+UW2_GR_TOOL_TARGET("ssse3")
+int unpack_nibbles_ssse3(
+    const unsigned char* src,
+    int count,
+    const AuxPalette& colors,
+    unsigned char* buffer)
+{
+    const __m128i table =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(colors));
+
+    const __m128i mask = _mm_set1_epi8(0x0F);
+
+    int unpacked_count = 0;
+
+    for ( ; (count - unpacked_count) >= 32; unpacked_count += 32) {
+        __m128i octets =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+
+        __m128i high = _mm_and_si128(_mm_srli_epi16(octets, 4), mask);
+        __m128i low = _mm_and_si128(octets, mask);
+
+        _mm_storeu_si128(
+            reinterpret_cast<__m128i*>(buffer),
+            _mm_shuffle_epi8(table, _mm_unpacklo_epi8(high, low)));
+
+        _mm_storeu_si128(
+            reinterpret_cast<__m128i*>(buffer + 16),
+            _mm_shuffle_epi8(table, _mm_unpackhi_epi8(high, low)));
+
+        src += 16;
+        buffer += 32;
+    }
+
+    return unpacked_count;
+}
+#endif // UW2_GR_TOOL_SSSE3
+
+// Expands packed 4-bit pixels (the high nibble goes first) starting at
+// a nibble offset into colors of an auxiliary palette.
+void unpack_nibbles(
+    const unsigned char* data,
+    int nibble_offset,
+    int count,
+    const AuxPalette& colors,
+    unsigned char* buffer)
+{
+    if (count <= 0)
+        return;
+
+    if ((nibble_offset % 2) != 0) {
+        *buffer++ = colors[data[nibble_offset / 2] & 0x0F];
+        ++nibble_offset;
+        --count;
+    }
+
+    const unsigned char* src = &data[nibble_offset / 2];
+
+    // The palette fits into a register, so a byte shuffle looks up
+    // 16 (32 with AVX2) colors at once.
+#ifdef UW2_GR_TOOL_AVX2
+    if (count >= 64 && has_avx2()) {
+        int unpacked_count =
+            unpack_nibbles_avx2(src, count, colors, buffer);
+
+        src += unpacked_count / 2;
+        buffer += unpacked_count;
+        count -= unpacked_count;
+    }
+#endif // UW2_GR_TOOL_AVX2
+
+#ifdef UW2_GR_TOOL_SSSE3
+    if (count >= 32 && has_ssse3()) {
+        int unpacked_count =
+            unpack_nibbles_ssse3(src, count, colors, buffer);
+
+        src += unpacked_count / 2;
+        buffer += unpacked_count;
+        count -= unpacked_count;
+    }
+#endif // UW2_GR_TOOL_SSSE3
+
+    for ( ; count >= 2; count -= 2) {
+        int octet = *src++;
+        *buffer++ = colors[octet >> 4];
+        *buffer++ = colors[octet & 0x0F];
+    }
+
+    if (count != 0)
+        *buffer = colors[*src >> 4];
+}
+
+// Reads nibbles without checking the bounds; the data must have them
+// (see Bitmap::load_from_gr).
+class NibbleReader {
+public:
+    explicit NibbleReader(
+        const unsigned char* data) :
+            nibble_index_(2),
+            data_(data),
+            data_offset_()
+    {
+        assert(data);
+    }
+
+    ~NibbleReader()
+    {
+    }
+
+    unsigned char read()
+    {
+        if (nibble_index_ == 2) {
+            unsigned char octet = data_[data_offset_];
+            nibble_buffer_[0] = octet >> 4;
+            nibble_buffer_[1] = octet & 0x0F;
+            nibble_index_ = 0;
+            ++data_offset_;
+        }
+
+        unsigned char result = nibble_buffer_[nibble_index_];
+
+        ++nibble_index_;
+
+        return result;
+    }
+
+private:
+    int nibble_index_;
+    unsigned char nibble_buffer_[2];
+    const unsigned char* data_;
+    int data_offset_;
+
+    NibbleReader(
+        const NibbleReader& that);
+
+    NibbleReader& operator=(
+        const NibbleReader& that);
+}; // class NibbleReader
+
+class NibbleWriter {
+public:
+    NibbleWriter(
+        Buffer& data) :
+            data_(data),
+            nibble_count_()
+    {
+        data_.clear();
+    }
+
+    ~NibbleWriter()
+    {
+    }
+
+    void write(
+        int nibble)
+    {
+        if ((nibble_count_ % 2) == 0)
+            data_.push_back(static_cast<unsigned char>(nibble << 4));
+        else
+            data_.back() |= static_cast<unsigned char>(nibble & 0x0F);
+
+        ++nibble_count_;
+    }
+
+    int get_nibble_count() const
+    {
+        return nibble_count_;
+    }
+
+private:
+    Buffer& data_;
+    int nibble_count_;
+
+    NibbleWriter(
+        const NibbleWriter& that);
+
+    NibbleWriter& operator=(
+        const NibbleWriter& that);
+}; // class NibbleWriter
+
+// Encodes nibbles into type 8 records (see Bitmap::decompress_rle).
+//
+// The stream alternates repeat and run records, starting with a repeat
+// one. A repeat record with count 1 is skipped, and the one with count 2
+// introduces several repeat records in a row. The encoder picks records
+// by dynamic programming over the pixels. The result is near-optimal,
+// not the shortest stream: a repeat longer than 0xF pixels is tried only
+// with the longest count of each count size, and a multiple repeat chain
+// is chosen by its records only (the length of the chain's own count is
+// estimated afterwards).
+class NibbleRleEncoder {
+public:
+    NibbleRleEncoder()
+    {
+    }
+
+    ~NibbleRleEncoder()
+    {
+    }
+
+    // Returns a number of encoded nibbles or zero if the data does not fit
+    // into the 16-bit size field.
+    int encode(
+        const unsigned char* nibbles,
+        int nibble_count,
+        Buffer& data)
+    {
+        assert(nibbles);
+        assert(nibble_count > 0);
+
+        plan(nibbles, nibble_count);
+
+        if (repeat_cost_[0] > k_max_data_size)
+            return 0;
+
+        NibbleWriter writer(data);
+
+        bool is_repeat = true;
+
+        for (int i = 0; i < nibble_count; ) {
+            if (!is_repeat) {
+                int run_end = run_end_[i];
+
+                write_count(writer, run_end - i);
+
+                for ( ; i < run_end; ++i)
+                    writer.write(nibbles[i]);
+
+                is_repeat = true;
+                continue;
+            }
+
+            int count = repeat_choice_[i];
+
+            if (count == k_skip) {
+                write_count(writer, 1);
+            } else if (count == k_multi) {
+                write_count(writer, 2);
+                write_count(writer, chain_length_[i]);
+
+                for (int n = chain_length_[i]; n > 0; --n) {
+                    int chain_count = chain_choice_[i];
+
+                    write_count(writer, chain_count);
+                    writer.write(nibbles[i]);
+                    i += chain_count;
+                }
+            } else {
+                write_count(writer, count);
+                writer.write(nibbles[i]);
+                i += count;
+            }
+
+            is_repeat = false;
+        }
+
+        assert(writer.get_nibble_count() == repeat_cost_[0]);
+
+        return writer.get_nibble_count();
+    }
+
+private:
+    static const int k_infinity = 0x3FFFFFFF;
+    static const int k_max_count = 0xFFF;
+    static const int k_max_data_size = 0xFFFF;
+    static const int k_skip = 1;
+    static const int k_multi = 2;
+    static const int k_class_count = 3;
+
+    typedef std::vector<int> Ints;
+
+    // Indexed by a position in the input; the last element is the end.
+    Ints run_cost_;
+    Ints run_end_;
+    Ints repeat_cost_;
+    Ints repeat_choice_;
+    Ints chain_cost_;
+    Ints chain_choice_;
+    Ints chain_length_;
+    Ints span_;
+    Ints window_[k_class_count];
+
+    static int get_count_size(
+        int count)
+    {
+        if (count < 0x10)
+            return 1;
+        else if (count < 0x100)
+            return 3;
+        else
+            return 6;
+    }
+
+    static void write_count(
+        NibbleWriter& writer,
+        int count)
+    {
+        assert(count > 0 && count <= k_max_count);
+
+        if (count >= 0x100) {
+            writer.write(0);
+            writer.write(0);
+            writer.write(0);
+            writer.write(count >> 8);
+            writer.write((count >> 4) & 0x0F);
+            writer.write(count & 0x0F);
+        } else if (count >= 0x10) {
+            writer.write(0);
+            writer.write(count >> 4);
+            writer.write(count & 0x0F);
+        } else
+            writer.write(count);
+    }
+
+    void plan(
+        const unsigned char* nibbles,
+        int nibble_count)
+    {
+        static const int max_counts[k_class_count] = {
+            0xF, 0xFF, k_max_count
+        };
+
+        int n = nibble_count;
+
+        run_cost_.assign(n + 1, 0);
+        run_end_.assign(n + 1, n);
+        repeat_cost_.assign(n + 1, 0);
+        repeat_choice_.assign(n + 1, k_skip);
+        chain_cost_.assign(n + 1, k_infinity);
+        chain_choice_.assign(n + 1, 0);
+        chain_length_.assign(n + 1, 0);
+        span_.assign(n + 1, 0);
+
+        // Sliding windows over "repeat_cost_[j] + j" for run records
+        // of every count size.
+        int heads[k_class_count];
+        int tails[k_class_count];
+
+        for (int k = 0; k < k_class_count; ++k) {
+            window_[k].resize(n + 1);
+            heads[k] = 0;
+            tails[k] = 0;
+        }
+
+        for (int i = n - 1; i >= 0; --i) {
+            span_[i] = 1;
+
+            if ((i + 1) < n && nibbles[i] == nibbles[i + 1] &&
+                span_[i + 1] < k_max_count)
+            {
+                span_[i] += span_[i + 1];
+            }
+
+            // Run record.
+            //
+            int j = i + 1;
+            int j_cost = repeat_cost_[j] + j;
+
+            run_cost_[i] = k_infinity;
+
+            for (int k = 0; k < k_class_count; ++k) {
+                Ints& window = window_[k];
+
+                while (tails[k] > heads[k] &&
+                    (repeat_cost_[window[tails[k] - 1]] +
+                        window[tails[k] - 1]) >= j_cost)
+                {
+                    --tails[k];
+                }
+
+                window[tails[k]++] = j;
+
+                while (window[heads[k]] > i + max_counts[k])
+                    ++heads[k];
+
+                int best_j = window[heads[k]];
+
+                int cost = get_count_size(max_counts[k]) +
+                    repeat_cost_[best_j] + best_j - i;
+
+                if (cost < run_cost_[i]) {
+                    run_cost_[i] = cost;
+                    run_end_[i] = best_j;
+                }
+            }
+
+            // Repeat records.
+            //
+            int span = span_[i];
+
+            repeat_cost_[i] = 1 + run_cost_[i];
+            repeat_choice_[i] = k_skip;
+
+            if (span < 3)
+                continue;
+
+            for (int c = 3; c <= span; ) {
+                int count_cost = get_count_size(c) + 1;
+
+                // A single record.
+                int cost = count_cost + run_cost_[i + c];
+
+                if (cost < repeat_cost_[i]) {
+                    repeat_cost_[i] = cost;
+                    repeat_choice_[i] = c;
+                }
+
+                // A record of a chain.
+                int tail_cost = run_cost_[i + c];
+                int chain_length = 1;
+
+                if ((i + c) == n)
+                    tail_cost = 0;
+                else if (chain_length_[i + c] < k_max_count &&
+                    chain_cost_[i + c] < tail_cost)
+                {
+                    tail_cost = chain_cost_[i + c];
+                    chain_length += chain_length_[i + c];
+                }
+
+                cost = count_cost + tail_cost;
+
+                if (cost < chain_cost_[i]) {
+                    chain_cost_[i] = cost;
+                    chain_choice_[i] = c;
+                    chain_length_[i] = chain_length;
+                }
+
+                // Shorter records only make sense within the smallest
+                // count size; otherwise only the longest one is tried.
+                if (c < 0xF && c < span)
+                    ++c;
+                else if (c < span)
+                    c = std::min(span, c < 0xFF ? 0xFF : k_max_count);
+                else
+                    break;
+            }
+
+            if (chain_length_[i] > 1) {
+                int cost = 1 + get_count_size(chain_length_[i]) +
+                    chain_cost_[i];
+
+                if (cost < repeat_cost_[i]) {
+                    repeat_cost_[i] = cost;
+                    repeat_choice_[i] = k_multi;
+                }
+            }
+        }
+    }
+
+    NibbleRleEncoder(
+        const NibbleRleEncoder& that);
+
+    NibbleRleEncoder& operator=(
+        const NibbleRleEncoder& that);
+}; // class NibbleRleEncoder
+
+const int NibbleRleEncoder::k_infinity;
+const int NibbleRleEncoder::k_max_count;
+const int NibbleRleEncoder::k_max_data_size;
+const int NibbleRleEncoder::k_skip;
+const int NibbleRleEncoder::k_multi;
+const int NibbleRleEncoder::k_class_count;
+
+// In order of processing of a data directory.
+constexpr Resource k_resources[] = {
+    { "3DWIN.GR", 0, false },
+    { "ANIMO.GR", 0, false },
+    { "ARMOR_F.GR", 0, false },
+    { "ARMOR_M.GR", 0, false },
+    { "BODIES.GR", 0, false },
+    { "BUTTONS.GR", 0, false },
+    { "CHAINS.GR", 0, false },
+    { "CHARHEAD.GR", 0, false },
+    { "CHRBTNS.GR", 3, false },
+    { "COMPASS.GR", 0, false },
+    { "CONVERSE.GR", 0, false },
+    { "CURSORS.GR", 0, false },
+    { "DOORS.GR", 0, false },
+    { "DRAGONS.GR", 0, false },
+    { "EYES.GR", 0, false },
+    { "FLASKS.GR", 0, false },
+    { "GEMPT.GR", 0, false },
+    { "GENHEAD.GR", 0, false },
+    { "GHED.GR", 0, false },
+    { "HEADS.GR", 0, false },
+    { "INV.GR", 0, false },
+    { "LFTI.GR", 0, false },
+    { "OBJECTS.GR", 0, false },
+    { "OPBTN.GR", 2, false },
+    { "OPTB.GR", 0, false },
+    { "OPTBTNS.GR", 0, false },
+    { "PANELS.GR", 0, true },
+    { "POWER.GR", 0, false },
+    { "QUESTION.GR", 0, false },
+    { "SCRLEDGE.GR", 0, false },
+    { "SPELLS.GR", 0, false },
+    { "TMFLAT.GR", 0, false },
+    { "TMOBJ.GR", 0, false },
+    { "VIEWS.GR", 0, false },
+    { "WEAP.GR", 0, false },
+};
+
+const int k_resource_count =
+    static_cast<int>(sizeof(k_resources) / sizeof(k_resources[0]));
+
+// Resources are looked up with a perfect hash of their names: 32-bit
+// FNV-1a with a seed picked so that the top bits of the hashes of all
+// known names differ.
+const int k_resource_slot_bits = 6;
+const unsigned int k_resource_hash_seed = 25220;
+
+constexpr int get_resource_slot(
+    const char* name,
+    unsigned int hash = k_resource_hash_seed)
+{
+    return *name == '\0' ?
+        static_cast<int>(hash >> (32 - k_resource_slot_bits)) :
+        get_resource_slot(
+            name + 1,
+            (hash ^ static_cast<unsigned char>(*name)) * 16777619U);
+}
+
+// Returns an index of the first resource in the slot or -1.
+constexpr int find_resource_index(
+    int slot,
+    int index = 0)
+{
+    return
+        index == k_resource_count ? -1 :
+        get_resource_slot(k_resources[index].file_name) == slot ? index :
+        find_resource_index(slot, index + 1);
+}
+
+// Counts resources which do not share a slot with a preceding one.
+constexpr int count_resource_slots(
+    int index = 0)
+{
+    return index == k_resource_count ? 0 :
+        (find_resource_index(
+            get_resource_slot(k_resources[index].file_name)) == index) +
+        count_resource_slots(index + 1);
+}
+
+static_assert(
+    count_resource_slots() == k_resource_count,
+    "Names of resources collide, pick another k_resource_hash_seed.");
+
+// Indices of resources by slots.
+constexpr signed char k_resource_slots[1 << k_resource_slot_bits] = {
+    find_resource_index(0), find_resource_index(1), find_resource_index(2), find_resource_index(3),
+    find_resource_index(4), find_resource_index(5), find_resource_index(6), find_resource_index(7),
+    find_resource_index(8), find_resource_index(9), find_resource_index(10), find_resource_index(11),
+    find_resource_index(12), find_resource_index(13), find_resource_index(14), find_resource_index(15),
+    find_resource_index(16), find_resource_index(17), find_resource_index(18), find_resource_index(19),
+    find_resource_index(20), find_resource_index(21), find_resource_index(22), find_resource_index(23),
+    find_resource_index(24), find_resource_index(25), find_resource_index(26), find_resource_index(27),
+    find_resource_index(28), find_resource_index(29), find_resource_index(30), find_resource_index(31),
+    find_resource_index(32), find_resource_index(33), find_resource_index(34), find_resource_index(35),
+    find_resource_index(36), find_resource_index(37), find_resource_index(38), find_resource_index(39),
+    find_resource_index(40), find_resource_index(41), find_resource_index(42), find_resource_index(43),
+    find_resource_index(44), find_resource_index(45), find_resource_index(46), find_resource_index(47),
+    find_resource_index(48), find_resource_index(49), find_resource_index(50), find_resource_index(51),
+    find_resource_index(52), find_resource_index(53), find_resource_index(54), find_resource_index(55),
+    find_resource_index(56), find_resource_index(57), find_resource_index(58), find_resource_index(59),
+    find_resource_index(60), find_resource_index(61), find_resource_index(62), find_resource_index(63)
+};
+
+
+} // namespace
+
+
+std::string combine_path(
+    const std::string& path1,
+    const std::string& path2)
+{
+    if (path1.empty())
+        return path2;
+
+    if (path2.empty())
+        return path1;
+
+    if (path2[0] == k_path_separator)
+        return path2;
+
+    bool use_separator = (path1[path1.size() - 1] != k_path_separator);
+
+    std::string result(path1);
+
+    if (use_separator)
+        result += k_path_separator;
+
+    result += path2;
+
+    return result;
+}
+
+std::string combine_path(
+    const std::string& path1,
+    const std::string& path2,
+    const std::string& path3)
+{
+    return combine_path(combine_path(path1, path2), path3);
+}
+
+std::string to_lowercase(
+    const std::string& string)
+{
+    if (string.empty())
+        return std::string();
+
+    static std::locale locale;
+
+    static const std::ctype<char>& facet =
+        std::use_facet<std::ctype<char> >(locale);
+
+    std::string result(string);
+
+    facet.tolower(&result[0], &result[0] + result.size());
+
+    return result;
+}
+
+std::string to_uppercase(
+    const std::string& string)
+{
+    if (string.empty())
+        return std::string();
+
+    static std::locale locale;
+
+    static const std::ctype<char>& facet =
+        std::use_facet<std::ctype<char> >(locale);
+
+    std::string result(string);
+
+    facet.toupper(&result[0], &result[0] + result.size());
+
+    return result;
+}
+
+namespace {
+
+
+const unsigned long long k_fnv1a_basis = 0xCBF29CE484222325ULL;
+
+unsigned long long update_fnv1a(
+    unsigned long long hash,
+    const unsigned char* data,
+    size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= data[i];
+        hash *= 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+bool normalize_path_pred(
+    char c)
+{
+#ifdef _WIN32
+    return c == '/';
+#else
+    return c == '\\';
+#endif
+}
+
+
+} // namespace
+
+std::string normalize_path(
+    const std::string& path)
+{
+    std::string result(path);
+
+    std::replace_if(
+        result.begin(), result.end(), normalize_path_pred, k_path_separator);
+
+    return result;
+}
+
+std::string extract_dir(
+    const std::string& path)
+{
+    if (path.empty())
+        return std::string();
+
+    size_t name_pos = path.rfind(k_path_separator);
+
+    if (name_pos == path.npos)
+        return std::string();
+
+    return path.substr(0, name_pos);
+}
+
+std::string extract_file_name(
+    const std::string& path)
+{
+    if (path.empty())
+        return std::string();
+
+    size_t name_pos = path.rfind(k_path_separator);
+
+    if (name_pos == (path.size() - 1))
+        return std::string();
+
+    if (name_pos == path.npos)
+        name_pos = 0;
+    else
+        ++name_pos;
+
+    return path.substr(name_pos);
+}
+
+std::string extract_file_name_without_extension(
+    const std::string& path)
+{
+    if (path.empty())
+        return std::string();
+
+    size_t name_pos = path.rfind(k_path_separator);
+
+    if (name_pos == (path.size() - 1))
+        return std::string();
+
+    if (name_pos == path.npos)
+        name_pos = 0;
+    else
+        ++name_pos;
+
+    size_t dot_pos = path.rfind('.');
+
+    if (dot_pos == path.npos)
+        dot_pos = path.size();
+
+    size_t length = dot_pos - name_pos;
+    return path.substr(name_pos, length);
+}
+
+bool create_dir(
+    const std::string& path)
+{
+#ifdef _WIN32
+    int api_result = ::_mkdir(path.c_str());
+#else
+    int api_result = ::mkdir(path.c_str(), 0777);
+#endif // _WIN32
+
+    if (api_result != 0) {
+        if (errno != EEXIST) {
+            std::cerr <<
+                "ERROR: Failed to create a directory \"" <<
+                path << "\"." << std::endl;
+
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool create_dirs_along_the_path(
+    const std::string& path)
+{
+    if (path.empty())
+        return true;
+
+    std::string current_path;
+    size_t dir_start_pos = 0;
+    size_t dir_end_pos = 0;
+
+    while (dir_end_pos != std::string::npos) {
+        dir_end_pos = path.find(k_path_separator, dir_start_pos);
+
+        std::string dir = path.substr(
+            dir_start_pos, dir_end_pos - dir_start_pos);
+
+        if (dir.empty()) {
+            // The root of an absolute path.
+            if (dir_end_pos == 0)
+                current_path = k_path_separator;
+        } else {
+            current_path = combine_path(current_path, dir);
+
+            if (!create_dir(current_path))
+                return false;
+        }
+
+        dir_start_pos = dir_end_pos;
+
+        if (dir_start_pos != std::string::npos)
+            ++dir_start_pos;
+    }
+
+    return true;
+}
+
+bool is_file_exists(
+    const std::string& file_name)
+{
+    long long size;
+    long long mtime;
+
+    return get_file_status(file_name, size, mtime);
+}
+
+bool get_dir_entries(
+    const std::string& dir,
+    std::vector<std::string>& names)
+{
+    names.clear();
+
+    std::string path = dir.empty() ? "." : dir;
+
+#ifdef _WIN32
+    WIN32_FIND_DATAA find_data;
+
+    HANDLE handle = ::FindFirstFileA(
+        combine_path(path, "*").c_str(), &find_data);
+
+    if (handle == INVALID_HANDLE_VALUE)
+        return false;
+
+    do {
+        std::string name = find_data.cFileName;
+
+        if (name != "." && name != "..")
+            names.push_back(name);
+    } while (::FindNextFileA(handle, &find_data));
+
+    ::FindClose(handle);
+#else
+    DIR* dir_handle = ::opendir(path.c_str());
+
+    if (!dir_handle)
+        return false;
+
+    for (struct dirent* entry = ::readdir(dir_handle); entry;
+        entry = ::readdir(dir_handle))
+    {
+        std::string name = entry->d_name;
+
+        if (name != "." && name != "..")
+            names.push_back(name);
+    }
+
+    ::closedir(dir_handle);
+#endif // _WIN32
+
+    return true;
+}
+
+// Gets a size and a time of the last modification of a file
+// (in the finest units the system provides).
+bool get_file_status(
+    const std::string& file_name,
+    long long& size,
+    long long& mtime)
+{
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+
+    if (!::GetFileAttributesExA(
+        file_name.c_str(), GetFileExInfoStandard, &attributes))
+    {
+        return false;
+    }
+
+    size =
+        (static_cast<long long>(attributes.nFileSizeHigh) << 32) |
+        attributes.nFileSizeLow;
+
+    // 100 ns intervals.
+    mtime =
+        (static_cast<long long>(
+            attributes.ftLastWriteTime.dwHighDateTime) << 32) |
+        attributes.ftLastWriteTime.dwLowDateTime;
+#else
+    struct stat file_stat;
+
+    if (::stat(file_name.c_str(), &file_stat) != 0)
+        return false;
+
+    size = file_stat.st_size;
+
+    // Nanoseconds.
+#ifdef __APPLE__
+    mtime =
+        (static_cast<long long>(file_stat.st_mtimespec.tv_sec) * 1000000000) +
+        file_stat.st_mtimespec.tv_nsec;
+#else
+    mtime =
+        (static_cast<long long>(file_stat.st_mtim.tv_sec) * 1000000000) +
+        file_stat.st_mtim.tv_nsec;
+#endif // __APPLE__
+#endif // _WIN32
+
+    return true;
+}
+
+bool is_same_file(
+    const std::string& file_name1,
+    const std::string& file_name2)
+{
+#ifdef _WIN32
+    // A mapped file cannot be truncated here anyway,
+    // so the names are just compared.
+    return
+        is_file_exists(file_name1) &&
+        to_lowercase(file_name1) == to_lowercase(file_name2);
+#else
+    struct stat file_stat1;
+    struct stat file_stat2;
+
+    return
+        ::stat(file_name1.c_str(), &file_stat1) == 0 &&
+        ::stat(file_name2.c_str(), &file_stat2) == 0 &&
+        file_stat1.st_dev == file_stat2.st_dev &&
+        file_stat1.st_ino == file_stat2.st_ino;
+#endif // _WIN32
+}
+
+// Computes 64-bit FNV-1a hash of a file content.
+bool hash_file(
+    const std::string& file_name,
+    unsigned long long& hash)
+{
+    std::ifstream file(
+        file_name.c_str(),
+        std::ios_base::in | std::ios_base::binary);
+
+    if (!file)
+        return false;
+
+    hash = k_fnv1a_basis;
+
+    char buffer[65536];
+
+    while (file) {
+        file.read(buffer, sizeof(buffer));
+
+        hash = update_fnv1a(
+            hash,
+            reinterpret_cast<const unsigned char*>(buffer),
+            static_cast<size_t>(file.gcount()));
+    }
+
+    return file.eof();
+}
+
+unsigned long long hash_data(
+    const unsigned char* data,
+    size_t size)
+{
+    return update_fnv1a(k_fnv1a_basis, data, size);
+}
+
+bool FileMapping::open(
+    const std::string& file_name)
+{
+    close();
+
+#ifdef _WIN32
+    HANDLE file = ::CreateFileA(
+        file_name.c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ,
+        NULL,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL);
+
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER file_size;
+    HANDLE mapping = NULL;
+
+    if (::GetFileSizeEx(file, &file_size) &&
+        file_size.QuadPart > 0 &&
+        static_cast<unsigned long long>(file_size.QuadPart) <=
+            static_cast<size_t>(-1))
+    {
+        mapping = ::CreateFileMappingA(
+            file, NULL, PAGE_READONLY, 0, 0, NULL);
+    }
+
+    ::CloseHandle(file);
+
+    if (!mapping)
+        return false;
+
+    void* view = ::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+    ::CloseHandle(mapping);
+
+    if (!view)
+        return false;
+
+    data_ = static_cast<const unsigned char*>(view);
+    size_ = static_cast<size_t>(file_size.QuadPart);
+#else
+    int file = ::open(file_name.c_str(), O_RDONLY);
+
+    if (file < 0)
+        return false;
+
+    struct stat file_stat;
+    void* view = MAP_FAILED;
+
+    if (::fstat(file, &file_stat) == 0 && file_stat.st_size > 0) {
+        view = ::mmap(
+            NULL,
+            static_cast<size_t>(file_stat.st_size),
+            PROT_READ,
+            MAP_PRIVATE,
+            file,
+            0);
+    }
+
+    ::close(file);
+
+    if (view == MAP_FAILED)
+        return false;
+
+    data_ = static_cast<const unsigned char*>(view);
+    size_ = static_cast<size_t>(file_stat.st_size);
+#endif // _WIN32
+
+    return true;
+}
+
+void FileMapping::close()
+{
+    if (!data_)
+        return;
+
+#ifdef _WIN32
+    ::UnmapViewOfFile(data_);
+#else
+    ::munmap(const_cast<unsigned char*>(data_), size_);
+#endif // _WIN32
+
+    data_ = NULL;
+    size_ = 0;
+}
+
+// Creates a file with the specified content in one go.
+bool write_file(
+    const std::string& file_name,
+    const unsigned char* data,
+    size_t size,
+    std::ostream& err)
+{
+#ifdef _WIN32
+    std::ofstream file(
+        file_name.c_str(), std::ios_base::out | std::ios_base::binary);
+
+    if (!file) {
+        err << "ERROR: Unable to open." << std::endl;
+        return false;
+    }
+
+    file.write(reinterpret_cast<const char*>(data), size);
+
+    if (!file) {
+        err << "ERROR: I/O error." << std::endl;
+        return false;
+    }
+#else
+    int fd = ::open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+    if (fd < 0) {
+        err << "ERROR: Unable to open." << std::endl;
+        return false;
+    }
+
+    bool is_succeed = true;
+
+    // Usually takes a single call.
+    while (size > 0) {
+        ssize_t written_size = ::write(fd, data, size);
+
+        if (written_size < 0) {
+            if (errno == EINTR)
+                continue;
+
+            is_succeed = false;
+            break;
+        }
+
+        data += written_size;
+        size -= static_cast<size_t>(written_size);
+    }
+
+    if (::close(fd) != 0)
+        is_succeed = false;
+
+    if (!is_succeed) {
+        err << "ERROR: I/O error." << std::endl;
+        return false;
+    }
+#endif // _WIN32
+
+    return true;
+}
+
+// Guesses a format of an image by the extension of its file (BMP
+// by default).
+ImageFormat get_image_format(
+    const std::string& file_name)
+{
+    size_t dot_pos = file_name.rfind('.');
+
+    if (dot_pos != file_name.npos &&
+        to_lowercase(file_name.substr(dot_pos)) == ".png")
+    {
+        return e_format_png;
+    }
+
+    return e_format_bmp;
+}
+
+std::string get_image_extension(
+    ImageFormat format)
+{
+    return format == e_format_png ? ".png" : ".bmp";
+}
+
+unsigned int get_le_u16(
+    const unsigned char* data)
+{
+    return
+        static_cast<unsigned int>(data[0]) |
+        (static_cast<unsigned int>(data[1]) << 8);
+}
+
+unsigned int get_le_u32(
+    const unsigned char* data)
+{
+    return
+        static_cast<unsigned int>(data[0]) |
+        (static_cast<unsigned int>(data[1]) << 8) |
+        (static_cast<unsigned int>(data[2]) << 16) |
+        (static_cast<unsigned int>(data[3]) << 24);
+}
+
+bool IndexedImage::check_dimensions(
+    int max_width,
+    int max_height,
+    std::ostream& err) const
+{
+    if (width == 0 || height == 0) {
+        err << "ERROR: Empty image." << std::endl;
+        return false;
+    }
+
+    if (width > max_width) {
+        err << "ERROR: Width is too big." << std::endl;
+        return false;
+    }
+
+    if (height > max_height) {
+        err << "ERROR: Height is too big." << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool IndexedImage::load_from_bmp(
+    const std::string& file_name,
+    int max_width,
+    int max_height,
+    std::ostream& err)
+{
+    std::ifstream file(
+        file_name.c_str(),
+        std::ios_base::in | std::ios_base::binary);
+
+    if (!file) {
+        err << "ERROR: Failed to open." << std::endl;
+        return false;
+    }
+
+    //
+    BmpHeader header;
+    header.load_from_stream(file);
+
+    if (!file) {
+        err << "ERROR: I/O error." << std::endl;
+        return false;
+    }
+
+    if (header.bfType != 0x4D42) {
+        err << "ERROR: Not a BMP file." << std::endl;
+        return false;
+    }
+
+    //
+    BmpInfoHeader info_header;
+    info_header.load_from_stream(file);
+
+    if (!file) {
+        err << "ERROR: I/O error." << std::endl;
+        return false;
+    }
+
+    if (static_cast<int>(info_header.biSize) < BmpInfoHeader::get_size()) {
+        err << "ERROR: Info header is too small." << std::endl;
+        return false;
+    }
+
+    if (info_header.biWidth < 0) {
+        err << "ERROR: Negative width." << std::endl;
+        return false;
+    }
+
+    width = info_header.biWidth;
+    height = ::abs(info_header.biHeight);
+
+    if (!check_dimensions(max_width, max_height, err))
+        return false;
+
+    if (info_header.biPlanes != 1) {
+        err << "ERROR: Unsupported number of bitplanes: " <<
+            info_header.biPlanes << '.' << std::endl;
+        return false;
+    }
+
+    if (info_header.biBitCount != 8) {
+        err << "ERROR: Color bit depth is not 8 bit." << std::endl;
+        return false;
+    }
+
+    switch (info_header.biCompression) {
+    case BmpInfoHeader::e_rgb:
+    case BmpInfoHeader::e_rle8:
+        break;
+
+    default:
+        err << "ERROR: Unsupported compression mode: " <<
+            info_header.biCompression << '.' << std::endl;
+        return false;
+    }
+
+    if (info_header.is_compressed() && info_header.biSizeImage == 0) {
+        err << "ERROR: Unknown size of compressed data." << std::endl;
+        return false;
+    }
+
+    if (info_header.biClrUsed != 0 && info_header.biClrUsed != 256) {
+        err << "ERROR: Invalid size of palette." << std::endl;
+        return false;
+    }
+
+    // Uncompressed data may have no size specified.
+    int stride = ((width + 3) / 4) * 4;
+    size_t data_size = stride * height;
+
+    if (info_header.is_compressed())
+        data_size = info_header.biSizeImage;
+
+    // The sizes come from the file, so check them before allocating.
+    file.seekg(0, std::ios_base::end);
+    std::streamoff file_size = file.tellg();
+
+    if (!file) {
+        err << "ERROR: I/O error." << std::endl;
+        return false;
+    }
+
+    if (header.bfOffBits > static_cast<unsigned long long>(file_size) ||
+        data_size > static_cast<unsigned long long>(
+            file_size - header.bfOffBits))
+    {
+        err << "ERROR: Pixel data is out of the file." << std::endl;
+        return false;
+    }
+
+    Buffer data(data_size);
+    file.seekg(header.bfOffBits);
+    file.read(reinterpret_cast<char*>(&data[0]), data.size());
+
+    if (!file) {
+        err << "ERROR: I/O error." << std::endl;
+        return false;
+    }
+
+    bool is_top_bottom = (info_header.biHeight < 0);
+
+    pixels.clear();
+    pixels.resize(width * height);
+
+    if (info_header.is_compressed())
+        return decode_rle8(data, is_top_bottom, err);
+
+    for (int line = 0; line < height; ++line) {
+        const unsigned char* src = &data[line * stride];
+        std::copy(src, src + width, get_line(line, is_top_bottom));
+    }
+
+    return true;
+}
+
+bool IndexedImage::decode_rle8(
+    const Buffer& data,
+    bool is_top_bottom,
+    std::ostream& err)
+{
+    const unsigned char* src = &data[0];
+    size_t src_size = data.size();
+    size_t src_offset = 0;
+    int x = 0;
+    int line = 0;
+    bool is_valid = true;
+
+    while (is_valid && (src_offset + 2) <= src_size) {
+        int count = src[src_offset];
+        int value = src[src_offset + 1];
+
+        src_offset += 2;
+
+        if (count > 0) {
+            // Repeat run.
+            is_valid = (line < height && count <= (width - x));
+
+            if (is_valid) {
+                std::fill_n(
+                    get_line(line, is_top_bottom) + x,
+                    count,
+                    static_cast<unsigned char>(value));
+
+                x += count;
+            }
+
+            continue;
+        }
+
+        switch (value) {
+        case 0:
+            // End of line.
+            x = 0;
+            ++line;
+            break;
+
+        case 1:
+            // End of bitmap.
+            return true;
+
+        case 2:
+            // Delta.
+            is_valid = ((src_offset + 2) <= src_size);
+
+            if (is_valid) {
+                x += src[src_offset];
+                line += src[src_offset + 1];
+                src_offset += 2;
+
+                is_valid = (x <= width && line <= height);
+            }
+            break;
+
+        default: {
+            // Absolute run, padded to a word.
+            count = value;
+            size_t padded_count = count + (count % 2);
+
+            is_valid =
+                line < height &&
+                count <= (width - x) &&
+                padded_count <= (src_size - src_offset);
+
+            if (is_valid) {
+                std::copy(
+                    &src[src_offset],
+                    &src[src_offset] + count,
+                    get_line(line, is_top_bottom) + x);
+
+                x += count;
+                src_offset += padded_count;
+            }
+            break;
+        }
+        }
+    }
+
+    if (!is_valid || src_offset != src_size) {
+        err << "ERROR: Invalid RLE8 data." << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool IndexedImage::load_from_png(
+    const std::string& file_name,
+    int max_width,
+    int max_height,
+    std::ostream& err)
+{
+    std::ifstream file(
+        file_name.c_str(),
+        std::ios_base::in | std::ios_base::binary);
+
+    if (!file) {
+        err << "ERROR: Failed to open." << std::endl;
+        return false;
+    }
+
+    Buffer png_file(
+        (std::istreambuf_iterator<char>(file)),
+        std::istreambuf_iterator<char>());
+
+    if (file.bad()) {
+        err << "ERROR: I/O error." << std::endl;
+        return false;
+    }
+
+    size_t file_size = png_file.size();
+
+    if (file_size < sizeof(k_png_signature) ||
+        !std::equal(
+            k_png_signature,
+            k_png_signature + sizeof(k_png_signature),
+            png_file.begin()))
+    {
+        err << "ERROR: Not a PNG file." << std::endl;
+        return false;
+    }
+
+    //
+    size_t offset = sizeof(k_png_signature);
+    bool has_header = false;
+    bool has_end = false;
+    Buffer image_data;
+
+    while (!has_end) {
+        if ((file_size - offset) < 12) {
+            err << "ERROR: Unexpected end of file." << std::endl;
+            return false;
+        }
+
+        const unsigned char* chunk = &png_file[offset];
+        unsigned int length = get_be_u32(chunk);
+
+        if (length > (file_size - offset - 12)) {
+            err << "ERROR: Unexpected end of file." << std::endl;
+            return false;
+        }
+
+        std::string type(reinterpret_cast<const char*>(&chunk[4]), 4);
+        const unsigned char* data = &chunk[8];
+        unsigned int crc = update_crc32(0, &chunk[4], length + 4);
+
+        if (get_be_u32(&data[length]) != crc) {
+            err << "ERROR: CRC mismatch in chunk \"" <<
+                type << "\"." << std::endl;
+            return false;
+        }
+
+        offset += length + 12;
+
+        if (!has_header && type != "IHDR") {
+            err << "ERROR: Header is not the first chunk." << std::endl;
+            return false;
+        }
+
+        if (type == "IHDR") {
+            if (has_header || length != 13) {
+                err << "ERROR: Invalid header." << std::endl;
+                return false;
+            }
+
+            has_header = true;
+
+            unsigned int png_width = get_be_u32(&data[0]);
+            unsigned int png_height = get_be_u32(&data[4]);
+
+            if (data[8] != 8 || data[9] != 3) {
+                err << "ERROR: Image is not 8 bit indexed." << std::endl;
+                return false;
+            }
+
+            if (data[10] != 0 || data[11] != 0) {
+                err << "ERROR: Unsupported compression or filter method." <<
+                    std::endl;
+                return false;
+            }
+
+            if (data[12] != 0) {
+                err << "ERROR: Interlaced images are not supported." <<
+                    std::endl;
+                return false;
+            }
+
+            // Anything bigger is rejected as too big anyway.
+            width = static_cast<int>(
+                std::min(png_width, static_cast<unsigned int>(0xFFFF)));
+            height = static_cast<int>(
+                std::min(png_height, static_cast<unsigned int>(0xFFFF)));
+
+            if (!check_dimensions(max_width, max_height, err))
+                return false;
+        } else if (type == "IDAT")
+            image_data.insert(image_data.end(), data, data + length);
+        else if (type == "IEND")
+            has_end = true;
+        else if (type != "PLTE" && (type[0] & 0x20) == 0) {
+            // Only ancillary chunks may be ignored.
+            err << "ERROR: Unsupported chunk \"" <<
+                type << "\"." << std::endl;
+            return false;
+        }
+    }
+
+    //
+    int stride = width + 1;
+    size_t scanlines_size = static_cast<size_t>(stride) * height;
+    Buffer scanlines;
+
+    if (image_data.empty() ||
+        !ZlibDecoder().decode(
+            &image_data[0],
+            image_data.size(),
+            scanlines_size,
+            scanlines) ||
+        scanlines.size() != scanlines_size)
+    {
+        err << "ERROR: Invalid image data." << std::endl;
+        return false;
+    }
+
+    pixels.clear();
+    pixels.resize(width * height);
+
+    // Undo filtering; a pixel is a single byte.
+    for (int y = 0; y < height; ++y) {
+        const unsigned char* line = &scanlines[(y * stride) + 1];
+        unsigned char* pixel = &pixels[y * width];
+        const unsigned char* prior_pixel =
+            (y > 0 ? &pixels[(y - 1) * width] : NULL);
+
+        int filter_type = scanlines[y * stride];
+
+        for (int x = 0; x < width; ++x) {
+            int a = (x > 0 ? pixel[x - 1] : 0);
+            int b = (prior_pixel ? prior_pixel[x] : 0);
+            int c = ((x > 0 && prior_pixel) ? prior_pixel[x - 1] : 0);
+            int predictor = 0;
+
+            switch (filter_type) {
+            case 0:
+                break;
+
+            case 1:
+                predictor = a;
+                break;
+
+            case 2:
+                predictor = b;
+                break;
+
+            case 3:
+                predictor = (a + b) / 2;
+                break;
+
+            case 4: {
+                // Paeth
+                int p = a + b - c;
+                int pa = ::abs(p - a);
+                int pb = ::abs(p - b);
+                int pc = ::abs(p - c);
+
+                if (pa <= pb && pa <= pc)
+                    predictor = a;
+                else if (pb <= pc)
+                    predictor = b;
+                else
+                    predictor = c;
+                break;
+            }
+
+            default:
+                err << "ERROR: Invalid filter type: " <<
+                    filter_type << '.' << std::endl;
+                return false;
+            }
+
+            pixel[x] = static_cast<unsigned char>(line[x] + predictor);
+        }
+    }
+
+    return true;
+}
+
+bool IndexedImage::save_to_file(
+    const std::string& file_name,
+    ImageFormat format,
+    const Palette& palette,
+    std::ostream& err) const
+{
+    ImageScratch scratch;
+
+    return save_to_file(file_name, format, palette, scratch, err);
+}
+
+bool IndexedImage::save_to_file(
+    const std::string& file_name,
+    ImageFormat format,
+    const Palette& palette,
+    ImageScratch& scratch,
+    std::ostream& err) const
+{
+    if (format == e_format_png)
+        return save_to_png(file_name, palette, scratch, err);
+    else
+        return save_to_bmp(
+            file_name, palette, format == e_format_bmp_rle8, scratch, err);
+}
+
+bool IndexedImage::save_to_bmp(
+    const std::string& file_name,
+    const Palette& palette,
+    bool is_compressed,
+    ImageScratch& scratch,
+    std::ostream& err) const
+{
+    int pad = (((width + 3) / 4) * 4) - width;
+
+    Buffer& rle_data = scratch.encoded;
+
+    if (is_compressed)
+        encode_rle8(rle_data);
+
+    int image_size = is_compressed ?
+        static_cast<int>(rle_data.size()) : (width + pad) * height;
+
+    BmpHeader header = BmpHeader();
+    header.bfType = 0x4D42;
+    header.bfSize =
+        BmpHeader::get_size() + BmpInfoHeader::get_size() +
+        (4 * 256) + image_size;
+    header.bfOffBits =
+        BmpHeader::get_size() + BmpInfoHeader::get_size() + (4 * 256);
+
+    BmpInfoHeader info_header = BmpInfoHeader();
+    info_header.biSize = BmpInfoHeader::get_size();
+    info_header.biWidth = width;
+    info_header.biHeight = is_compressed ? height : -height;
+    info_header.biPlanes = 1;
+    info_header.biBitCount = 8;
+    info_header.biCompression = is_compressed ?
+        BmpInfoHeader::e_rle8 : BmpInfoHeader::e_rgb;
+    info_header.biSizeImage = image_size;
+
+    // Padding bytes are zeroed.
+    Buffer& bmp_file = scratch.file;
+    bmp_file.assign(header.bfSize, 0);
+
+    unsigned char* data = &bmp_file[0];
+    data = header.save_to_buffer(data);
+    data = info_header.save_to_buffer(data);
+    data = std::copy(palette.bmp, palette.bmp + (4 * 256), data);
+
+    if (is_compressed)
+        std::copy(rle_data.begin(), rle_data.end(), data);
+    else {
+        for (int i = 0; i < height; ++i) {
+            data = std::copy(
+                pixels.begin() + (i * width),
+                pixels.begin() + ((i + 1) * width),
+                data);
+
+            data += pad;
+        }
+    }
+
+    return write_file(file_name, &bmp_file[0], bmp_file.size(), err);
+}
+
+void IndexedImage::encode_rle8(
+    Buffer& data) const
+{
+    data.clear();
+    data.reserve(pixels.size() / 2);
+
+    bool has_lines = false;
+    int pending_lines = 0;
+
+    for (int line = 0; line < height; ++line) {
+        const unsigned char* src = &pixels[(height - 1 - line) * width];
+
+        int count = width;
+
+        while (count > 0 && src[count - 1] == 0)
+            --count;
+
+        if (count == 0) {
+            ++pending_lines;
+            continue;
+        }
+
+        // Move to the next line past the skipped ones.
+        if (has_lines) {
+            // End of line.
+            data.push_back(0);
+            data.push_back(0);
+        }
+
+        while (pending_lines >= 3) {
+            int delta = std::min(pending_lines, 255);
+
+            // Delta.
+            data.push_back(0);
+            data.push_back(2);
+            data.push_back(0);
+            data.push_back(static_cast<unsigned char>(delta));
+
+            pending_lines -= delta;
+        }
+
+        for ( ; pending_lines > 0; --pending_lines) {
+            data.push_back(0);
+            data.push_back(0);
+        }
+
+        encode_rle8_line(src, count, data);
+        has_lines = true;
+    }
+
+    // End of bitmap.
+    data.push_back(0);
+    data.push_back(1);
+}
+
+void IndexedImage::encode_rle8_line(
+    const unsigned char* src,
+    int count,
+    Buffer& data)
+{
+    int offset = 0;
+
+    while (offset < count) {
+        int run_count = get_run_count(src, offset, count);
+
+        if (run_count >= 3) {
+            data.push_back(static_cast<unsigned char>(run_count));
+            data.push_back(src[offset]);
+            offset += run_count;
+            continue;
+        }
+
+        // Gather pixels up to a run worth a repeat record.
+        int literal_count = 0;
+
+        while ((offset + literal_count) < count &&
+            literal_count < 255 &&
+            get_run_count(src, offset + literal_count, count) < 3)
+        {
+            ++literal_count;
+        }
+
+        // Absolute mode needs at least three pixels.
+        if (literal_count < 3) {
+            for (int i = 0; i < literal_count; ++i) {
+                data.push_back(1);
+                data.push_back(src[offset + i]);
+            }
+        } else {
+            data.push_back(0);
+            data.push_back(static_cast<unsigned char>(literal_count));
+            data.insert(
+                data.end(),
+                &src[offset],
+                &src[offset] + literal_count);
+
+            if ((literal_count % 2) != 0)
+                data.push_back(0);
+        }
+
+        offset += literal_count;
+    }
+}
+
+int IndexedImage::get_run_count(
+    const unsigned char* src,
+    int offset,
+    int count)
+{
+    int end = std::min(count, offset + 255);
+    int i = offset + 1;
+
+    while (i < end && src[i] == src[offset])
+        ++i;
+
+    return i - offset;
+}
+
+bool IndexedImage::save_to_png(
+    const std::string& file_name,
+    const Palette& palette,
+    ImageScratch& scratch,
+    std::ostream& err) const
+{
+    // Indexed images compress best without filtering,
+    // so each row is just prefixed with filter type 0.
+    int stride = width + 1;
+    Buffer& scanlines = scratch.encoded;
+    scanlines.assign(stride * height, 0);
+
+    for (int i = 0; i < height; ++i) {
+        std::copy(
+            pixels.begin() + (i * width),
+            pixels.begin() + ((i + 1) * width),
+            scanlines.begin() + (i * stride) + 1);
+    }
+
+    Buffer& png_file = scratch.file;
+    png_file.assign(
+        k_png_signature, k_png_signature + sizeof(k_png_signature));
+
+    unsigned char header[13];
+    unsigned char* data = header;
+    data = put_be_value(static_cast<unsigned int>(width), data);
+    data = put_be_value(static_cast<unsigned int>(height), data);
+    *data++ = 8; // bit depth
+    *data++ = 3; // color type: indexed
+    *data++ = 0; // compression method: deflate
+    *data++ = 0; // filter method: adaptive
+    *data++ = 0; // interlace method: none
+    append_png_chunk("IHDR", header, sizeof(header), png_file);
+
+    unsigned char rgb_palette[768];
+
+    for (int i = 0; i < 256; ++i) {
+        rgb_palette[(3 * i) + 0] = palette.bmp[(4 * i) + 2];
+        rgb_palette[(3 * i) + 1] = palette.bmp[(4 * i) + 1];
+        rgb_palette[(3 * i) + 2] = palette.bmp[(4 * i) + 0];
+    }
+
+    append_png_chunk("PLTE", rgb_palette, sizeof(rgb_palette), png_file);
+
+    Buffer& image_data = scratch.compressed;
+    image_data.clear();
+    scratch.get_zlib_encoder().encode(
+        &scanlines[0], static_cast<int>(scanlines.size()), image_data);
+    append_png_chunk("IDAT", &image_data[0], image_data.size(), png_file);
+
+    append_png_chunk("IEND", NULL, 0, png_file);
+
+    return write_file(file_name, &png_file[0], png_file.size(), err);
+}
+
+ImageScratch::~ImageScratch()
+{
+    delete zlib_encoder_;
+}
+
+ZlibEncoder& ImageScratch::get_zlib_encoder()
+{
+    if (!zlib_encoder_)
+        zlib_encoder_ = new ZlibEncoder();
+
+    return *zlib_encoder_;
+}
+
+void ImageScratch::reserve(
+    int width,
+    int height)
+{
+    int pixel_count = width * height;
+
+    // RLE8 data takes up to two bytes per pixel plus escapes.
+    int max_encoded_size = (2 * pixel_count) + (4 * height) + 2;
+
+    image.pixels.reserve(pixel_count);
+    encoded.reserve(max_encoded_size);
+    file.reserve(
+        BmpHeader::get_size() + BmpInfoHeader::get_size() + (4 * 256) +
+        max_encoded_size);
+}
+
+bool Bitmap::load_from_gr(
+    const void* data,
+    int size,
+    Special special,
+    const Palette* palette,
+    const AuxPalettes& aux_palette,
+    std::ostream& err)
+{
+    assert(data);
+    assert(size >= 0);
+    assert(palette);
+
+    const unsigned char* octets = static_cast<const unsigned char*>(data);
+
+    // Type, width and height; the type tells the rest of the header.
+    if (special == e_default && size < 3) {
+        err << "ERROR: Truncated bitmap header." << std::endl;
+        return false;
+    }
+
+    if (special == e_default) {
+        type = octets[0];
+        width = octets[1];
+        height = octets[2];
+        octets += 3;
+    } else {
+        type = 4;
+
+        if (special == e_last_panel) {
+            width = k_panel_border_width;
+            height = k_panel_border_height;
+        } else {
+            width = k_panel_width;
+            height = k_panel_height;
+        }
+
+        data_size = width * height;
+    }
+
+    switch (type) {
+    case 4:
+    case 8:
+    case 10:
+        break;
+
+    default:
+        err << "ERROR: Invalid bitmap type: " <<
+            type << '.' << std::endl;
+        return false;
+    }
+
+    this->special = special;
+
+    // A bitmap without a header still has the size field.
+    int header_size = (special == e_none ? 2 : get_header_size());
+
+    if (size < header_size) {
+        err << "ERROR: Truncated bitmap header." << std::endl;
+        return false;
+    }
+
+    if (is_compressed()) {
+        int aux_palette_index = *octets++;
+
+        if (aux_palette_index > 31) {
+            err << "ERROR: Auxiliary palette index out of range: " <<
+                aux_palette_index << '.' << std::endl;
+            return false;
+        }
+
+        this->aux_palette = &aux_palette[aux_palette_index];
+    } else
+        this->aux_palette = NULL;
+
+    if (special == e_none || special == e_default) {
+        data_size = static_cast<int>(get_le_u16(octets));
+        octets += 2;
+    }
+
+    // Decoders rely on this and do not check the bounds of the data.
+    if (get_size_in_bytes() > (size - header_size)) {
+        err << "ERROR: Truncated bitmap data." << std::endl;
+        return false;
+    }
+
+    Buffer().swap(pixels);
+    view = octets;
+
+    this->palette = palette;
+
+    return true;
+}
+
+void Bitmap::decompress(
+    Buffer& buffer) const
+{
+    const unsigned char* data = get_pixels();
+
+    if (!is_compressed()) {
+        if (data)
+            buffer.assign(data, data + data_size);
+        else
+            buffer.clear();
+
+        return;
+    }
+
+    buffer.clear();
+
+    if (!data || width == 0 || height == 0)
+        return;
+
+    buffer.resize(width * height);
+
+    if (type == 8) {
+        if (!decompress_rle_fast(&buffer[0])) {
+            // Malformed stream; let the reference decoder produce
+            // exactly what it always did.
+            std::fill(buffer.begin(), buffer.end(), 0);
+            decompress_rle(&buffer[0]);
+        }
+    }
+
+    if (type == 10) {
+        // 4-bit uncompressed; extra nibbles are ignored
+        // and missing ones leave pixels of color 0.
+
+        unpack_nibbles(
+            data,
+            0,
+            std::min(data_size, width * height),
+            *aux_palette,
+            &buffer[0]);
+    }
+}
+
+void Bitmap::decode(
+    IndexedImage& image) const
+{
+    image.width = width;
+    image.height = height;
+    decompress(image.pixels);
+    image.pixels.resize(width * height);
+}
+
+bool Bitmap::export_to_image(
+    const std::string& file_name,
+    ImageFormat format,
+    std::ostream& out,
+    std::ostream& err) const
+{
+    ImageScratch scratch;
+
+    return export_to_image(file_name, format, scratch, out, err);
+}
+
+bool Bitmap::export_to_image(
+    const std::string& file_name,
+    ImageFormat format,
+    ImageScratch& scratch,
+    std::ostream& out,
+    std::ostream& err) const
+{
+    out << "Exporting a bitmap to \"" <<
+        file_name << "\"." << std::endl;
+
+    decode(scratch.image);
+
+    return scratch.image.save_to_file(
+        file_name, format, *palette, scratch, err);
+}
+
+bool Bitmap::import_from_image(
+    const std::string& file_name,
+    Special special,
+    const AuxPaletteIndex* aux_palette_index,
+    std::ostream& out,
+    std::ostream& err)
+{
+    out << "Importing bitmap from \"" <<
+        file_name << "\"." << std::endl;
+
+    IndexedImage image;
+
+    if (!image.load_from_file(file_name, k_max_width, k_max_height, err))
+        return false;
+
+    if (!check_import_dimensions(image.width, image.height, err))
+        return false;
+
+    import_from_region(image, 0, 0, special, aux_palette_index);
+
+    return true;
+}
+
+void Bitmap::import_from_region(
+    const IndexedImage& image,
+    int x,
+    int y,
+    Special special,
+    const AuxPaletteIndex* aux_palette_index)
+{
+    assert(x >= 0 && (x + width) <= image.width);
+    assert(y >= 0 && (y + height) <= image.height);
+
+    pixels.resize(width * height);
+    view = NULL;
+
+    for (int i = 0; i < height; ++i) {
+        const unsigned char* line =
+            &image.pixels[((y + i) * image.width) + x];
+
+        std::copy(line, line + width, &pixels[i * width]);
+    }
+
+    finish_import(special, aux_palette_index);
+}
+
+bool Bitmap::check_import_dimensions(
+    int width,
+    int height,
+    std::ostream& err) const
+{
+    if (this->width != width || this->height != height) {
+        err <<
+            "ERROR: Mismatch dimensions of a new image and an original one." <<
+            std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool Bitmap::compress(
+    const AuxPalette& aux_palette)
+{
+    assert(!is_compressed());
+
+    if (pixels.empty())
+        return false;
+
+    int nibble_map[256];
+
+    std::fill_n(nibble_map, 256, -1);
+
+    for (int i = 15; i >= 0; --i)
+        nibble_map[aux_palette[i]] = i;
+
+    int pixel_count = static_cast<int>(pixels.size());
+    Buffer nibbles(pixel_count);
+
+    for (int i = 0; i < pixel_count; ++i) {
+        int nibble = nibble_map[pixels[i]];
+
+        if (nibble < 0)
+            return false;
+
+        nibbles[i] = static_cast<unsigned char>(nibble);
+    }
+
+    Buffer data;
+    NibbleRleEncoder encoder;
+
+    int type = 8;
+    int nibble_count = encoder.encode(&nibbles[0], pixel_count, data);
+
+    if (nibble_count == 0 || nibble_count > pixel_count) {
+        type = 10;
+        nibble_count = pixel_count;
+
+        NibbleWriter writer(data);
+
+        for (int i = 0; i < pixel_count; ++i)
+            writer.write(nibbles[i]);
+    }
+
+    // An auxiliary palette index is an extra byte of the header.
+    if (static_cast<int>(data.size()) + 1 >= pixel_count)
+        return false;
+
+    this->type = type;
+    data_size = nibble_count;
+    pixels.swap(data);
+    this->aux_palette = &aux_palette;
+
+    return true;
+}
+
+void Bitmap::finish_import(
+    Special special,
+    const AuxPaletteIndex* aux_palette_index)
+{
+    const AuxPalette* original_aux_palette = aux_palette;
+
+    type = 4;
+    this->special = special;
+    data_size = width * height;
+    aux_palette = NULL;
+
+    if (special == e_default && aux_palette_index) {
+        ColorSet colors;
+
+        for (int i = 0; i < data_size; ++i)
+            colors.insert(pixels[i]);
+
+        const AuxPalette* new_aux_palette =
+            aux_palette_index->find(colors, original_aux_palette);
+
+        if (new_aux_palette)
+            compress(*new_aux_palette);
+    }
+}
+
+bool Bitmap::read_rle_count(
+    const unsigned char* data,
+    int data_size,
+    int& nibble_offset,
+    int& count)
+{
+    if (nibble_offset >= data_size)
+        return false;
+
+    count = get_nibble(data, nibble_offset++);
+
+    if (count != 0)
+        return true;
+
+    if ((nibble_offset + 2) > data_size)
+        return false;
+
+    count = (get_nibble(data, nibble_offset) << 4) |
+        get_nibble(data, nibble_offset + 1);
+
+    nibble_offset += 2;
+
+    if (count != 0)
+        return true;
+
+    if ((nibble_offset + 3) > data_size)
+        return false;
+
+    count = (get_nibble(data, nibble_offset) << 8) |
+        (get_nibble(data, nibble_offset + 1) << 4) |
+        get_nibble(data, nibble_offset + 2);
+
+    nibble_offset += 3;
+
+    return true;
+}
+
+bool Bitmap::decompress_rle_fast(
+    unsigned char* buffer) const
+{
+    // Indexed by a state and by a count (0, 1, 2, 3 and above).
+    static const Type8Transition transitions[4][4] = {
+        // e_t8_repeat
+        {
+            { e_t8_none, e_t8_invalid },
+            { e_t8_none, e_t8_run },
+            { e_t8_none, e_t8_repeat_count },
+            { e_t8_fill, e_t8_run }
+        },
+
+        // e_t8_repeat_count
+        {
+            { e_t8_none, e_t8_invalid },
+            { e_t8_none, e_t8_repeat },
+            { e_t8_set_repeats, e_t8_multi_repeat },
+            { e_t8_set_repeats, e_t8_multi_repeat }
+        },
+
+        // e_t8_multi_repeat
+        {
+            { e_t8_none, e_t8_invalid },
+            { e_t8_none, e_t8_invalid },
+            { e_t8_none, e_t8_invalid },
+            { e_t8_fill, e_t8_multi_repeat }
+        },
+
+        // e_t8_run
+        {
+            { e_t8_none, e_t8_invalid },
+            { e_t8_copy, e_t8_repeat },
+            { e_t8_copy, e_t8_repeat },
+            { e_t8_copy, e_t8_repeat }
+        }
+    };
+
+    const unsigned char* data = get_pixels();
+    const AuxPalette& colors = *aux_palette;
+
+    int area = width * height;
+    int offset = 0;
+    int nibble_offset = 0;
+    int repeat_count = 0;
+    Type8State state = e_t8_repeat;
+
+    while (offset < area) {
+        int count;
+
+        if (!read_rle_count(data, data_size, nibble_offset, count))
+        {
+            return false;
+        }
+
+        const Type8Transition& transition =
+            transitions[state][std::min(count, 3)];
+
+        state = transition.next_state;
+
+        switch (transition.action) {
+        case e_t8_none:
+            break;
+
+        case e_t8_fill: {
+            if (nibble_offset >= data_size)
+                return false;
+
+            int color = get_nibble(data, nibble_offset++);
+            int fill_count = std::min(count, area - offset);
+
+            std::fill_n(&buffer[offset], fill_count, colors[color]);
+            offset += fill_count;
+
+            if (state == e_t8_multi_repeat) {
+                --repeat_count;
+
+                if (repeat_count == 1)
+                    state = e_t8_repeat;
+            }
+            break;
+        }
+
+        case e_t8_copy: {
+            int copy_count = std::min(count, area - offset);
+
+            if ((nibble_offset + copy_count) > data_size)
+                return false;
+
+            unpack_nibbles(
+                data, nibble_offset, copy_count, colors, &buffer[offset]);
+
+            offset += copy_count;
+            nibble_offset += copy_count;
+            break;
+        }
+
+        case e_t8_set_repeats:
+            repeat_count = count;
+            break;
+        }
+
+        if (state == e_t8_invalid)
+            return false;
+    }
+
+    return true;
+}
+
+void Bitmap::decompress_rle(
+    unsigned char* buffer) const
+{
+    // At most data_size nibbles are read.
+    NibbleReader reader(get_pixels());
+
+    int buffer_offset = 0;
+
+    int pixel_count = 0;
+    int stage = 0; // we start in stage 0
+    int count = 0;
+    int record = 0; // we start with record 0=repeat (3=run)
+    int repeat_count = 0;
+
+    int data_length = data_size;
+    int area = width * height;
+
+    while (data_length > 0 && pixel_count < area) {
+        int nibble = reader.read();
+
+        --data_length;
+
+        switch (stage) {
+        case 0: // we retrieve a new count
+            if (nibble == 0)
+                ++stage;
+            else {
+                count = nibble;
+                stage = 6;
+            }
+            break;
+
+        case 1:
+            count = nibble;
+            ++stage;
+            break;
+
+        case 2:
+            count = (count << 4) | nibble;
+
+            if (count == 0)
+                ++stage;
+            else
+                stage = 6;
+            break;
+
+        case 3:
+        case 4:
+        case 5:
+            count = (count << 4) | nibble;
+            ++stage;
+            break;
+        }
+
+        if (stage < 6)
+            continue;
+
+        switch (record) {
+        case 0:
+            // repeat record stage 1
+
+            if (count == 1) {
+                // skip this record; a run follows
+                record = 3;
+                break;
+            }
+
+            if (count == 2) {
+                // multiple run records
+                record = 2;
+                break;
+            }
+
+            // read next nibble; it's the color to repeat
+            record = 1;
+            continue;
+
+        case 1:
+            // repeat record stage 2
+
+            // repeat 'nibble' color 'count' times
+            for (int n = 0; n < count; ++n) {
+                buffer[buffer_offset++] = (*aux_palette)[nibble];
+
+                if (++pixel_count >= area)
+                    break;
+            }
+
+            if (repeat_count == 0)
+                record = 3; // next one is a run record
+            else {
+                --repeat_count;
+                record = 0; // continue with repeat records
+            }
+            break;
+
+        case 2:
+            // multiple repeat stage
+            // 'count' specifies the number of repeat record to appear
+            repeat_count = count - 1;
+            record = 0;
+            break;
+
+        case 3:
+            // run record stage 1
+            // copy 'count' nibbles
+
+            // retrieve next nibble
+            record = 4;
+            continue;
+
+        case 4:
+            // run record stage 2
+
+            // now we have a nibble to write
+            buffer[buffer_offset++] = (*aux_palette)[nibble];
+            ++pixel_count;
+
+            if (--count == 0)
+                record = 0; // next one is a repeat again
+            else
+                continue;
+            break;
+        }
+
+        stage = 0;
+    }
+}
+
+const Resource* find_resource(
+    const std::string& file_name)
+{
+    int index = k_resource_slots[get_resource_slot(file_name.c_str())];
+
+    if (index < 0 || file_name != k_resources[index].file_name)
+        return NULL;
+
+    return &k_resources[index];
+}
+
+int get_resource_count()
+{
+    return k_resource_count;
+}
+
+const Resource& get_resource(
+    int index)
+{
+    return k_resources[index];
+}
+
+
+// ========================================================================
+// PaletteSet
+
+const int PaletteSet::k_palette_count;
+
+bool PaletteSet::load(
+    const std::string& dir,
+    std::ostream& out,
+    std::ostream& err)
+{
+    std::string file_name;
+
+    //
+    file_name = combine_path(dir, "PALS.DAT");
+    out << "Loading palettes from \"" << file_name << "\"." << std::endl;
+
+    std::ifstream file(
+        file_name.c_str(),
+        std::ios_base::in | std::ios_base::binary);
+
+    if (!file) {
+        err << "ERROR: Failed to open." << std::endl;
+        return false;
+    }
+
+    unsigned char pals_data[k_palette_count * 768];
+    file.read(reinterpret_cast<char*>(pals_data), sizeof(pals_data));
+
+    if (!file) {
+        err << "ERROR: I/O error." << std::endl;
+        return false;
+    }
+
+    //
+    file_name = combine_path(dir, "ALLPALS.DAT");
+    out << "Loading auxiliary palettes from \"" <<
+        file_name << "\"." << std::endl;
+
+    std::ifstream aux_file(
+        file_name.c_str(),
+        std::ios_base::in | std::ios_base::binary);
+
+    if (!aux_file) {
+        err << "ERROR: Failed to open." << std::endl;
+        return false;
+    }
+
+    unsigned char allpals_data[sizeof(AuxPalettes)];
+    aux_file.read(reinterpret_cast<char*>(allpals_data), sizeof(allpals_data));
+
+    if (!aux_file) {
+        err << "ERROR: I/O error." << std::endl;
+        return false;
+    }
+
+    return load_from_memory(
+        pals_data,
+        sizeof(pals_data),
+        allpals_data,
+        sizeof(allpals_data),
+        err);
+}
+
+bool PaletteSet::load_from_memory(
+    const unsigned char* pals_data,
+    size_t pals_size,
+    const unsigned char* allpals_data,
+    size_t allpals_size,
+    std::ostream& err)
+{
+    if (pals_size < (k_palette_count * 768) ||
+        allpals_size < sizeof(AuxPalettes))
+    {
+        err << "ERROR: Not enough palette data." << std::endl;
+        return false;
+    }
+
+    for (int i = 0; i < k_palette_count; ++i) {
+        std::copy(
+            pals_data + (i * 768),
+            pals_data + ((i + 1) * 768),
+            palettes_[i].vga);
+
+        palettes_[i].update_bmp();
+    }
+
+    std::copy(
+        allpals_data,
+        allpals_data + sizeof(AuxPalettes),
+        &aux_palettes_[0][0]);
+
+    aux_palette_index_.build(aux_palettes_);
+
+    return true;
+}
+
+
+// ========================================================================
+// ImageCache
+
+const size_t ImageCache::k_default_capacity;
+
+void ImageCache::reset(
+    int slot_count)
+{
+    clear();
+    slots_.resize(slot_count, entries_.end());
+}
+
+void ImageCache::clear()
+{
+    entries_.clear();
+    Slots().swap(slots_);
+    size_ = 0;
+}
+
+const IndexedImage* ImageCache::find(
+    int index)
+{
+    if (index < 0 || index >= static_cast<int>(slots_.size()) ||
+        slots_[index] == entries_.end())
+    {
+        ++miss_count_;
+        return NULL;
+    }
+
+    ++hit_count_;
+
+    Entries::iterator entry = slots_[index];
+
+    // Move the entry to the front without reallocation.
+    entries_.splice(entries_.begin(), entries_, entry);
+
+    return &entry->image;
+}
+
+const IndexedImage* ImageCache::insert(
+    int index,
+    IndexedImage& image)
+{
+    if (index >= static_cast<int>(slots_.size()))
+        slots_.resize(index + 1, entries_.end());
+
+    remove(index);
+
+    entries_.push_front(Entry());
+
+    Entry& entry = entries_.front();
+    entry.index = index;
+    entry.image.width = image.width;
+    entry.image.height = image.height;
+    entry.image.pixels.swap(image.pixels);
+
+    slots_[index] = entries_.begin();
+    size_ += entry.image.pixels.size();
+
+    trim();
+
+    return &entry.image;
+}
+
+void ImageCache::remove(
+    int index)
+{
+    if (index < 0 || index >= static_cast<int>(slots_.size()))
+        return;
+
+    Entries::iterator entry = slots_[index];
+
+    if (entry == entries_.end())
+        return;
+
+    size_ -= entry->image.pixels.size();
+    slots_[index] = entries_.end();
+    entries_.erase(entry);
+}
+
+void ImageCache::set_capacity(
+    size_t capacity)
+{
+    capacity_ = capacity;
+    trim();
+}
+
+void ImageCache::trim()
+{
+    while (size_ > capacity_ && entries_.size() > 1) {
+        Entry& entry = entries_.back();
+
+        size_ -= entry.image.pixels.size();
+        slots_[entry.index] = entries_.end();
+        entries_.pop_back();
+    }
+}
+
+
+// ========================================================================
+// GrArchive
+
+bool GrArchive::open(
+    const std::string& file_name,
+    const Resource& resource,
+    const PaletteSet& palette_set,
+    std::ostream& err)
+{
+    // Bitmaps refer to the data of the file.
+    close();
+
+    file_name_ = file_name;
+
+#ifndef UW2_GR_TOOL_NO_MMAP
+    if (mapping_.open(file_name)) {
+        data_ = mapping_.get_data();
+        size_ = mapping_.get_size();
+    }
+#endif // UW2_GR_TOOL_NO_MMAP
+
+    // Without a mapping only the tables are read here, and the pixels
+    // are read on demand one bitmap at a time (see fetch_bitmap).
+    if (!data_) {
+        stream_.open(
+            file_name.c_str(),
+            std::ios_base::in | std::ios_base::binary | std::ios_base::ate);
+
+        if (!stream_) {
+            err << "ERROR: Failed to open." << std::endl;
+            return false;
+        }
+
+        std::streamoff file_size = stream_.tellg();
+
+        if (file_size <= 0) {
+            err << "ERROR: Empty file." << std::endl;
+            return false;
+        }
+
+        size_ = static_cast<size_t>(file_size);
+    }
+
+    return load(resource, palette_set, err);
+}
+
+bool GrArchive::open_from_memory(
+    const unsigned char* data,
+    size_t size,
+    const Resource& resource,
+    const PaletteSet& palette_set,
+    std::ostream& err)
+{
+    close();
+
+    if (size == 0) {
+        err << "ERROR: Empty file." << std::endl;
+        return false;
+    }
+
+    contents_.assign(data, data + size);
+    data_ = &contents_[0];
+    size_ = size;
+
+    return load(resource, palette_set, err);
+}
+
+void GrArchive::close()
+{
+    file_name_.clear();
+    bitmaps_.clear();
+    mapping_.close();
+    Buffer().swap(contents_);
+    data_ = NULL;
+    size_ = 0;
+    stream_.close();
+    stream_.clear();
+    data_offsets_.clear();
+    image_cache_.clear();
+}
+
+const unsigned char* GrArchive::read(
+    int offset,
+    int size,
+    Buffer& buffer,
+    std::ostream& err)
+{
+    if (data_) {
+        if (offset < 0 || size < 0 ||
+            (static_cast<size_t>(offset) + size) > size_)
+        {
+            err << "ERROR: Unexpected end of file." << std::endl;
+            return NULL;
+        }
+
+        return data_ + offset;
+    }
+
+    buffer.resize(std::max(size, 1));
+
+    stream_.seekg(offset);
+    stream_.read(reinterpret_cast<char*>(&buffer[0]), size);
+
+    if (!stream_) {
+        err << "ERROR: I/O error." << std::endl;
+        stream_.clear();
+        return NULL;
+    }
+
+    return &buffer[0];
+}
+
+bool GrArchive::load(
+    const Resource& resource,
+    const PaletteSet& palette_set,
+    std::ostream& err)
+{
+    resource_ = &resource;
+    palette_set_ = &palette_set;
+
+    bool is_in_memory = (data_ != NULL);
+
+    // Offsets are kept as int.
+    if (size_ > static_cast<size_t>(INT_MAX)) {
+        err << "ERROR: File is too large." << std::endl;
+        return false;
+    }
+
+    int file_size = static_cast<int>(size_);
+
+    if (file_size < 3) {
+        err << "ERROR: Truncated header." << std::endl;
+        return false;
+    }
+
+    Buffer buffer;
+    const unsigned char* octets = read(0, 3, buffer, err);
+
+    if (!octets)
+        return false;
+
+    int gr_type = octets[0];
+
+    if (gr_type != 1) {
+        err << "ERROR: Invalid type: " << gr_type << "\"." <<
+            std::endl;
+        return false;
+    }
+
+    int bitmap_count = static_cast<int>(get_le_u16(&octets[1]));
+
+    if (bitmap_count == 0) {
+        err << "ERROR: No bitmaps." << std::endl;
+        return false;
+    }
+
+    int table_size = 4 * (bitmap_count + 1);
+
+    if (table_size > (file_size - 3)) {
+        err << "ERROR: Truncated offset table." << std::endl;
+        return false;
+    }
+
+    octets = read(3, table_size, buffer, err);
+
+    if (!octets)
+        return false;
+
+    // The whole table is checked before any bitmap is loaded, so
+    // a record of a bitmap lies inside of the file.
+    std::vector<int> offsets(bitmap_count + 1);
+
+    for (int i = 0; i < bitmap_count + 1; ++i) {
+        unsigned int offset = get_le_u32(&octets[4 * i]);
+
+        if (offset < static_cast<unsigned int>(3 + table_size) ||
+            offset > static_cast<unsigned int>(file_size))
+        {
+            err << "ERROR: Offset " << i << " is out of range: " <<
+                offset << '.' << std::endl;
+            return false;
+        }
+
+        offsets[i] = static_cast<int>(offset);
+
+        if (i > 0 && offsets[i] < offsets[i - 1]) {
+            err << "ERROR: Offset " << i <<
+                " is less than the previous one: " << offset << '.' <<
+                std::endl;
+            return false;
+        }
+    }
+
+    bitmaps_.resize(bitmap_count);
+    image_cache_.reset(bitmap_count);
+
+    if (!is_in_memory)
+        data_offsets_.resize(bitmap_count);
+
+    int palette_index = resource.palette_index;
+    const Palette& palette = palette_set.get_palette(palette_index);
+
+    for (int i = 0; i < bitmap_count; ++i) {
+        Bitmap& bitmap = bitmaps_[i];
+
+        int data_size = offsets[i + 1] - offsets[i];
+
+        if (data_size == 0) {
+            bitmap.special = Bitmap::e_none;
+            bitmap.width = 0;
+            bitmap.height = 0;
+            bitmap.data_size = 0;
+            Buffer().swap(bitmap.pixels);
+            bitmap.view = NULL;
+            bitmap.aux_palette = NULL;
+            continue;
+        }
+
+        Bitmap::Special special = Bitmap::e_default;
+
+        if (resource.is_panels) {
+            if (i == (bitmap_count - 1))
+                special = Bitmap::e_last_panel;
+            else
+                special = Bitmap::e_panel;
+        }
+
+        // Pixels may extend past the record as long as they are
+        // inside of the file.
+        int available_size = file_size - offsets[i];
+        int read_size = available_size;
+
+        // Just a header if not in memory.
+        if (!is_in_memory)
+            read_size = std::min(read_size, Bitmap::get_max_header_size());
+
+        octets = read(offsets[i], read_size, buffer, err);
+
+        if (!octets)
+            return false;
+
+        if (!bitmap.load_from_gr(
+            octets,
+            available_size,
+            special,
+            &palette,
+            palette_set.get_aux_palettes(),
+            err))
+        {
+            return false;
+        }
+
+        if (!is_in_memory) {
+            data_offsets_[i] = offsets[i] + bitmap.get_header_size();
+            bitmap.view = NULL;
+        }
+
+        if (bitmap.type != 4 && palette_index != 0) {
+            err <<
+                "ERROR: Non zero palette index for compressed bitmap." <<
+                std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool GrArchive::fetch_bitmap(
+    int index,
+    Buffer& buffer,
+    std::ostream& err)
+{
+    Bitmap& bitmap = bitmaps_[index];
+
+    if (bitmap.is_empty() || bitmap.get_pixels())
+        return true;
+
+    const unsigned char* data = read(
+        data_offsets_[index], bitmap.get_size_in_bytes(), buffer, err);
+
+    if (!data)
+        return false;
+
+    bitmap.view = data;
+
+    return true;
+}
+
+void GrArchive::release_bitmap(
+    int index)
+{
+    if (!data_)
+        bitmaps_[index].view = NULL;
+}
+
+bool GrArchive::decode_bitmap(
+    int index,
+    IndexedImage& image,
+    std::ostream& err)
+{
+    Buffer buffer;
+
+    if (!fetch_bitmap(index, buffer, err))
+        return false;
+
+    const Bitmap& bitmap = bitmaps_[index];
+
+    bitmap.decode(image);
+
+    release_bitmap(index);
+
+    return true;
+}
+
+const IndexedImage* GrArchive::get_image(
+    int index,
+    std::ostream& err)
+{
+    const IndexedImage* cached_image = image_cache_.find(index);
+
+    if (cached_image)
+        return cached_image;
+
+    IndexedImage image;
+
+    if (!decode_bitmap(index, image, err))
+        return NULL;
+
+    return image_cache_.insert(index, image);
+}
+
+bool GrArchive::save(
+    const std::string& file_name,
+    std::ostream& err)
+{
+    // The source file may be the same one.
+    std::string temp_file_name = file_name + ".tmp";
+
+    // Writing into the opened file would pull data from under
+    // the bitmaps (and crash if the file is mapped).
+    if (!file_name_.empty() && is_same_file(temp_file_name, file_name_)) {
+        err << "ERROR: Temporary file \"" << temp_file_name <<
+            "\" is the opened file." << std::endl;
+        return false;
+    }
+
+    std::ofstream file(
+        temp_file_name.c_str(),
+        std::ios_base::out | std::ios_base::binary);
+
+    if (!file) {
+        err << "ERROR: Failed to open." << std::endl;
+        return false;
+    }
+
+    size_t bitmap_count = bitmaps_.size();
+    size_t offset_count = bitmap_count + 1;
+    std::vector<unsigned int> offsets(offset_count);
+    unsigned int offset = static_cast<unsigned int>(3 + (4 * offset_count));
+    offsets[0] = offset;
+
+    for (size_t i = 0; i < bitmap_count; ++i) {
+        const Bitmap& bitmap = bitmaps_[i];
+
+        if (!bitmap.is_empty()) {
+            offset += static_cast<unsigned int>(
+                bitmap.get_header_size() + bitmap.get_size_in_bytes());
+        }
+
+        offsets[i + 1] = offset;
+    }
+
+    // type
+    write_value(static_cast<unsigned char>(1), file);
+
+    // image count
+    write_value(static_cast<unsigned short>(bitmap_count), file);
+
+    // image offsets
+    for (size_t i = 0; i < offset_count; ++i)
+        write_value(offsets[i], file);
+
+    // images
+    Buffer buffer;
+
+    for (size_t i = 0; i < bitmap_count; ++i) {
+        const Bitmap& bitmap = bitmaps_[i];
+
+        if (bitmap.is_empty())
+            continue;
+
+        if (!fetch_bitmap(static_cast<int>(i), buffer, err)) {
+            file.close();
+            std::remove(temp_file_name.c_str());
+            return false;
+        }
+
+        if (!resource_->is_panels) {
+            write_value(static_cast<unsigned char>(bitmap.type), file);
+            write_value(static_cast<unsigned char>(bitmap.width), file);
+            write_value(static_cast<unsigned char>(bitmap.height), file);
+
+            if (bitmap.is_compressed()) {
+                int aux_palette_index = static_cast<int>(
+                    bitmap.aux_palette - palette_set_->get_aux_palettes());
+
+                write_value(static_cast<unsigned char>(aux_palette_index), file);
+            }
+
+            write_value(static_cast<unsigned short>(bitmap.data_size), file);
+        }
+
+        file.write(
+            reinterpret_cast<const char*>(bitmap.get_pixels()),
+            bitmap.get_size_in_bytes());
+
+        release_bitmap(static_cast<int>(i));
+    }
+
+    file.close();
+
+    if (!file) {
+        err << "ERROR: I/O error." << std::endl;
+        std::remove(temp_file_name.c_str());
+        return false;
+    }
+
+    close();
+
+#ifdef _WIN32
+    // Renaming does not replace an existing file here.
+    std::remove(file_name.c_str());
+#endif // _WIN32
+
+    // Replaces the file at once, so it is never lost.
+    if (std::rename(temp_file_name.c_str(), file_name.c_str()) != 0) {
+        err << "ERROR: Failed to rename \"" << temp_file_name <<
+            "\"." << std::endl;
+        std::remove(temp_file_name.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+
+} // namespace uw2_gr
@@ -0,0 +1,1111 @@
+/*
+    uw2_gr_tool: "Ultima Underworld II" .GR extracter/rebuilder.
+    Copyright (C) 2014, Boris I. Bendovsky <bibendovsky@hotmail.com>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. 
+*/
+
+
+// Reads and writes .GR files of "Ultima Underworld II".
+
+
+#ifndef UW2_GR_H
+#define UW2_GR_H
+
+
+#include <algorithm>
+#include <cstddef>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <string>
+#include <vector>
+
+
+namespace uw2_gr {
+
+
+#ifdef _WIN32
+const char k_path_separator = '\\';
+#else
+const char k_path_separator = '/';
+#endif
+
+std::string combine_path(
+    const std::string& path1,
+    const std::string& path2);
+
+std::string combine_path(
+    const std::string& path1,
+    const std::string& path2,
+    const std::string& path3);
+
+std::string to_lowercase(
+    const std::string& string);
+
+std::string to_uppercase(
+    const std::string& string);
+
+std::string normalize_path(
+    const std::string& path);
+
+std::string extract_dir(
+    const std::string& path);
+
+std::string extract_file_name(
+    const std::string& path);
+
+std::string extract_file_name_without_extension(
+    const std::string& path);
+
+bool create_dir(
+    const std::string& path);
+
+bool create_dirs_along_the_path(
+    const std::string& path);
+
+bool is_file_exists(
+    const std::string& file_name);
+
+// Gets names of entries of a directory except "." and "..".
+bool get_dir_entries(
+    const std::string& dir,
+    std::vector<std::string>& names);
+
+// Gets a size and a time of the last modification of a file
+// (in the finest units the system provides).
+bool get_file_status(
+    const std::string& file_name,
+    long long& size,
+    long long& mtime);
+
+// Returns true if both names refer to the same existing file.
+bool is_same_file(
+    const std::string& file_name1,
+    const std::string& file_name2);
+
+// Computes 64-bit FNV-1a hash of a file content.
+bool hash_file(
+    const std::string& file_name,
+    unsigned long long& hash);
+
+// Computes 64-bit FNV-1a hash of data (as hash_file does).
+unsigned long long hash_data(
+    const unsigned char* data,
+    size_t size);
+
+// A read-only view of a whole file mapped into memory.
+class FileMapping {
+public:
+    FileMapping() :
+        data_(),
+        size_()
+    {
+    }
+
+    ~FileMapping()
+    {
+        close();
+    }
+
+    // Returns false if the file is empty or the mapping is not possible.
+    bool open(
+        const std::string& file_name);
+
+    void close();
+
+    const unsigned char* get_data() const
+    {
+        return data_;
+    }
+
+    size_t get_size() const
+    {
+        return size_;
+    }
+
+private:
+    const unsigned char* data_;
+    size_t size_;
+
+    FileMapping(
+        const FileMapping& that);
+
+    FileMapping& operator=(
+        const FileMapping& that);
+}; // class FileMapping
+
+template<typename T>
+void write_value(
+    T value,
+    std::ostream& stream)
+{
+    stream.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<typename T>
+void read_value(
+    T& value,
+    std::istream& stream)
+{
+    stream.read(reinterpret_cast<char*>(&value), sizeof(T));
+}
+
+// Stores a value in little-endian byte order.
+// Returns a pointer past the stored value.
+template<typename T>
+unsigned char* put_value(
+    T value,
+    unsigned char* data)
+{
+    for (size_t i = 0; i < sizeof(T); ++i) {
+        data[i] = static_cast<unsigned char>(value & 0xFF);
+        value = static_cast<T>(value >> 8);
+    }
+
+    return data + sizeof(T);
+}
+
+// Creates a file with the specified content in one go.
+bool write_file(
+    const std::string& file_name,
+    const unsigned char* data,
+    size_t size,
+    std::ostream& err = std::cerr);
+
+
+// ========================================================================
+
+
+const int k_max_width = 255;
+const int k_max_height = 255;
+
+const int k_panel_width = 79;
+const int k_panel_height = 112;
+
+const int k_panel_border_width = 3;
+const int k_panel_border_height = 112;
+
+typedef std::vector<unsigned char> Buffer;
+typedef unsigned char AuxPalette[16];
+typedef AuxPalette AuxPalettes[32];
+
+// A format of extracted images.
+enum ImageFormat {
+    e_format_bmp,
+    e_format_bmp_rle8,
+    e_format_png
+}; // enum ImageFormat
+
+// Guesses a format of an image by the extension of its file (BMP
+// by default).
+ImageFormat get_image_format(
+    const std::string& file_name);
+
+std::string get_image_extension(
+    ImageFormat format);
+
+
+// A VGA palette along with its BMP counterpart.
+class Palette {
+public:
+    // RGB triplets of 6-bit components.
+    unsigned char vga[768];
+
+    // RGBQUAD entries (blue, green, red, reserved) of a BMP file.
+    unsigned char bmp[1024];
+
+    Palette() :
+        vga(),
+        bmp()
+    {
+    }
+
+    // Converts the VGA palette into the BMP one.
+    void update_bmp()
+    {
+        for (int i = 0; i < 256; ++i) {
+            bmp[(4 * i) + 0] = convert_component(vga[(3 * i) + 2]);
+            bmp[(4 * i) + 1] = convert_component(vga[(3 * i) + 1]);
+            bmp[(4 * i) + 2] = convert_component(vga[(3 * i) + 0]);
+            bmp[(4 * i) + 3] = 0;
+        }
+    }
+
+private:
+    // Scales a 6-bit component to 8 bits (rounding down).
+    static unsigned char convert_component(
+        unsigned char value)
+    {
+        int clamped_value = (value < 63 ? value : 63);
+
+        return static_cast<unsigned char>((clamped_value * 255) / 63);
+    }
+}; // class Palette
+
+unsigned int get_le_u16(
+    const unsigned char* data);
+
+unsigned int get_le_u32(
+    const unsigned char* data);
+
+class ImageScratch;
+class ZlibEncoder;
+
+// An 8-bit indexed image with rows from top to bottom.
+class IndexedImage {
+public:
+    int width;
+    int height;
+    Buffer pixels;
+
+    IndexedImage() :
+        width(),
+        height(),
+        pixels()
+    {
+    }
+
+    // Loads an image of format according to extension of its file.
+    bool load_from_file(
+        const std::string& file_name,
+        int max_width,
+        int max_height,
+        std::ostream& err)
+    {
+        if (get_image_format(file_name) == e_format_png)
+            return load_from_png(file_name, max_width, max_height, err);
+        else
+            return load_from_bmp(file_name, max_width, max_height, err);
+    }
+
+    bool save_to_file(
+        const std::string& file_name,
+        ImageFormat format,
+        const Palette& palette,
+        std::ostream& err) const;
+
+    // Builds the file in buffers of the scratch. The contents
+    // of the file are left in scratch.file.
+    bool save_to_file(
+        const std::string& file_name,
+        ImageFormat format,
+        const Palette& palette,
+        ImageScratch& scratch,
+        std::ostream& err) const;
+
+private:
+    bool check_dimensions(
+        int max_width,
+        int max_height,
+        std::ostream& err) const;
+
+    bool load_from_bmp(
+        const std::string& file_name,
+        int max_width,
+        int max_height,
+        std::ostream& err);
+
+    // Returns pixels of a line in order of the lines in a BMP file.
+    unsigned char* get_line(
+        int line,
+        bool is_top_bottom)
+    {
+        int y = is_top_bottom ? line : height - 1 - line;
+
+        return &pixels[y * width];
+    }
+
+    // Decodes RLE8 data run by run. Runs may not cross the end
+    // of a line. A missing end of bitmap is tolerated.
+    bool decode_rle8(
+        const Buffer& data,
+        bool is_top_bottom,
+        std::ostream& err);
+
+    // Supports 8-bit indexed images only.
+    bool load_from_png(
+        const std::string& file_name,
+        int max_width,
+        int max_height,
+        std::ostream& err);
+
+    // Compressed images are stored bottom-up as RLE8 requires,
+    // uncompressed ones top-down.
+    bool save_to_bmp(
+        const std::string& file_name,
+        const Palette& palette,
+        bool is_compressed,
+        ImageScratch& scratch,
+        std::ostream& err) const;
+
+    // Encodes the pixels as bottom-up RLE8 data. Pixels of color 0
+    // at the end of a line or of the image and whole lines of them
+    // are skipped with escapes, and a decoder leaves them as color 0.
+    void encode_rle8(
+        Buffer& data) const;
+
+    static void encode_rle8_line(
+        const unsigned char* src,
+        int count,
+        Buffer& data);
+
+    // Returns a number of equal pixels at the offset (up to 255).
+    static int get_run_count(
+        const unsigned char* src,
+        int offset,
+        int count);
+
+    bool save_to_png(
+        const std::string& file_name,
+        const Palette& palette,
+        ImageScratch& scratch,
+        std::ostream& err) const;
+}; // class IndexedImage
+
+// Reusable buffers for exporting images. The buffers keep their
+// capacity, so exporting images one after another with the same
+// scratch does not allocate memory once the buffers have grown to
+// the largest image.
+class ImageScratch {
+public:
+    IndexedImage image; // decoded pixels
+    Buffer encoded; // RLE8 data or PNG scanlines
+    Buffer compressed; // deflated PNG scanlines
+    Buffer file; // contents of the file
+
+    ImageScratch() :
+        image(),
+        encoded(),
+        compressed(),
+        file(),
+        zlib_encoder_()
+    {
+    }
+
+    ~ImageScratch();
+
+    // Reserves the buffers for images up to the dimensions.
+    void reserve(
+        int width,
+        int height);
+
+    // Returns the encoder of PNG data, which keeps its tables.
+    ZlibEncoder& get_zlib_encoder();
+
+private:
+    ZlibEncoder* zlib_encoder_;
+
+    ImageScratch(
+        const ImageScratch& that);
+
+    ImageScratch& operator=(
+        const ImageScratch& that);
+}; // class ImageScratch
+
+// A set of 8-bit color indices.
+class ColorSet {
+public:
+    ColorSet()
+    {
+        clear();
+    }
+
+    ~ColorSet()
+    {
+    }
+
+    void clear()
+    {
+        std::fill_n(bits_, k_word_count, 0U);
+    }
+
+    void insert(
+        int color)
+    {
+        bits_[color / 32] |= 1U << (color % 32);
+    }
+
+    bool includes(
+        const ColorSet& that) const
+    {
+        for (int i = 0; i < k_word_count; ++i) {
+            if ((that.bits_[i] & ~bits_[i]) != 0)
+                return false;
+        }
+
+        return true;
+    }
+
+private:
+    enum {
+        k_word_count = 256 / 32
+    };
+
+    unsigned int bits_[k_word_count];
+}; // class ColorSet
+
+// Finds an auxiliary palette which has all colors of an image.
+class AuxPaletteIndex {
+public:
+    AuxPaletteIndex() :
+        aux_palettes_()
+    {
+    }
+
+    ~AuxPaletteIndex()
+    {
+    }
+
+    void build(
+        const AuxPalettes& aux_palettes)
+    {
+        aux_palettes_ = aux_palettes;
+
+        for (int i = 0; i < 32; ++i) {
+            color_sets_[i].clear();
+
+            for (int j = 0; j < 16; ++j)
+                color_sets_[i].insert(aux_palettes[i][j]);
+        }
+    }
+
+    // Returns a palette with all the colors or NULL.
+    // The preferred palette is checked first; a palette of another set
+    // is ignored.
+    const AuxPalette* find(
+        const ColorSet& colors,
+        const AuxPalette* preferred) const
+    {
+        if (!aux_palettes_)
+            return NULL;
+
+        if (preferred >= aux_palettes_ && preferred < aux_palettes_ + 32) {
+            int index = static_cast<int>(preferred - aux_palettes_);
+
+            if (color_sets_[index].includes(colors))
+                return preferred;
+        }
+
+        for (int i = 0; i < 32; ++i) {
+            if (color_sets_[i].includes(colors))
+                return &aux_palettes_[i];
+        }
+
+        return NULL;
+    }
+
+private:
+    const AuxPalette* aux_palettes_;
+    ColorSet color_sets_[32];
+
+    AuxPaletteIndex(
+        const AuxPaletteIndex& that);
+
+    AuxPaletteIndex& operator=(
+        const AuxPaletteIndex& that);
+}; // class AuxPaletteIndex
+
+class Bitmap {
+public:
+    enum Special {
+        e_none,
+        e_default,
+        e_panel,
+        e_last_panel
+    }; // enum Special
+
+    int type;
+    int width;
+    int height;
+
+    // If type is 4 the size in bytes otherwise in nibbles.
+    int data_size;
+
+    Special special;
+
+    // Pixels of a new or modified bitmap.
+    Buffer pixels;
+
+    // Pixels of an unmodified bitmap inside of a loaded .GR file.
+    // The file must outlive the bitmap.
+    const unsigned char* view;
+
+    const Palette* palette;
+    const AuxPalette* aux_palette;
+
+    Bitmap() :
+        type(),
+        width(),
+        height(),
+        data_size(),
+        special(),
+        pixels(),
+        view(),
+        palette(),
+        aux_palette()
+    {
+    }
+
+    Bitmap(
+        const Bitmap& that) :
+            type(that.type),
+            width(that.width),
+            height(that.height),
+            data_size(that.data_size),
+            special(that.special),
+            pixels(that.pixels),
+            view(that.view),
+            palette(that.palette),
+            aux_palette(that.aux_palette)
+    {
+    }
+
+    Bitmap& operator=(
+        const Bitmap& that)
+    {
+        if (&that != this) {
+            type = that.type;
+            width = that.width;
+            height = that.height;
+            data_size = that.data_size;
+            special = that.special;
+            pixels = that.pixels;
+            view = that.view;
+            palette = that.palette;
+            aux_palette = that.aux_palette;
+        }
+
+        return *this;
+    }
+
+    ~Bitmap()
+    {
+    }
+
+    // Does not copy the pixels but refers to them. The size is of the
+    // rest of the file from the data on, though only the header has to
+    // be in memory. Fails if the header or the pixels do not fit.
+    bool load_from_gr(
+        const void* data,
+        int size,
+        Special special,
+        const Palette* palette,
+        const AuxPalettes& aux_palette,
+        std::ostream& err = std::cerr);
+
+    void decompress(
+        Buffer& buffer) const;
+
+    // Decompresses pixels into an image.
+    void decode(
+        IndexedImage& image) const;
+
+    // Exports a bitmap into a file of the specified format.
+    bool export_to_image(
+        const std::string& file_name,
+        ImageFormat format,
+        std::ostream& out = std::cout,
+        std::ostream& err = std::cerr) const;
+
+    // Exports a bitmap decoding it into scratch.image.
+    bool export_to_image(
+        const std::string& file_name,
+        ImageFormat format,
+        ImageScratch& scratch,
+        std::ostream& out = std::cout,
+        std::ostream& err = std::cerr) const;
+
+    // Imports a bitmap from a file of format according to its extension.
+    // If an auxiliary palette index is specified the bitmap is encoded
+    // as 4-bit data when possible.
+    bool import_from_image(
+        const std::string& file_name,
+        Special special,
+        const AuxPaletteIndex* aux_palette_index,
+        std::ostream& out = std::cout,
+        std::ostream& err = std::cerr);
+
+    // Imports a bitmap from a region of an image (e.g., an atlas)
+    // at the specified position.
+    void import_from_region(
+        const IndexedImage& image,
+        int x,
+        int y,
+        Special special,
+        const AuxPaletteIndex* aux_palette_index);
+
+    // Checks dimensions of an image being imported against
+    // the original bitmap.
+    bool check_import_dimensions(
+        int width,
+        int height,
+        std::ostream& err) const;
+
+    // Encodes uncompressed pixels as type 8 or type 10 data whichever
+    // is smaller.
+    // Returns false if some color is not in the auxiliary palette or
+    // the encoded data is not smaller than uncompressed one.
+    bool compress(
+        const AuxPalette& aux_palette);
+
+    bool is_empty() const
+    {
+        return data_size == 0;
+    }
+
+    const unsigned char* get_pixels() const
+    {
+        if (view)
+            return view;
+        else if (!pixels.empty())
+            return &pixels[0];
+        else
+            return NULL;
+    }
+
+    bool is_compressed() const
+    {
+        return type != 4;
+    }
+
+    int get_header_size() const
+    {
+        if (special != e_default)
+            return 0;
+
+        // type, width, height, aux. palette index, image size
+        return 1 + 1 + 1 + (is_compressed() ? 1 : 0) + 2;
+    }
+
+    static int get_max_header_size()
+    {
+        return 6;
+    }
+
+    int get_size_in_bytes() const
+    {
+        if (is_compressed())
+            return (data_size + 1) / 2;
+        else
+            return data_size;
+    }
+
+private:
+    // Makes a bitmap out of imported pixels.
+    // Uses 4-bit data if all colors are in one auxiliary palette.
+    void finish_import(
+        Special special,
+        const AuxPaletteIndex* aux_palette_index);
+
+    // A state of the type 8 record grammar.
+    enum Type8State {
+        e_t8_repeat, // a repeat record (count 1: skip, count 2: multiple)
+        e_t8_repeat_count, // a number of repeat records that follow
+        e_t8_multi_repeat, // one of multiple repeat records
+        e_t8_run, // a run record
+        e_t8_invalid
+    }; // enum Type8State
+
+    enum Type8Action {
+        e_t8_none,
+        e_t8_fill,
+        e_t8_copy,
+        e_t8_set_repeats
+    }; // enum Type8Action
+
+    struct Type8Transition {
+        Type8Action action;
+        Type8State next_state;
+    }; // struct Type8Transition
+
+    static int get_nibble(
+        const unsigned char* data,
+        int nibble_offset)
+    {
+        int octet = data[nibble_offset / 2];
+
+        if ((nibble_offset % 2) == 0)
+            return octet >> 4;
+        else
+            return octet & 0x0F;
+    }
+
+    // Reads a count of the type 8 record.
+    // Returns false if there is not enough data.
+    static bool read_rle_count(
+        const unsigned char* data,
+        int data_size,
+        int& nibble_offset,
+        int& count);
+
+    // Decodes type 8 data record by record instead of nibble by nibble.
+    // Returns false on any stream the reference decoder handles
+    // in a non-obvious way (truncated data, zero counts, nested multiple
+    // repeat records, etc.); the output is undefined in that case.
+    bool decompress_rle_fast(
+        unsigned char* buffer) const;
+
+    // Reference type 8 decoder.
+    void decompress_rle(
+        unsigned char* buffer) const;
+}; // class Bitmap
+
+typedef std::vector<Bitmap> Bitmaps;
+typedef Bitmaps::iterator BitmapsIt;
+typedef Bitmaps::const_iterator BitmapsCIt;
+
+// A known resource of UW2.
+class Resource {
+public:
+    const char* file_name;
+    int palette_index;
+
+    // Bitmaps without headers (see Bitmap::e_panel).
+    bool is_panels;
+}; // class Resource
+
+// Returns a known resource by a file name in upper case or NULL.
+const Resource* find_resource(
+    const std::string& file_name);
+
+int get_resource_count();
+
+// Resources are ordered as a data directory is processed.
+const Resource& get_resource(
+    int index);
+
+// VGA palettes (PALS.DAT) and auxiliary palettes (ALLPALS.DAT).
+class PaletteSet {
+public:
+    static const int k_palette_count = 8;
+
+    PaletteSet() :
+        aux_palettes_(),
+        aux_palette_index_()
+    {
+    }
+
+    ~PaletteSet()
+    {
+    }
+
+    // Loads the files from a directory.
+    bool load(
+        const std::string& dir,
+        std::ostream& out = std::cout,
+        std::ostream& err = std::cerr);
+
+    // Loads palettes from contents of the files.
+    bool load_from_memory(
+        const unsigned char* pals_data,
+        size_t pals_size,
+        const unsigned char* allpals_data,
+        size_t allpals_size,
+        std::ostream& err = std::cerr);
+
+    const Palette& get_palette(
+        int index) const
+    {
+        return palettes_[index];
+    }
+
+    const AuxPalettes& get_aux_palettes() const
+    {
+        return aux_palettes_;
+    }
+
+    const AuxPaletteIndex& get_aux_palette_index() const
+    {
+        return aux_palette_index_;
+    }
+
+private:
+    Palette palettes_[k_palette_count];
+    AuxPalettes aux_palettes_;
+    AuxPaletteIndex aux_palette_index_;
+
+    PaletteSet(
+        const PaletteSet& that);
+
+    PaletteSet& operator=(
+        const PaletteSet& that);
+}; // class PaletteSet
+
+// Decoded images of an archive ordered from the most to the least
+// recently used one. The size of pixels of all images is kept within
+// the capacity by dropping the least recently used images (the most
+// recent one is always kept).
+class ImageCache {
+public:
+    static const size_t k_default_capacity = 4 * 1024 * 1024;
+
+    ImageCache() :
+        capacity_(k_default_capacity),
+        size_(),
+        hit_count_(),
+        miss_count_(),
+        entries_(),
+        slots_()
+    {
+    }
+
+    ~ImageCache()
+    {
+    }
+
+    // Drops all images and prepares slots for images with indices
+    // in range [0, slot_count).
+    void reset(
+        int slot_count);
+
+    // Drops all images and slots. Counters are kept.
+    void clear();
+
+    // Returns an image and marks it as the most recently used one,
+    // or NULL if it's not in the cache.
+    const IndexedImage* find(
+        int index);
+
+    // Takes pixels of the image and adds it as the most recently used
+    // one. Returns the added image.
+    const IndexedImage* insert(
+        int index,
+        IndexedImage& image);
+
+    // Drops an image if it's in the cache.
+    void remove(
+        int index);
+
+    void set_capacity(
+        size_t capacity);
+
+    size_t get_capacity() const
+    {
+        return capacity_;
+    }
+
+    // Returns the total size of pixels in bytes.
+    size_t get_size() const
+    {
+        return size_;
+    }
+
+    int get_count() const
+    {
+        return static_cast<int>(entries_.size());
+    }
+
+    unsigned long get_hit_count() const
+    {
+        return hit_count_;
+    }
+
+    unsigned long get_miss_count() const
+    {
+        return miss_count_;
+    }
+
+    void reset_counters()
+    {
+        hit_count_ = 0;
+        miss_count_ = 0;
+    }
+
+private:
+    class Entry {
+    public:
+        int index;
+        IndexedImage image;
+
+        Entry() :
+            index(),
+            image()
+        {
+        }
+    }; // class Entry
+
+    typedef std::list<Entry> Entries;
+    typedef std::vector<Entries::iterator> Slots;
+
+    size_t capacity_;
+    size_t size_;
+    unsigned long hit_count_;
+    unsigned long miss_count_;
+    Entries entries_;
+    Slots slots_;
+
+    ImageCache(
+        const ImageCache& that);
+
+    ImageCache& operator=(
+        const ImageCache& that);
+
+    // Drops the least recently used images while over the capacity.
+    void trim();
+}; // class ImageCache
+
+// A .GR file with its bitmaps. Bitmaps refer to the data of the file,
+// which is mapped into memory or kept in memory. If neither is possible
+// only headers of bitmaps are read, and pixels are read on demand (see
+// fetch_bitmap). Bitmaps of an archive in memory may be decoded from
+// several threads at once.
+//
+// Opening checks the offset table and the headers of all bitmaps
+// against the size of the file, so decoding needs no checks. The first
+// problem is reported to err and the opening fails.
+class GrArchive {
+public:
+    GrArchive() :
+        resource_(),
+        palette_set_(),
+        file_name_(),
+        data_(),
+        size_()
+    {
+    }
+
+    ~GrArchive()
+    {
+    }
+
+    // Opens a file of the resource. The palette set must outlive
+    // the archive.
+    bool open(
+        const std::string& file_name,
+        const Resource& resource,
+        const PaletteSet& palette_set,
+        std::ostream& err = std::cerr);
+
+    // Opens a copy of the contents of a file.
+    bool open_from_memory(
+        const unsigned char* data,
+        size_t size,
+        const Resource& resource,
+        const PaletteSet& palette_set,
+        std::ostream& err = std::cerr);
+
+    // Releases the file and the bitmaps.
+    void close();
+
+    // Saves the bitmaps into a file and closes the archive.
+    // The file may be the opened one.
+    bool save(
+        const std::string& file_name,
+        std::ostream& err = std::cerr);
+
+    int get_bitmap_count() const
+    {
+        return static_cast<int>(bitmaps_.size());
+    }
+
+    // Returns a bitmap for modification. A decoded image of the bitmap
+    // is dropped from the cache.
+    Bitmap& get_bitmap(
+        int index)
+    {
+        image_cache_.remove(index);
+        return bitmaps_[index];
+    }
+
+    const Bitmap& get_bitmap(
+        int index) const
+    {
+        return bitmaps_[index];
+    }
+
+    // Makes pixels of an unmodified bitmap available.
+    // If the file is not in memory they are read into the buffer.
+    bool fetch_bitmap(
+        int index,
+        Buffer& buffer,
+        std::ostream& err = std::cerr);
+
+    // Forgets pixels read by fetch_bitmap.
+    void release_bitmap(
+        int index);
+
+    // Decodes pixels of a bitmap into an image.
+    bool decode_bitmap(
+        int index,
+        IndexedImage& image,
+        std::ostream& err = std::cerr);
+
+    // Returns a decoded image of a bitmap or NULL on error. The image is
+    // decoded on the first request and then taken from the cache. The
+    // pointer is valid until the next call of get_image or get_bitmap,
+    // or until the archive is closed. Not thread-safe.
+    const IndexedImage* get_image(
+        int index,
+        std::ostream& err = std::cerr);
+
+    ImageCache& get_image_cache()
+    {
+        return image_cache_;
+    }
+
+    const ImageCache& get_image_cache() const
+    {
+        return image_cache_;
+    }
+
+    const Resource* get_resource() const
+    {
+        return resource_;
+    }
+
+    const PaletteSet* get_palette_set() const
+    {
+        return palette_set_;
+    }
+
+private:
+    const Resource* resource_;
+    const PaletteSet* palette_set_;
+    Bitmaps bitmaps_;
+    FileMapping mapping_;
+    Buffer contents_;
+    std::string file_name_; // empty for a file in memory
+    const unsigned char* data_;
+    size_t size_; // of the file
+    std::ifstream stream_;
+    std::vector<int> data_offsets_;
+    ImageCache image_cache_;
+
+    GrArchive(
+        const GrArchive& that);
+
+    GrArchive& operator=(
+        const GrArchive& that);
+
+    // Reads the tables and headers of bitmaps.
+    bool load(
+        const Resource& resource,
+        const PaletteSet& palette_set,
+        std::ostream& err);
+
+    // Returns a pointer to a part of the file or NULL on error.
+    // If the file is not in memory the part is read into the buffer.
+    const unsigned char* read(
+        int offset,
+        int size,
+        Buffer& buffer,
+        std::ostream& err);
+}; // class GrArchive
+
+} // namespace uw2_gr
+
+
+#endif // UW2_GR_H
@@ -0,0 +1,708 @@
+/*
+    uw2_gr_tool: "Ultima Underworld II" .GR extracter/rebuilder.
+    Copyright (C) 2014, Boris I. Bendovsky <bibendovsky@hotmail.com>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+// Benchmarks of the hot paths of the library on a synthetic archive.
+
+
+#include "uw2_gr.h"
+#include "uw2_gr_synthetic.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+namespace {
+
+
+using namespace uw2_gr;
+
+
+// A number of calls of the global operator new.
+unsigned long g_allocation_count = 0;
+
+
+// Accumulated results of a benchmark.
+class Measurement {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    std::string name;
+    double image_count;
+    double byte_count;
+    double seconds;
+    double allocation_count;
+
+    explicit Measurement(
+        const std::string& name) :
+            name(name),
+            image_count(),
+            byte_count(),
+            seconds(),
+            allocation_count(),
+            start_time_(),
+            start_allocation_count_()
+    {
+    }
+
+    void start()
+    {
+        start_allocation_count_ = g_allocation_count;
+        start_time_ = Clock::now();
+    }
+
+    void stop()
+    {
+        Clock::time_point stop_time = Clock::now();
+
+        seconds += std::chrono::duration<double>(
+            stop_time - start_time_).count();
+
+        allocation_count += g_allocation_count - start_allocation_count_;
+    }
+
+    double get_images_per_second() const
+    {
+        return seconds > 0.0 ? image_count / seconds : 0.0;
+    }
+
+    // Megabytes are 10^6 bytes.
+    double get_megabytes_per_second() const
+    {
+        return seconds > 0.0 ? byte_count / seconds / 1000000.0 : 0.0;
+    }
+
+    double get_allocations_per_image() const
+    {
+        return image_count > 0.0 ? allocation_count / image_count : 0.0;
+    }
+
+private:
+    Clock::time_point start_time_;
+    unsigned long start_allocation_count_;
+}; // class Measurement
+
+typedef std::vector<Measurement> Measurements;
+
+
+const char* const k_resource_file_name = "OBJECTS.GR";
+
+const int k_min_dimension = 16;
+const int k_max_dimension = 160;
+
+int g_iteration_count = 10;
+int g_bitmaps_per_type = 64;
+std::string g_dir = ".";
+std::string g_json_file_name;
+
+PaletteSet g_palette_set;
+const Resource* g_resource = NULL;
+
+// An output for messages of the library.
+std::ostream g_null_stream(NULL);
+
+
+// Makes a .GR file with bitmaps of types 4, 8 and 10.
+bool make_archive(
+    const std::string& file_name)
+{
+    Random random(1992);
+    Bitmaps bitmaps;
+    IndexedImage image;
+
+    for (int i = 0; i < 3 * g_bitmaps_per_type; ++i) {
+        static const int types[3] = { 4, 8, 10 };
+
+        int type = types[i % 3];
+
+        make_synthetic_image(
+            type, k_min_dimension, k_max_dimension, g_palette_set,
+            random, image);
+
+        bitmaps.push_back(Bitmap());
+
+        Bitmap& bitmap = bitmaps.back();
+        bitmap.width = image.width;
+        bitmap.height = image.height;
+        bitmap.import_from_region(
+            image, 0, 0, Bitmap::e_default,
+            &g_palette_set.get_aux_palette_index());
+
+        if (bitmap.type != type) {
+            std::cerr << "ERROR: Unexpected type of a synthetic bitmap." <<
+                std::endl;
+            return false;
+        }
+    }
+
+    int bitmap_count = static_cast<int>(bitmaps.size());
+    unsigned int offset = 3 + (4 * (bitmap_count + 1));
+    Buffer data(offset);
+
+    put_value(static_cast<unsigned char>(1), &data[0]);
+    put_value(static_cast<unsigned short>(bitmap_count), &data[1]);
+    put_value(offset, &data[3]);
+
+    for (int i = 0; i < bitmap_count; ++i) {
+        const Bitmap& bitmap = bitmaps[i];
+
+        data.push_back(static_cast<unsigned char>(bitmap.type));
+        data.push_back(static_cast<unsigned char>(bitmap.width));
+        data.push_back(static_cast<unsigned char>(bitmap.height));
+
+        if (bitmap.is_compressed()) {
+            int aux_palette_index = static_cast<int>(
+                bitmap.aux_palette - g_palette_set.get_aux_palettes());
+
+            data.push_back(static_cast<unsigned char>(aux_palette_index));
+        }
+
+        data.push_back(static_cast<unsigned char>(bitmap.data_size & 0xFF));
+        data.push_back(static_cast<unsigned char>(bitmap.data_size >> 8));
+
+        const unsigned char* pixels = bitmap.get_pixels();
+        data.insert(data.end(), pixels, pixels + bitmap.get_size_in_bytes());
+
+        // The data may be reallocated, so the offset is put by index.
+        offset = static_cast<unsigned int>(data.size());
+        put_value(offset, &data[3 + (4 * (i + 1))]);
+    }
+
+    return write_file(file_name, &data[0], data.size());
+}
+
+double get_file_size(
+    const std::string& file_name)
+{
+    std::ifstream file(
+        file_name.c_str(), std::ios_base::in | std::ios_base::binary);
+
+    file.seekg(0, std::ios_base::end);
+
+    return static_cast<double>(file.tellg());
+}
+
+std::string get_image_file_name(
+    int index,
+    ImageFormat format)
+{
+    std::ostringstream stream;
+
+    stream << "uw2_gr_bench_" << index <<
+        (format == e_format_bmp_rle8 ? "_rle8" : "") <<
+        get_image_extension(format);
+
+    return combine_path(g_dir, stream.str());
+}
+
+// Returns a name of a benchmark of an operation on images
+// of the format.
+std::string get_benchmark_name(
+    const std::string& operation,
+    ImageFormat format)
+{
+    switch (format) {
+    case e_format_bmp_rle8:
+        return operation + "_bmp_rle8";
+
+    case e_format_png:
+        return operation + "_png";
+
+    default:
+        return operation + "_bmp";
+    }
+}
+
+bool bench_load(
+    const std::string& file_name,
+    Measurements& measurements)
+{
+    Measurement measurement("load");
+    double file_size = get_file_size(file_name);
+
+    for (int i = 0; i < g_iteration_count; ++i) {
+        GrArchive archive;
+
+        measurement.start();
+
+        bool is_opened = archive.open(
+            file_name, *g_resource, g_palette_set, std::cerr);
+
+        measurement.stop();
+
+        if (!is_opened)
+            return false;
+
+        measurement.image_count += archive.get_bitmap_count();
+        measurement.byte_count += file_size;
+    }
+
+    measurements.push_back(measurement);
+
+    return true;
+}
+
+// Makes pixels of all bitmaps available before the benchmarks, so they
+// do not time reading of a file which is not mapped into memory.
+bool fetch_bitmaps(
+    GrArchive& archive,
+    std::vector<Buffer>& buffers)
+{
+    buffers.resize(archive.get_bitmap_count());
+
+    for (int i = 0; i < archive.get_bitmap_count(); ++i) {
+        if (!archive.fetch_bitmap(i, buffers[i]))
+            return false;
+
+        const Bitmap& bitmap = archive.get_bitmap(i);
+
+        if (!bitmap.is_empty() && !bitmap.get_pixels()) {
+            std::cerr << "ERROR: No pixels of bitmap " << i << '.' <<
+                std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void release_bitmaps(
+    GrArchive& archive)
+{
+    for (int i = 0; i < archive.get_bitmap_count(); ++i)
+        archive.release_bitmap(i);
+}
+
+void bench_decompress(
+    GrArchive& archive,
+    int type,
+    Measurements& measurements)
+{
+    std::ostringstream name;
+    name << "decompress_type" << type;
+
+    Measurement measurement(name.str());
+    Buffer buffer;
+
+    // The first pass reserves the buffer.
+    for (int i = 0; i <= g_iteration_count; ++i) {
+        if (i == 1)
+            measurement.start();
+
+        for (int j = 0; j < archive.get_bitmap_count(); ++j) {
+            const Bitmap& bitmap = archive.get_bitmap(j);
+
+            if (bitmap.type != type)
+                continue;
+
+            bitmap.decompress(buffer);
+
+            if (i > 0) {
+                measurement.image_count += 1;
+                measurement.byte_count += bitmap.width * bitmap.height;
+            }
+        }
+    }
+
+    measurement.stop();
+    measurements.push_back(measurement);
+}
+
+bool bench_export(
+    GrArchive& archive,
+    ImageFormat format,
+    Measurements& measurements)
+{
+    Measurement measurement(get_benchmark_name("export", format));
+
+    // Buffers sized to the largest bitmap are reused, so exporting
+    // should not allocate memory.
+    int max_width = 0;
+    int max_height = 0;
+
+    for (int i = 0; i < archive.get_bitmap_count(); ++i) {
+        const Bitmap& bitmap = archive.get_bitmap(i);
+
+        max_width = std::max(max_width, bitmap.width);
+        max_height = std::max(max_height, bitmap.height);
+    }
+
+    ImageScratch scratch;
+    scratch.reserve(
+        std::min(max_width, k_max_width),
+        std::min(max_height, k_max_height));
+
+    // The first pass grows buffers which are not reserved (e.g.,
+    // deflated data of PNG files).
+    for (int i = 0; i <= g_iteration_count; ++i) {
+        for (int j = 0; j < archive.get_bitmap_count(); ++j) {
+            std::string file_name = get_image_file_name(j, format);
+
+            if (i > 0)
+                measurement.start();
+
+            bool is_exported = archive.get_bitmap(j).export_to_image(
+                file_name, format, scratch, g_null_stream, std::cerr);
+
+            if (i > 0)
+                measurement.stop();
+
+            if (!is_exported)
+                return false;
+
+            if (i > 0) {
+                measurement.image_count += 1;
+                measurement.byte_count += get_file_size(file_name);
+            }
+        }
+    }
+
+    measurements.push_back(measurement);
+
+    return true;
+}
+
+// Imports images written by bench_export.
+bool bench_import(
+    GrArchive& archive,
+    ImageFormat format,
+    Measurements& measurements)
+{
+    Measurement measurement(get_benchmark_name("import", format));
+
+    for (int i = 0; i < g_iteration_count; ++i) {
+        for (int j = 0; j < archive.get_bitmap_count(); ++j) {
+            std::string file_name = get_image_file_name(j, format);
+            Bitmap bitmap(archive.get_bitmap(j));
+
+            measurement.start();
+
+            bool is_imported = bitmap.import_from_image(
+                file_name, Bitmap::e_default,
+                &g_palette_set.get_aux_palette_index(),
+                g_null_stream, std::cerr);
+
+            measurement.stop();
+
+            if (!is_imported)
+                return false;
+
+            measurement.image_count += 1;
+            measurement.byte_count += get_file_size(file_name);
+        }
+    }
+
+    measurements.push_back(measurement);
+
+    return true;
+}
+
+bool bench_save(
+    const std::string& file_name,
+    const std::string& new_file_name,
+    Measurements& measurements)
+{
+    Measurement measurement("save");
+
+    for (int i = 0; i < g_iteration_count; ++i) {
+        GrArchive archive;
+
+        if (!archive.open(file_name, *g_resource, g_palette_set))
+            return false;
+
+        int bitmap_count = archive.get_bitmap_count();
+
+        measurement.start();
+
+        bool is_saved = archive.save(new_file_name);
+
+        measurement.stop();
+
+        if (!is_saved)
+            return false;
+
+        measurement.image_count += bitmap_count;
+        measurement.byte_count += get_file_size(new_file_name);
+    }
+
+    measurements.push_back(measurement);
+
+    return true;
+}
+
+void print_measurements(
+    const Measurements& measurements)
+{
+    std::cout <<
+        std::left << std::setw(20) << "benchmark" << std::right <<
+        std::setw(14) << "images/s" <<
+        std::setw(12) << "MB/s" <<
+        std::setw(14) << "allocs/image" << std::endl;
+
+    std::cout << std::fixed;
+
+    for (size_t i = 0; i < measurements.size(); ++i) {
+        const Measurement& measurement = measurements[i];
+
+        std::cout <<
+            std::left << std::setw(20) << measurement.name << std::right <<
+            std::setprecision(0) <<
+            std::setw(14) << measurement.get_images_per_second() <<
+            std::setprecision(2) <<
+            std::setw(12) << measurement.get_megabytes_per_second() <<
+            std::setw(14) << measurement.get_allocations_per_image() <<
+            std::endl;
+    }
+}
+
+bool save_measurements_to_json(
+    const std::string& file_name,
+    const Measurements& measurements)
+{
+    std::ostringstream stream;
+
+    stream << std::setprecision(9);
+
+    stream <<
+        "{" << std::endl <<
+        "  \"version\": 1," << std::endl <<
+        "  \"iterations\": " << g_iteration_count << "," << std::endl <<
+        "  \"bitmaps_per_type\": " << g_bitmaps_per_type << "," << std::endl <<
+        "  \"benchmarks\": [" << std::endl;
+
+    for (size_t i = 0; i < measurements.size(); ++i) {
+        const Measurement& measurement = measurements[i];
+
+        stream <<
+            "    {" <<
+            "\"name\": \"" << measurement.name << "\", " <<
+            "\"images\": " << measurement.image_count << ", " <<
+            "\"bytes\": " << measurement.byte_count << ", " <<
+            "\"seconds\": " << measurement.seconds << ", " <<
+            "\"images_per_second\": " <<
+                measurement.get_images_per_second() << ", " <<
+            "\"mb_per_second\": " <<
+                measurement.get_megabytes_per_second() << ", " <<
+            "\"allocations_per_image\": " <<
+                measurement.get_allocations_per_image() <<
+            "}" << (i + 1 < measurements.size() ? "," : "") << std::endl;
+    }
+
+    stream <<
+        "  ]" << std::endl <<
+        "}" << std::endl;
+
+    std::string json = stream.str();
+
+    if (file_name == "-") {
+        std::cout << json;
+        return true;
+    }
+
+    return write_file(
+        file_name,
+        reinterpret_cast<const unsigned char*>(json.c_str()),
+        json.size());
+}
+
+void usage()
+{
+    std::cout <<
+        "Usage: uw2_gr_bench [options]" << std::endl <<
+        std::endl <<
+        "  Options:" << std::endl <<
+        "  --iterations=<count>  Passes over all bitmaps (10 by default)." << std::endl <<
+        "  --bitmaps=<count>     Bitmaps of each type (64 by default)." << std::endl <<
+        "  --dir=<dir>           Directory for temporary files (current by default)." << std::endl <<
+        "  --json=<file>         Also write results as JSON (\"-\" for standard output)." << std::endl
+    ;
+}
+
+bool parse_count(
+    const std::string& value,
+    int max_count,
+    int& count)
+{
+    char* end = NULL;
+    long result = std::strtol(value.c_str(), &end, 10);
+
+    if (value.empty() || *end != '\0' || result < 1 || result > max_count) {
+        std::cerr << "ERROR: Invalid count \"" << value << "\"." << std::endl;
+        return false;
+    }
+
+    count = static_cast<int>(result);
+
+    return true;
+}
+
+bool parse_options(
+    int argc,
+    char* argv[])
+{
+    for (int i = 1; i < argc; ++i) {
+        std::string option = argv[i];
+
+        if (option.compare(0, 13, "--iterations=") == 0) {
+            if (!parse_count(option.substr(13), 100000, g_iteration_count))
+                return false;
+        } else if (option.compare(0, 10, "--bitmaps=") == 0) {
+            // An archive holds up to 65535 bitmaps.
+            if (!parse_count(option.substr(10), 21845, g_bitmaps_per_type))
+                return false;
+        } else if (option.compare(0, 6, "--dir=") == 0)
+            g_dir = option.substr(6);
+        else if (option.compare(0, 7, "--json=") == 0)
+            g_json_file_name = option.substr(7);
+        else {
+            std::cerr << "ERROR: Unknown option \"" <<
+                option << "\"." << std::endl;
+            usage();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool run(
+    Measurements& measurements)
+{
+    if (!make_synthetic_palette_set(g_palette_set))
+        return false;
+
+    g_resource = find_resource(k_resource_file_name);
+
+    std::string file_name = combine_path(g_dir, "uw2_gr_bench.gr");
+    std::string new_file_name = combine_path(g_dir, "uw2_gr_bench_new.gr");
+
+    if (!make_archive(file_name))
+        return false;
+
+    if (!bench_load(file_name, measurements))
+        return false;
+
+    GrArchive archive;
+    std::vector<Buffer> buffers;
+
+    if (!archive.open(file_name, *g_resource, g_palette_set) ||
+        !fetch_bitmaps(archive, buffers))
+    {
+        return false;
+    }
+
+    bench_decompress(archive, 4, measurements);
+    bench_decompress(archive, 8, measurements);
+    bench_decompress(archive, 10, measurements);
+
+    if (!bench_export(archive, e_format_bmp, measurements) ||
+        !bench_export(archive, e_format_bmp_rle8, measurements) ||
+        !bench_export(archive, e_format_png, measurements) ||
+        !bench_import(archive, e_format_bmp, measurements) ||
+        !bench_import(archive, e_format_bmp_rle8, measurements) ||
+        !bench_import(archive, e_format_png, measurements))
+    {
+        return false;
+    }
+
+    release_bitmaps(archive);
+    archive.close();
+
+    return bench_save(file_name, new_file_name, measurements);
+}
+
+void remove_files()
+{
+    for (int i = 0; i < 3 * g_bitmaps_per_type; ++i) {
+        std::remove(get_image_file_name(i, e_format_bmp).c_str());
+        std::remove(get_image_file_name(i, e_format_bmp_rle8).c_str());
+        std::remove(get_image_file_name(i, e_format_png).c_str());
+    }
+
+    std::remove(combine_path(g_dir, "uw2_gr_bench.gr").c_str());
+    std::remove(combine_path(g_dir, "uw2_gr_bench_new.gr").c_str());
+}
+
+} // namespace
+
+
+// Counts allocations.
+void* operator new(
+    size_t size)
+{
+    ++g_allocation_count;
+
+    void* pointer = std::malloc(size > 0 ? size : 1);
+
+    if (!pointer)
+        throw std::bad_alloc();
+
+    return pointer;
+}
+
+// Inlined into callers it makes GCC report free() of memory allocated
+// by operator new.
+#ifdef __GNUC__
+__attribute__((noinline))
+#endif
+void operator delete(
+    void* pointer) noexcept
+{
+    std::free(pointer);
+}
+
+
+int main(
+    int argc,
+    char* argv[])
+{
+    if (!parse_options(argc, argv))
+        return 1;
+
+    Measurements measurements;
+
+    bool is_succeed = run(measurements);
+
+    remove_files();
+
+    if (!is_succeed) {
+        std::cerr << "ERROR: Benchmark failed." << std::endl;
+        return 1;
+    }
+
+    if (g_json_file_name != "-")
+        print_measurements(measurements);
+
+    if (!g_json_file_name.empty() &&
+        !save_measurements_to_json(g_json_file_name, measurements))
+    {
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,119 @@
+/*
+    uw2_gr_tool: "Ultima Underworld II" .GR extracter/rebuilder.
+    Copyright (C) 2014, Boris I. Bendovsky <bibendovsky@hotmail.com>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+// libFuzzer target of the .GR parser and of the decoders. An input is
+// the contents of a .GR file which is opened as a regular and as a panels
+// resource, and every bitmap of it is decoded.
+//
+// With UW2_GR_TOOL_FUZZ_STANDALONE the target is a program which runs
+// files specified on the command line (to reproduce a crash without
+// libFuzzer).
+
+
+#include "uw2_gr.h"
+#include "uw2_gr_synthetic.h"
+
+#include <cstddef>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+
+
+namespace {
+
+
+using namespace uw2_gr;
+
+
+const Resource k_resources[] = {
+    { "FUZZ.GR", 0, false },
+    { "PANELS.GR", 0, true }
+}; // k_resources
+
+const int k_resource_count =
+    static_cast<int>(sizeof(k_resources) / sizeof(k_resources[0]));
+
+
+const PaletteSet& get_palette_set()
+{
+    static PaletteSet palette_set;
+    static bool is_made = make_synthetic_palette_set(palette_set);
+
+    static_cast<void>(is_made);
+
+    return palette_set;
+}
+
+
+} // namespace
+
+
+extern "C" int LLVMFuzzerTestOneInput(
+    const unsigned char* data,
+    size_t size)
+{
+    const PaletteSet& palette_set = get_palette_set();
+
+    std::ostream null_stream(NULL);
+    GrArchive archive;
+    IndexedImage image;
+
+    for (int i = 0; i < k_resource_count; ++i) {
+        if (!archive.open_from_memory(
+            data, size, k_resources[i], palette_set, null_stream))
+        {
+            continue;
+        }
+
+        for (int j = 0; j < archive.get_bitmap_count(); ++j)
+            archive.decode_bitmap(j, image, null_stream);
+    }
+
+    return 0;
+}
+
+#ifdef UW2_GR_TOOL_FUZZ_STANDALONE
+int main(
+    int argc,
+    char* argv[])
+{
+    for (int i = 1; i < argc; ++i) {
+        std::ifstream file(
+            argv[i], std::ios_base::in | std::ios_base::binary);
+
+        if (!file) {
+            std::cerr << "ERROR: Failed to open \"" << argv[i] << "\"." <<
+                std::endl;
+            return 1;
+        }
+
+        Buffer contents(
+            (std::istreambuf_iterator<char>(file)),
+            std::istreambuf_iterator<char>());
+
+        std::cout << "Running \"" << argv[i] << "\"." << std::endl;
+
+        LLVMFuzzerTestOneInput(
+            contents.empty() ? NULL : &contents[0], contents.size());
+    }
+
+    return 0;
+}
+#endif // UW2_GR_TOOL_FUZZ_STANDALONE
@@ -0,0 +1,90 @@
+/*
+    uw2_gr_tool: "Ultima Underworld II" .GR extracter/rebuilder.
+    Copyright (C) 2014, Boris I. Bendovsky <bibendovsky@hotmail.com>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "uw2_gr_synthetic.h"
+
+
+namespace uw2_gr {
+
+
+bool make_synthetic_palette_set(
+    PaletteSet& palette_set)
+{
+    Buffer pals(PaletteSet::k_palette_count * 768);
+
+    for (size_t i = 0; i < pals.size(); ++i)
+        pals[i] = static_cast<unsigned char>((i * 7) % 64);
+
+    Buffer allpals(32 * 16);
+
+    for (int i = 0; i < 32; ++i) {
+        for (int j = 0; j < 16; ++j) {
+            allpals[(16 * i) + j] =
+                static_cast<unsigned char>(((8 * i) + j) % 256);
+        }
+    }
+
+    return palette_set.load_from_memory(
+        &pals[0], pals.size(), &allpals[0], allpals.size());
+}
+
+void make_synthetic_image(
+    int type,
+    int min_dimension,
+    int max_dimension,
+    const PaletteSet& palette_set,
+    Random& random,
+    IndexedImage& image)
+{
+    image.width = random.get(min_dimension, max_dimension);
+    image.height = random.get(min_dimension, max_dimension);
+    image.pixels.resize(image.width * image.height);
+
+    const AuxPalette& aux_palette =
+        palette_set.get_aux_palettes()[random.get(32)];
+
+    int pixel_count = static_cast<int>(image.pixels.size());
+
+    for (int i = 0; i < pixel_count; ) {
+        int color = 0;
+        int count = 1;
+
+        switch (type) {
+        case 4:
+            color = random.get(256);
+            break;
+
+        case 8:
+            color = aux_palette[random.get(16)];
+            count = random.get(4, 40);
+            break;
+
+        default:
+            color = aux_palette[random.get(16)];
+            break;
+        }
+
+        for ( ; count > 0 && i < pixel_count; --count)
+            image.pixels[i++] = static_cast<unsigned char>(color);
+    }
+}
+
+
+} // namespace uw2_gr
@@ -0,0 +1,92 @@
+/*
+    uw2_gr_tool: "Ultima Underworld II" .GR extracter/rebuilder.
+    Copyright (C) 2014, Boris I. Bendovsky <bibendovsky@hotmail.com>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+// Synthetic data for the benchmark, the fuzzer and the tests, so they
+// need no game data.
+
+
+#ifndef UW2_GR_SYNTHETIC_H
+#define UW2_GR_SYNTHETIC_H
+
+
+#include "uw2_gr.h"
+
+
+namespace uw2_gr {
+
+
+// A linear congruential generator, so the data is the same on every
+// platform.
+class Random {
+public:
+    explicit Random(
+        unsigned int seed) :
+            state_(seed)
+    {
+    }
+
+    ~Random()
+    {
+    }
+
+    // Returns a number in range [0, limit).
+    int get(
+        int limit)
+    {
+        state_ = (state_ * 1103515245U) + 12345U;
+
+        return static_cast<int>((state_ >> 16) % limit);
+    }
+
+    // Returns a number in range [min_value, max_value].
+    int get(
+        int min_value,
+        int max_value)
+    {
+        return min_value + get(max_value - min_value + 1);
+    }
+
+private:
+    unsigned int state_;
+}; // class Random
+
+// Makes palettes where the auxiliary palette N consists of colors
+// (8 * N + i) % 256 for i in range [0, 16), so neighbouring palettes
+// share eight colors and the last one wraps around to colors [0, 8).
+bool make_synthetic_palette_set(
+    PaletteSet& palette_set);
+
+// Makes an image of dimensions in range [min_dimension, max_dimension]
+// which is stored as the specified type: 4 - noise of all colors,
+// 8 - runs of colors of an auxiliary palette, 10 - noise of colors
+// of an auxiliary palette.
+void make_synthetic_image(
+    int type,
+    int min_dimension,
+    int max_dimension,
+    const PaletteSet& palette_set,
+    Random& random,
+    IndexedImage& image);
+
+
+} // namespace uw2_gr
+
+
+#endif // UW2_GR_SYNTHETIC_H
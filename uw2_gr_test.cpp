@@ -0,0 +1,243 @@
+/*
+    uw2_gr_tool: "Ultima Underworld II" .GR extracter/rebuilder.
+    Copyright (C) 2014, Boris I. Bendovsky <bibendovsky@hotmail.com>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+// Round trips of the codecs on synthetic images: type 8 and type 10
+// encoding of bitmaps, and BMP, RLE8 BMP and PNG files. Files are
+// written into the current directory.
+
+
+#include "uw2_gr.h"
+#include "uw2_gr_synthetic.h"
+
+#include <cstdio>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+namespace {
+
+
+using namespace uw2_gr;
+
+
+const int k_images_per_type = 64;
+
+PaletteSet g_palette_set;
+
+
+// Reports the first pixel which differs.
+bool compare_images(
+    const IndexedImage& expected,
+    const IndexedImage& actual,
+    const std::string& what)
+{
+    if (actual.width != expected.width ||
+        actual.height != expected.height)
+    {
+        std::cerr << "ERROR: " << what << ": " << actual.width << 'x' <<
+            actual.height << " instead of " << expected.width << 'x' <<
+            expected.height << '.' << std::endl;
+        return false;
+    }
+
+    for (size_t i = 0; i < expected.pixels.size(); ++i) {
+        if (actual.pixels[i] != expected.pixels[i]) {
+            std::cerr << "ERROR: " << what << ": pixel " << i << " is " <<
+                static_cast<int>(actual.pixels[i]) << " instead of " <<
+                static_cast<int>(expected.pixels[i]) << '.' << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Makes images of a single color and of stripes in colors of
+// the first auxiliary palette.
+void make_special_images(
+    std::vector<IndexedImage>& images)
+{
+    const AuxPalette& aux_palette = g_palette_set.get_aux_palettes()[0];
+
+    for (int i = 0; i < 4; ++i) {
+        IndexedImage image;
+        image.width = (i % 2) == 0 ? k_max_width : 1;
+        image.height = (i / 2) == 0 ? k_max_height : 1;
+        image.pixels.assign(image.width * image.height, aux_palette[5]);
+        images.push_back(image);
+    }
+
+    IndexedImage image;
+    image.width = 37;
+    image.height = 23;
+    image.pixels.resize(image.width * image.height);
+
+    for (int i = 0; i < image.height; ++i) {
+        for (int j = 0; j < image.width; ++j) {
+            image.pixels[(i * image.width) + j] =
+                aux_palette[(i % 3) == 0 ? (j % 2) : (i % 16)];
+        }
+    }
+
+    images.push_back(image);
+}
+
+// Encodes images as bitmaps of the type and decodes them back.
+bool test_bitmaps(
+    int type)
+{
+    Random random(2014 + type);
+    std::vector<IndexedImage> images;
+
+    for (int i = 0; i < k_images_per_type; ++i) {
+        IndexedImage image;
+        make_synthetic_image(
+            type, 16, k_max_width, g_palette_set, random, image);
+        images.push_back(image);
+    }
+
+    // Special images may be stored as any type (e.g., a single pixel
+    // is not compressed at all), but they still must decode back.
+    if (type == 8)
+        make_special_images(images);
+
+    for (size_t i = 0; i < images.size(); ++i) {
+        const IndexedImage& image = images[i];
+
+        Bitmap bitmap;
+        bitmap.width = image.width;
+        bitmap.height = image.height;
+        bitmap.import_from_region(
+            image, 0, 0, Bitmap::e_default,
+            &g_palette_set.get_aux_palette_index());
+
+        bool is_special = i >= static_cast<size_t>(k_images_per_type);
+
+        if (bitmap.type != type && !is_special) {
+            std::cerr << "ERROR: Image " << i << " is stored as type " <<
+                bitmap.type << " instead of " << type << '.' << std::endl;
+            return false;
+        }
+
+        IndexedImage decoded_image;
+        bitmap.decode(decoded_image);
+
+        std::ostringstream what;
+        what << "type " << bitmap.type << " bitmap " << i;
+
+        if (!compare_images(image, decoded_image, what.str()))
+            return false;
+    }
+
+    std::cout << "Type " << type << " bitmaps: " << images.size() <<
+        " round trips." << std::endl;
+
+    return true;
+}
+
+// Saves images into files of the format and loads them back.
+bool test_files(
+    ImageFormat format)
+{
+    Random random(1992 + format);
+    std::vector<IndexedImage> images;
+
+    for (int i = 0; i < k_images_per_type; ++i) {
+        static const int types[3] = { 4, 8, 10 };
+
+        IndexedImage image;
+        make_synthetic_image(
+            types[i % 3], 1, k_max_width, g_palette_set, random, image);
+        images.push_back(image);
+    }
+
+    make_special_images(images);
+
+    // Lines which end with color 0 are cut short in RLE8 BMP files.
+    IndexedImage image;
+    image.width = 37;
+    image.height = 23;
+    image.pixels.resize(image.width * image.height);
+
+    for (int i = 0; i < image.height; ++i) {
+        for (int j = 0; j < image.width; ++j) {
+            bool is_blank = (i % 4) == 0 || j >= (image.width - i);
+
+            image.pixels[(i * image.width) + j] = static_cast<unsigned char>(
+                is_blank ? 0 : (16 + ((i * j) % 200)));
+        }
+    }
+
+    images.push_back(image);
+
+    std::string file_name = "uw2_gr_test" + get_image_extension(format);
+    const Palette& palette = g_palette_set.get_palette(0);
+    bool result = true;
+
+    for (size_t i = 0; i < images.size() && result; ++i) {
+        IndexedImage loaded_image;
+
+        std::ostringstream what;
+        what << file_name << " of image " << i;
+
+        result =
+            images[i].save_to_file(file_name, format, palette, std::cerr) &&
+            loaded_image.load_from_file(
+                file_name, k_max_width, k_max_height, std::cerr) &&
+            compare_images(images[i], loaded_image, what.str());
+    }
+
+    std::remove(file_name.c_str());
+
+    if (!result)
+        return false;
+
+    std::cout << get_image_extension(format) <<
+        (format == e_format_bmp_rle8 ? " (RLE8)" : "") << " files: " <<
+        images.size() << " round trips." << std::endl;
+
+    return true;
+}
+
+
+} // namespace
+
+
+int main()
+{
+    if (!make_synthetic_palette_set(g_palette_set))
+        return 1;
+
+    bool result =
+        test_bitmaps(8) &&
+        test_bitmaps(10) &&
+        test_files(e_format_bmp) &&
+        test_files(e_format_bmp_rle8) &&
+        test_files(e_format_png);
+
+    if (!result) {
+        std::cerr << "ERROR: Test failed." << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
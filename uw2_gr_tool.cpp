@@ -21,1089 +21,1313 @@
 // TODO
 // - Check dimensions of last panel (panels.gr).
 
-
-#ifdef _WIN32
-#include <direct.h>
-#else
-#include <sys/stat.h>
-#include <sys/types.h>
-#endif // _WIN32
+#include "uw2_gr.h"
 
 #include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
-#include <locale>
+#include <iterator>
 #include <map>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_set>
 #include <vector>
 
 
 namespace {
 
 
-#ifdef _WIN32
-const char k_path_separator = '\\';
-#else
-const char k_path_separator = '/';
-#endif
+using namespace uw2_gr;
 
 
-std::string combine_path(
-    const std::string& path1,
-    const std::string& path2)
-{
-    if (path1.empty())
-        return path2;
+// A unit of work for WorkerPool.
+class Task {
+public:
+    Task() :
+        is_done_()
+    {
+    }
 
-    if (path2.empty())
-        return path1;
+    virtual ~Task()
+    {
+    }
 
-    if (path2[0] == k_path_separator)
-        return path2;
+    virtual void run() = 0;
 
-    bool use_separator = (path1[path1.size() - 1] != k_path_separator);
+private:
+    friend class WorkerPool;
 
-    std::string result(path1);
+    bool is_done_;
 
-    if (use_separator)
-        result += k_path_separator;
+    Task(
+        const Task& that);
 
-    result += path2;
+    Task& operator=(
+        const Task& that);
+}; // class Task
 
-    return result;
-}
+// Runs tasks on a fixed number of threads.
+// Without threads a task is run right away by post.
+class WorkerPool {
+public:
+    explicit WorkerPool(
+        int thread_count) :
+            is_stopping_()
+    {
+        for (int i = 0; i < thread_count; ++i)
+            threads_.push_back(std::thread(&WorkerPool::work, this));
+    }
 
-std::string combine_path(
-    const std::string& path1,
-    const std::string& path2,
-    const std::string& path3)
-{
-    return combine_path(combine_path(path1, path2), path3);
-}
+    ~WorkerPool()
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            is_stopping_ = true;
+        }
 
-std::string to_lowercase(
-    const std::string& string)
-{
-    if (string.empty())
-        return std::string();
+        task_posted_.notify_all();
 
-    static std::locale locale;
+        for (size_t i = 0; i < threads_.size(); ++i)
+            threads_[i].join();
+    }
 
-    static const std::ctype<char>& facet =
-        std::use_facet<std::ctype<char> >(locale);
+    int get_thread_count() const
+    {
+        return static_cast<int>(threads_.size());
+    }
 
-    std::string result(string);
+    void post(
+        Task* task)
+    {
+        assert(task);
 
-    facet.tolower(&result[0], &result[0] + result.size());
+        // A task may be posted again after it is done.
+        task->is_done_ = false;
 
-    return result;
-}
+        if (threads_.empty()) {
+            task->run();
+            task->is_done_ = true;
+            return;
+        }
 
-std::string to_uppercase(
-    const std::string& string)
-{
-    if (string.empty())
-        return std::string();
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            tasks_.push_back(task);
+        }
 
-    static std::locale locale;
+        task_posted_.notify_one();
+    }
 
-    static const std::ctype<char>& facet =
-        std::use_facet<std::ctype<char> >(locale);
+    void wait(
+        Task* task)
+    {
+        assert(task);
 
-    std::string result(string);
+        std::unique_lock<std::mutex> lock(mutex_);
 
-    facet.toupper(&result[0], &result[0] + result.size());
+        while (!task->is_done_)
+            task_done_.wait(lock);
+    }
 
-    return result;
-}
+private:
+    typedef std::deque<Task*> Tasks;
+    typedef std::vector<std::thread> Threads;
 
-bool normalize_path_pred(
-    char c)
-{
-#ifdef _WIN32
-    return c == '/';
-#else
-    return c == '\\';
-#endif
-}
+    std::mutex mutex_;
+    std::condition_variable task_posted_;
+    std::condition_variable task_done_;
+    Tasks tasks_;
+    Threads threads_;
+    bool is_stopping_;
 
-std::string normalize_path(
-    const std::string& path)
-{
-    std::string result(path);
+    void work()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
 
-    std::replace_if(
-        result.begin(), result.end(), normalize_path_pred, k_path_separator);
+        while (true) {
+            while (tasks_.empty() && !is_stopping_)
+                task_posted_.wait(lock);
 
-    return result;
-}
+            if (tasks_.empty())
+                return;
 
-std::string extract_dir(
-    const std::string& path)
-{
-    if (path.empty())
-        return std::string();
+            Task* task = tasks_.front();
+            tasks_.pop_front();
 
-    size_t name_pos = path.rfind(k_path_separator);
+            lock.unlock();
+            task->run();
+            lock.lock();
 
-    if (name_pos == path.npos)
-        return std::string();
+            task->is_done_ = true;
+            task_done_.notify_all();
+        }
+    }
 
-    return path.substr(0, name_pos - 1);
-}
+    WorkerPool(
+        const WorkerPool& that);
 
-std::string extract_file_name(
-    const std::string& path)
-{
-    if (path.empty())
-        return std::string();
+    WorkerPool& operator=(
+        const WorkerPool& that);
+}; // class WorkerPool
 
-    size_t name_pos = path.rfind(k_path_separator);
+typedef std::map<int,std::string> Mappings;
+typedef Mappings::iterator MappingsIt;
+typedef Mappings::const_iterator MappingsCIt;
 
-    if (name_pos == (path.size() - 1))
-        return std::string();
+// Packs rectangles into square pages using the skyline bottom-left
+// heuristic. Taller rectangles should go first.
+class AtlasPacker {
+public:
+    explicit AtlasPacker(
+        int page_size) :
+            page_size_(page_size),
+            pages_()
+    {
+        assert(page_size > 0);
+    }
 
-    if (name_pos == path.npos)
-        name_pos = 0;
-    else
-        ++name_pos;
+    ~AtlasPacker()
+    {
+    }
 
-    return path.substr(name_pos);
-}
+    // Places a rectangle into the first page it fits into.
+    // Returns an index of the page.
+    int add(
+        int width,
+        int height,
+        int& x,
+        int& y)
+    {
+        assert(width > 0 && width <= page_size_);
+        assert(height > 0 && height <= page_size_);
 
-std::string extract_file_name_without_extension(
-    const std::string& path)
-{
-    if (path.empty())
-        return std::string();
+        int page_count = static_cast<int>(pages_.size());
 
-    size_t name_pos = path.rfind(k_path_separator);
+        for (int i = 0; i < page_count; ++i) {
+            if (place(pages_[i], width, height, x, y))
+                return i;
+        }
 
-    if (name_pos == (path.size() - 1))
-        return std::string();
+        pages_.push_back(Page(page_size_));
+        place(pages_.back(), width, height, x, y);
 
-    if (name_pos == path.npos)
-        name_pos = 0;
-    else
-        ++name_pos;
+        return page_count;
+    }
 
-    size_t dot_pos = path.rfind('.');
+    int get_page_count() const
+    {
+        return static_cast<int>(pages_.size());
+    }
 
-    if (dot_pos == path.npos)
-        dot_pos = path.size();
+    // Returns an extent of the used area of a page.
+    void get_page_size(
+        int index,
+        int& width,
+        int& height) const
+    {
+        width = pages_[index].used_width;
+        height = pages_[index].used_height;
+    }
 
-    size_t length = dot_pos - name_pos;
-    return path.substr(name_pos, length);
-}
+private:
+    // A horizontal span of the top edge of placed rectangles.
+    class Segment {
+    public:
+        int x;
+        int y;
+        int width;
+
+        Segment(
+            int x,
+            int y,
+            int width) :
+                x(x),
+                y(y),
+                width(width)
+        {
+        }
+    }; // class Segment
 
-bool create_dir(
-    const std::string& path)
-{
-#ifdef _WIN32
-    int api_result = ::_mkdir(path.c_str());
-#else
-    int api_result = ::mkdir(path.c_str(), 0777);
-#endif // _WIN32
+    typedef std::vector<Segment> Skyline;
 
-    if (api_result != 0) {
-        if (errno != EEXIST) {
-            std::cerr <<
-                "ERROR: Failed to create a directory \"" <<
-                path << "\"." << std::endl;
+    class Page {
+    public:
+        Skyline skyline; // ordered by x
+        int used_width;
+        int used_height;
 
-            return false;
+        explicit Page(
+            int page_size) :
+                skyline(1, Segment(0, 0, page_size)),
+                used_width(),
+                used_height()
+        {
         }
-    }
-
-    return true;
-}
-
-bool create_dirs_along_the_path(
-    const std::string& path)
-{
-    if (path.empty())
-        return true;
+    }; // class Page
 
-    std::string current_path;
-    size_t dir_start_pos = 0;
-    size_t dir_end_pos = 0;
+    typedef std::vector<Page> Pages;
 
-    while (dir_end_pos != std::string::npos) {
-        dir_end_pos = path.find(k_path_separator, dir_start_pos);
+    int page_size_;
+    Pages pages_;
 
-        current_path = combine_path(current_path, path.substr(
-            dir_start_pos, dir_end_pos - dir_start_pos));
+    AtlasPacker(
+        const AtlasPacker& that);
 
-        if (!create_dir(current_path))
-            return false;
+    AtlasPacker& operator=(
+        const AtlasPacker& that);
 
-        dir_start_pos = dir_end_pos;
+    // Finds the lowest position at the start of some segment.
+    bool place(
+        Page& page,
+        int width,
+        int height,
+        int& x,
+        int& y)
+    {
+        Skyline& skyline = page.skyline;
+        int segment_count = static_cast<int>(skyline.size());
+        int best_x = -1;
+        int best_y = page_size_;
 
-        if (dir_start_pos != std::string::npos)
-            ++dir_start_pos;
-    }
+        for (int i = 0; i < segment_count; ++i) {
+            int left = skyline[i].x;
+            int right = left + width;
 
-    return true;
-}
+            if (right > page_size_)
+                break;
 
-bool is_file_exists(
-    const std::string& file_name)
-{
-    std::ifstream file(
-        file_name.c_str(),
-        std::ios_base::in | std::ios_base::binary | std::ios_base::ate);
+            int top = 0;
 
-    return file.is_open();
-}
+            for (int j = i; j < segment_count && skyline[j].x < right; ++j)
+                top = std::max(top, skyline[j].y);
 
-template<typename T>
-void write_value(
-    T value,
-    std::ostream& stream)
-{
-    stream.write(reinterpret_cast<const char*>(&value), sizeof(T));
-}
+            if ((top + height) <= page_size_ && top < best_y) {
+                best_x = left;
+                best_y = top;
+            }
+        }
 
-template<typename T>
-void read_value(
-    T& value,
-    std::istream& stream)
-{
-    stream.read(reinterpret_cast<char*>(&value), sizeof(T));
-}
+        if (best_x < 0)
+            return false;
 
+        x = best_x;
+        y = best_y;
 
-// ========================================================================
+        // Raise the skyline over the rectangle.
+        Skyline new_skyline;
+        int right = x + width;
 
+        for (int i = 0; i < segment_count; ++i) {
+            const Segment& segment = skyline[i];
+            int segment_right = segment.x + segment.width;
 
-const int k_max_width = 255;
-const int k_max_height = 255;
+            if (segment.x == x)
+                new_skyline.push_back(Segment(x, y + height, width));
 
-const int k_panel_width = 79;
-const int k_panel_height = 112;
+            if (segment_right <= x || segment.x >= right)
+                new_skyline.push_back(segment);
+            else if (segment_right > right) {
+                new_skyline.push_back(
+                    Segment(right, segment.y, segment_right - right));
+            }
+        }
 
-const int k_panel_border_width = 3;
-const int k_panel_border_height = 112;
+        // Merge neighbours of the same height.
+        skyline.clear();
 
+        for (size_t i = 0; i < new_skyline.size(); ++i) {
+            if (!skyline.empty() && skyline.back().y == new_skyline[i].y)
+                skyline.back().width += new_skyline[i].width;
+            else
+                skyline.push_back(new_skyline[i]);
+        }
 
-typedef std::map<std::string,int> PaletteMap;
-typedef std::map<int,std::string> Mappings;
-typedef Mappings::iterator MappingsIt;
-typedef Mappings::const_iterator MappingsCIt;
-typedef std::vector<unsigned char> Buffer;
-typedef Buffer Palette;
-typedef unsigned char AuxPalette[16];
-typedef AuxPalette AuxPalettes[32];
+        page.used_width = std::max(page.used_width, right);
+        page.used_height = std::max(page.used_height, y + height);
 
+        return true;
+    }
+}; // class AtlasPacker
 
-class BmpHeader {
+// A bitmap placed into an atlas page.
+class AtlasEntry {
 public:
-    unsigned short bfType;
-    unsigned long bfSize;
-    unsigned short bfReserved1;
-    unsigned short bfReserved2;
-    unsigned long bfOffBits;
-
-    void save_to_stream(
-        std::ostream& stream)
-    {
-        write_value(bfType, stream);
-        write_value(bfSize, stream);
-        write_value(bfReserved1, stream);
-        write_value(bfReserved2, stream);
-        write_value(bfOffBits, stream);
-    }
+    int bitmap_index;
+    int page_index;
+    int x;
+    int y;
+    int width;
+    int height;
 
-    void load_from_stream(
-        std::istream& stream)
+    AtlasEntry() :
+        bitmap_index(),
+        page_index(),
+        x(),
+        y(),
+        width(),
+        height()
     {
-        read_value(bfType, stream);
-        read_value(bfSize, stream);
-        read_value(bfReserved1, stream);
-        read_value(bfReserved2, stream);
-        read_value(bfOffBits, stream);
     }
+}; // class AtlasEntry
 
-    static int get_size()
-    {
-        return 14;
-    }
-}; // class BmpHeader
+typedef std::vector<AtlasEntry> AtlasEntries;
+typedef AtlasEntries::const_iterator AtlasEntriesCIt;
 
-class BmpInfoHeader {
-public:
-    enum Compression {
-        e_rgb = 0, // BI_RGB
-        e_rle8 = 1 // BI_RLE8
-    }; // enum Compression
-
-    unsigned long biSize;
-    long biWidth;
-    long biHeight;
-    unsigned short biPlanes;
-    unsigned short biBitCount;
-    unsigned long biCompression;
-    unsigned long biSizeImage;
-    long biXPelsPerMeter;
-    long biYPelsPerMeter;
-    unsigned long biClrUsed;
-    unsigned long biClrImportant;
-
-    void save_to_stream(
-        std::ostream& stream)
-    {
-        write_value(biSize, stream);
-        write_value(biWidth, stream);
-        write_value(biHeight, stream);
-        write_value(biPlanes, stream);
-        write_value(biBitCount, stream);
-        write_value(biCompression, stream);
-        write_value(biSizeImage, stream);
-        write_value(biXPelsPerMeter, stream);
-        write_value(biYPelsPerMeter, stream);
-        write_value(biClrUsed, stream);
-        write_value(biClrImportant, stream);
-    }
-
-    void load_from_stream(
-        std::istream& stream)
-    {
-        read_value(biSize, stream);
-        read_value(biWidth, stream);
-        read_value(biHeight, stream);
-        read_value(biPlanes, stream);
-        read_value(biBitCount, stream);
-        read_value(biCompression, stream);
-        read_value(biSizeImage, stream);
-        read_value(biXPelsPerMeter, stream);
-        read_value(biYPelsPerMeter, stream);
-        read_value(biClrUsed, stream);
-        read_value(biClrImportant, stream);
-    }
-
-    bool is_compressed() const
-    {
-        return biCompression != e_rgb;
-    }
-
-    static int get_size()
-    {
-        return 40;
-    }
-}; // class BmpInfoHeader
-
-class NibbleReader {
+// Identifies a content of a file.
+class FileStamp {
 public:
-    NibbleReader(
-        const unsigned char* data,
-        int data_size) :
-            nibble_index_(2),
-            data_(data),
-            data_size_(data_size),
-            data_offset_()
-    {
-        assert(data);
-        assert(data_size >= 0);
-    }
-
-    ~NibbleReader()
-    {
-    }
-
-    unsigned char read()
+    long long size;
+    long long mtime;
+    unsigned long long hash;
+
+    FileStamp() :
+        size(),
+        mtime(),
+        hash()
     {
-        if (data_offset_ == data_size_)
-            return 0;
-
-        if (nibble_index_ == 2) {
-            unsigned char octet = data_[data_offset_];
-            nibble_buffer_[0] = octet >> 4;
-            nibble_buffer_[1] = octet & 0x0F;
-            nibble_index_ = 0;
-            ++data_offset_;
-        }
-
-        unsigned char result = nibble_buffer_[nibble_index_];
-
-        ++nibble_index_;
-
-        return result;
     }
+}; // class FileStamp
 
-private:
-    int nibble_index_;
-    unsigned char nibble_buffer_[2];
-    const unsigned char* data_;
-    int data_size_;
-    int data_offset_;
-
-    NibbleReader(
-        const NibbleReader& that);
+typedef std::map<std::string, FileStamp> FileStamps;
+typedef FileStamps::const_iterator FileStampsCIt;
 
-    NibbleReader& operator=(
-        const NibbleReader& that);
-}; // class NibbleReader
-
-class Bitmap {
+// Identifies a region of an extracted image a bitmap went to.
+class BitmapStamp {
 public:
-    enum Special {
-        e_none,
-        e_default,
-        e_panel,
-        e_last_panel
-    }; // enum Special
-
-    int type;
+    int bitmap_index;
+    int image_index; // in order of images in the stamps
+    int x;
+    int y;
     int width;
     int height;
 
-    // If type is 4 the size in bytes otherwise in nibbles.
-    int data_size;
+    BitmapStamp() :
+        bitmap_index(),
+        image_index(),
+        x(),
+        y(),
+        width(),
+        height()
+    {
+    }
+}; // class BitmapStamp
 
-    Special special;
-    Buffer pixels;
-    const Palette* palette;
-    const AuxPalette* aux_palette;
+typedef std::vector<BitmapStamp> BitmapStamps;
+typedef std::map<int, BitmapStamp> IndexedBitmapStamps;
+typedef IndexedBitmapStamps::const_iterator IndexedBitmapStampsCIt;
 
-    Bitmap() :
-        type(),
-        width(),
-        height(),
-        data_size(),
-        special(),
-        pixels(),
-        palette(),
-        aux_palette()
+// Mappings of bitmap indices to file names in a layout of a binary
+// mappings file, so the loaded file is used in place.
+//
+// Binary mappings file (values are little-endian):
+//   char[4] - "UW2M"
+//   u32 - version (1)
+//   u32 - record count
+//   u32 - size of the name pool
+//   record[count] - u32 bitmap index and u32 offset of the name in the pool
+//                   (sorted by bitmap index)
+//   char[pool size] - null-terminated file names
+class MappingsIndex {
+public:
+    // Bitmap index and offset of the name.
+    typedef std::pair<int, int> Record;
+    typedef std::vector<Record> Records;
+
+    MappingsIndex() :
+        mapping_(),
+        buffer_(),
+        data_(),
+        size_(),
+        count_()
     {
     }
 
-    Bitmap(
-        const Bitmap& that) :
-            type(that.type),
-            width(that.width),
-            height(that.height),
-            data_size(that.data_size),
-            special(that.special),
-            pixels(that.pixels),
-            palette(that.palette),
-            aux_palette(that.aux_palette)
+    void clear()
     {
+        mapping_.close();
+        buffer_.clear();
+        data_ = NULL;
+        size_ = 0;
+        count_ = 0;
     }
 
-    Bitmap& operator=(
-        const Bitmap& that)
+    void build(
+        const Mappings& mappings)
     {
-        if (&that != this) {
-            type = that.type;
-            width = that.width;
-            height = that.height;
-            data_size = that.data_size;
-            special = that.special;
-            pixels = that.pixels;
-            palette = that.palette;
-            aux_palette = that.aux_palette;
+        Records records;
+        Buffer pool;
+
+        records.reserve(mappings.size());
+
+        for (MappingsCIt i = mappings.begin(); i != mappings.end(); ++i) {
+            records.push_back(Record(i->first, static_cast<int>(pool.size())));
+            pool.insert(pool.end(), i->second.begin(), i->second.end());
+            pool.push_back(0);
         }
 
-        return *this;
+        assign(records, pool);
     }
 
-    ~Bitmap()
+    // Builds the index from records sorted by bitmap index
+    // and a pool of null-terminated names.
+    void build(
+        const Records& records,
+        const Buffer& pool)
     {
+        assign(records, pool);
     }
 
-    bool load_from_gr(
-        const void* data,
-        Special special,
-        const Palette* palette,
-        const AuxPalettes& aux_palette)
+    bool load_from_text(
+        const std::string& file_name)
     {
-        assert(data);
-        assert(palette);
+        std::cout << "Loading mappings from \"" << file_name << "\"" << std::endl;
 
-        const unsigned char* octets = static_cast<const unsigned char*>(data);
+        clear();
 
-        if (special == e_default) {
-            type = octets[0];
-            width = octets[1];
-            height = octets[2];
-            octets += 3;
-        } else {
-            type = 4;
-
-            if (special == e_last_panel) {
-                width = k_panel_border_width;
-                height = k_panel_border_height;
-            } else {
-                width = k_panel_width;
-                height = k_panel_height;
-            }
+        std::ifstream file(
+            file_name.c_str(),
+            std::ios_base::in | std::ios_base::binary);
 
-            data_size = width * height;
+        if (!file) {
+            std::cerr << "ERROR: Failed to open." << std::endl;
+            return false;
         }
 
-        switch (type) {
-        case 4:
-        case 8:
-        case 10:
-            break;
+        Buffer text(
+            (std::istreambuf_iterator<char>(file)),
+            std::istreambuf_iterator<char>());
 
-        default:
-            std::cerr << "ERROR: Invalid bitmap type: " <<
-                type << '.' << std::endl;
+        if (file.bad()) {
+            std::cerr << "ERROR: I/O error." << std::endl;
             return false;
         }
 
-        if (is_compressed()) {
-            int aux_palette_index = *octets++;
+        Records records;
+        Buffer pool;
+        size_t size = text.size();
+        size_t offset = 0;
 
-            if (aux_palette_index > 31) {
-                std::cerr << "ERROR: Auxiliary palette index out of range: " <<
-                    aux_palette_index << '.' << std::endl;
+        while (true) {
+            offset = skip_spaces(text, offset);
+
+            if (offset == size)
+                break;
+
+            size_t end = skip_token(text, offset);
+            int bitmap_index;
+
+            if (!parse_int(&text[offset], end - offset, bitmap_index)) {
+                std::cerr << "ERROR: Invalid bitmap index value." << std::endl;
                 return false;
             }
 
-            this->aux_palette = &aux_palette[aux_palette_index];
-        } else
-            this->aux_palette = NULL;
+            if (bitmap_index < 0) {
+                std::cerr << "ERROR: Negative bitmap index." << std::endl;
+                return false;
+            }
+
+            offset = skip_spaces(text, end);
+            end = skip_token(text, offset);
 
-        if (special == e_none || special == e_default) {
-            data_size = *reinterpret_cast<const unsigned short*>(&octets[0]);
-            octets += 2;
+            if (offset == end ||
+                std::find(&text[0] + offset, &text[0] + end, '\0') !=
+                    &text[0] + end)
+            {
+                std::cerr << "ERROR: Invalid bitmap file name." << std::endl;
+                return false;
+            }
+
+            records.push_back(
+                Record(bitmap_index, static_cast<int>(pool.size())));
+            pool.insert(pool.end(), &text[0] + offset, &text[0] + end);
+            pool.push_back(0);
+
+            offset = end;
         }
 
-        int size_in_bytes = get_size_in_bytes();
+        if (records.empty()) {
+            std::cerr << "ERROR: No records." << std::endl;
+            return false;
+        }
 
-        pixels.clear();
-        pixels.resize(size_in_bytes);
+        std::sort(records.begin(), records.end());
 
-        std::uninitialized_copy(
-            &octets[0],
-            &octets[size_in_bytes],
-            &pixels[0]);
+        for (size_t i = 1; i < records.size(); ++i) {
+            if (records[i].first == records[i - 1].first) {
+                std::cerr << "ERROR: Duplicating bitmap index: " <<
+                    records[i].first << '.' << std::endl;
+                return false;
+            }
+        }
 
-        this->palette = palette;
+        assign(records, pool);
 
         return true;
     }
 
-    void decompress(
-        Buffer& buffer) const
+    bool load_from_binary(
+        const std::string& file_name)
     {
-        if (!is_compressed()) {
-            buffer = pixels;
-            return;
+        std::cout << "Loading mappings from \"" << file_name << "\"" << std::endl;
+
+        clear();
+
+#ifndef UW2_GR_TOOL_NO_MMAP
+        if (mapping_.open(file_name)) {
+            data_ = mapping_.get_data();
+            size_ = mapping_.get_size();
         }
+#endif // UW2_GR_TOOL_NO_MMAP
 
-        buffer.clear();
+        if (!data_) {
+            std::ifstream file(
+                file_name.c_str(),
+                std::ios_base::in | std::ios_base::binary);
 
-        if (pixels.empty())
-            return;
+            if (!file) {
+                std::cerr << "ERROR: Failed to open." << std::endl;
+                return false;
+            }
+
+            buffer_.assign(
+                std::istreambuf_iterator<char>(file),
+                std::istreambuf_iterator<char>());
 
-        buffer.resize(width * height);
-
-        if (type == 8) {
-            NibbleReader reader(
-                &pixels[0],
-                get_size_in_bytes());
-
-            int buffer_offset = 0;
-
-            int pixel_count = 0;
-            int stage = 0; // we start in stage 0
-            int count = 0;
-            int record = 0; // we start with record 0=repeat (3=run)
-            int repeat_count = 0;
-
-            int data_length = data_size;
-            int area = width * height;
-
-            while (data_length > 0 && pixel_count < area) {
-                int nibble = reader.read();
-
-                --data_length;
-
-                switch (stage) {
-                case 0: // we retrieve a new count
-                    if (nibble == 0)
-                        ++stage;
-                    else {
-                        count = nibble;
-                        stage = 6;
-                    }
-                    break;
-
-                case 1:
-                    count = nibble;
-                    ++stage;
-                    break;
-
-                case 2:
-                    count = (count << 4) | nibble;
-
-                    if (count == 0)
-                        ++stage;
-                    else
-                        stage = 6;
-                    break;
-
-                case 3:
-                case 4:
-                case 5:
-                    count = (count << 4) | nibble;
-                    ++stage;
-                    break;
-                }
-
-                if (stage < 6)
-                    continue;
-
-                switch (record) {
-                case 0:
-                    // repeat record stage 1
-
-                    if (count == 1) {
-                        // skip this record; a run follows
-                        record = 3;
-                        break;
-                    }
-
-                    if (count == 2) {
-                        // multiple run records
-                        record = 2;
-                        break;
-                    }
-
-                    // read next nibble; it's the color to repeat
-                    record = 1;
-                    continue;
-
-                case 1:
-                    // repeat record stage 2
-
-                    // repeat 'nibble' color 'count' times
-                    for (int n = 0; n < count; ++n) {
-                        buffer[buffer_offset++] = (*aux_palette)[nibble];
-
-                        if (++pixel_count >= area)
-                            break;
-                    }
-
-                    if (repeat_count == 0)
-                        record = 3; // next one is a run record
-                    else {
-                        --repeat_count;
-                        record = 0; // continue with repeat records
-                    }
-                    break;
-
-                case 2:
-                    // multiple repeat stage
-                    // 'count' specifies the number of repeat record to appear
-                    repeat_count = count - 1;
-                    record = 0;
-                    break;
-
-                case 3:
-                    // run record stage 1
-                    // copy 'count' nibbles
-
-                    // retrieve next nibble
-                    record = 4;
-                    continue;
-
-                case 4:
-                    // run record stage 2
-
-                    // now we have a nibble to write
-                    buffer[buffer_offset++] = (*aux_palette)[nibble];
-                    ++pixel_count;
-
-                    if (--count == 0)
-                        record = 0; // next one is a repeat again
-                    else
-                        continue;
-                    break;
-                }
-
-                stage = 0;
+            if (file.bad()) {
+                std::cerr << "ERROR: I/O error." << std::endl;
+                clear();
+                return false;
+            }
+
+            if (!buffer_.empty()) {
+                data_ = &buffer_[0];
+                size_ = buffer_.size();
             }
         }
 
-        if (type == 10) {
-            // 4-bit uncompressed
+        if (!validate()) {
+            std::cerr << "ERROR: Invalid binary mappings." << std::endl;
+            clear();
+            return false;
+        }
 
-            NibbleReader reader(&pixels[0], data_size);
+        count_ = static_cast<int>(get_value(8));
 
-            for (int i = 0; i < data_size; ++i)
-                buffer[i] = reader.read();
-        }
+        return true;
     }
 
-    bool export_to_bmp(
+    bool save_to_text(
         const std::string& file_name) const
     {
-        std::cout << "Exporting a bitmap to \"" <<
-            file_name << "\"." << std::endl;
+        std::cout << "Saving mappings to \"" << file_name << "\"." << std::endl;
 
-        std::ofstream file(
-            file_name.c_str(), std::ios_base::out | std::ios_base::binary);
+        std::ostringstream oss;
 
-        if (!file) {
-            std::cerr << "ERROR: Unable to open." << std::endl;
-            return false;
-        }
-
-        int pad = (((width + 3) / 4) * 4) - width;
+        for (int i = 0; i < count_; ++i)
+            oss << get_bitmap_index(i) << ' ' << get_file_name(i) << '\n';
 
-        Buffer bmp_color_indices;
-        decompress(bmp_color_indices);
+        std::string text = oss.str();
 
-        BmpHeader header = BmpHeader();
-        header.bfType = 0x4D42;
-        header.bfSize =
-            BmpHeader::get_size() + BmpInfoHeader::get_size() +
-            (4 * 256) + ((width + pad) * height);
-        header.bfOffBits =
-            BmpHeader::get_size() + BmpInfoHeader::get_size() + (4 * 256);
-
-        BmpInfoHeader info_header = BmpInfoHeader();
-        info_header.biSize = BmpInfoHeader::get_size();
-        info_header.biWidth = width;
-        info_header.biHeight = -height;
-        info_header.biPlanes = 1;
-        info_header.biBitCount = 8;
-        info_header.biCompression = 0; // BI_RGB
-        info_header.biSizeImage = (width + pad) * height;
-
-        Buffer bmp_palette(1024);
+        return write_file(
+            file_name,
+            reinterpret_cast<const unsigned char*>(text.data()),
+            text.size());
+    }
 
-        for (int i = 0; i < 256; ++i) {
-            bmp_palette[(4 * i) + 0] = static_cast<unsigned char>(
-                (*palette)[(3 * i) + 2] * 255.0F / 63.0F);
+    bool save_to_binary(
+        const std::string& file_name) const
+    {
+        std::cout << "Saving binary mappings to \"" << file_name << "\"." <<
+            std::endl;
 
-            bmp_palette[(4 * i) + 1] = static_cast<unsigned char>(
-                (*palette)[(3 * i) + 1] * 255.0F / 63.0F);
+        return write_file(file_name, data_, size_);
+    }
 
-            bmp_palette[(4 * i) + 2] = static_cast<unsigned char>(
-                (*palette)[(3 * i) + 0] * 255.0F / 63.0F);
+    int get_count() const
+    {
+        return count_;
+    }
 
-            bmp_palette[(4 * i) + 3] = 0;
-        }
+    int get_bitmap_index(
+        int index) const
+    {
+        return static_cast<int>(get_value(k_header_size + (8 * index)));
+    }
 
-        header.save_to_stream(file);
-        info_header.save_to_stream(file);
+    const char* get_file_name(
+        int index) const
+    {
+        size_t pool_offset = k_header_size + (8 * count_);
+        size_t name_offset = get_value(k_header_size + (8 * index) + 4);
 
-        file.write(reinterpret_cast<const char*>(&bmp_palette[0]), 4 * 256);
+        return reinterpret_cast<const char*>(
+            data_ + pool_offset + name_offset);
+    }
 
-        if (pad == 0) {
-            file.write(
-                reinterpret_cast<const char*>(&bmp_color_indices[0]),
-                bmp_color_indices.size());
-        } else {
-            char padding[3];
+private:
+    static const int k_header_size = 16;
+    static const unsigned int k_version = 1;
 
-            for (int i = 0; i < height; ++i) {
-                file.write(
-                    reinterpret_cast<const char*>(
-                        &bmp_color_indices[i * width]),
-                    width);
+    FileMapping mapping_;
+    Buffer buffer_;
+    const unsigned char* data_;
+    size_t size_;
+    int count_;
 
-                file.write(padding, pad);
-            }
-        }
+    MappingsIndex(
+        const MappingsIndex& that);
 
-        if (!file) {
-            std::cerr << "ERROR: I/O error." << std::endl;
-            return false;
-        }
+    MappingsIndex& operator=(
+        const MappingsIndex& that);
 
-        return true;
+    unsigned int get_value(
+        size_t offset) const
+    {
+        return get_le_u32(data_ + offset);
     }
 
-    bool import_from_bmp(
-        const std::string& file_name,
-        Special special)
+    void assign(
+        const Records& records,
+        const Buffer& pool)
     {
-        std::cout << "Importing bitmap from \"" <<
-            file_name << "\"." << std::endl;
+        clear();
 
-        std::ifstream file(
-            file_name.c_str(),
-            std::ios_base::in | std::ios_base::binary);
+        count_ = static_cast<int>(records.size());
 
-        if (!file) {
-            std::cerr << "ERROR: Failed to open." << std::endl;
-            return false;
-        }
+        buffer_.resize(k_header_size + (8 * records.size()) + pool.size());
 
-        //
-        BmpHeader header;
-        header.load_from_stream(file);
+        unsigned char* data = &buffer_[0];
 
-        if (!file) {
-            std::cerr << "ERROR: I/O error." << std::endl;
-            return false;
-        }
+        *data++ = 'U';
+        *data++ = 'W';
+        *data++ = '2';
+        *data++ = 'M';
+        data = put_value<unsigned int>(k_version, data);
+        data = put_value<unsigned int>(records.size(), data);
+        data = put_value<unsigned int>(pool.size(), data);
 
-        if (header.bfType != 0x4D42) {
-            std::cerr << "ERROR: Not a BMP file." << std::endl;
-            return false;
+        for (size_t i = 0; i < records.size(); ++i) {
+            data = put_value<unsigned int>(records[i].first, data);
+            data = put_value<unsigned int>(records[i].second, data);
         }
 
-        //
-        BmpInfoHeader info_header;
-        info_header.load_from_stream(file);
-
-        if (!file) {
-            std::cerr << "ERROR: I/O error." << std::endl;
-            return false;
-        }
+        std::copy(pool.begin(), pool.end(), data);
 
-        if (static_cast<int>(info_header.biSize) < BmpInfoHeader::get_size()) {
-            std::cerr << "ERROR: Info header is too small." << std::endl;
-            return false;
-        }
+        data_ = &buffer_[0];
+        size_ = buffer_.size();
+    }
 
-        if (info_header.biWidth == 0 || info_header.biHeight == 0) {
-            std::cerr << "ERROR: Empty image." << std::endl;
+    // Checks the loaded data, so the accessors need no checks.
+    bool validate() const
+    {
+        if (size_ < static_cast<size_t>(k_header_size) ||
+            data_[0] != 'U' || data_[1] != 'W' ||
+            data_[2] != '2' || data_[3] != 'M' ||
+            get_value(4) != k_version)
+        {
             return false;
         }
 
-        if (::abs(info_header.biWidth) > k_max_width) {
-            std::cerr << "ERROR: Width is too big." << std::endl;
-            return false;
-        }
+        size_t count = get_value(8);
+        size_t pool_size = get_value(12);
 
-        if (::abs(info_header.biHeight) > k_max_height) {
-            std::cerr << "ERROR: Height is too big." << std::endl;
+        if (count == 0 ||
+            count > ((size_ - k_header_size) / 8) ||
+            pool_size != (size_ - k_header_size - (8 * count)) ||
+            data_[size_ - 1] != '\0')
+        {
             return false;
         }
 
-        if (info_header.biPlanes != 1) {
-            std::cerr << "ERROR: Unsupported number of bitplanes: " <<
-                info_header.biPlanes << '.' << std::endl;
-            return false;
-        }
+        const unsigned char* pool = data_ + k_header_size + (8 * count);
+        long long last_index = -1;
 
-        if (info_header.biBitCount != 8) {
-            std::cerr << "ERROR: Color bit depth is not 8 bit." << std::endl;
-            return false;
-        }
+        for (size_t i = 0; i < count; ++i) {
+            unsigned int bitmap_index = get_value(k_header_size + (8 * i));
+            size_t name_offset = get_value(k_header_size + (8 * i) + 4);
 
-        switch (info_header.biCompression) {
-        case BmpInfoHeader::e_rgb:
-        case BmpInfoHeader::e_rle8:
-            break;
+            if (bitmap_index > 0x7FFFFFFF ||
+                static_cast<long long>(bitmap_index) <= last_index ||
+                name_offset >= pool_size ||
+                pool[name_offset] == '\0')
+            {
+                return false;
+            }
 
-        default:
-            std::cerr << "ERROR: Unsupported compression mode: " <<
-                info_header.biCompression << '.' << std::endl;
-            return false;
+            last_index = bitmap_index;
         }
 
-        if (info_header.is_compressed() && info_header.biSizeImage == 0) {
-            std::cerr << "ERROR: Unknown size of compressed data." << std::endl;
-            return false;
+        return true;
+    }
+
+    static bool is_space(
+        unsigned char value)
+    {
+        return
+            value == ' ' || value == '\t' || value == '\n' ||
+            value == '\v' || value == '\f' || value == '\r';
+    }
+
+    static size_t skip_spaces(
+        const Buffer& text,
+        size_t offset)
+    {
+        while (offset < text.size() && is_space(text[offset]))
+            ++offset;
+
+        return offset;
+    }
+
+    static size_t skip_token(
+        const Buffer& text,
+        size_t offset)
+    {
+        while (offset < text.size() && !is_space(text[offset]))
+            ++offset;
+
+        return offset;
+    }
+
+    // Parses a decimal integer which occupies the whole token.
+    static bool parse_int(
+        const unsigned char* token,
+        size_t size,
+        int& value)
+    {
+        bool is_negative = false;
+        size_t offset = 0;
+
+        if (size > 0 && (token[0] == '-' || token[0] == '+')) {
+            is_negative = (token[0] == '-');
+            ++offset;
         }
 
-        if (info_header.biClrUsed != 0 && info_header.biClrUsed != 256) {
-            std::cerr << "ERROR: Invalid size of palette." << std::endl;
+        if (offset == size)
             return false;
+
+        long long result = 0;
+
+        for ( ; offset < size; ++offset) {
+            if (token[offset] < '0' || token[offset] > '9')
+                return false;
+
+            result = (10 * result) + (token[offset] - '0');
+
+            if (result > 0x7FFFFFFF)
+                return false;
         }
 
-        //
-        Buffer data(info_header.biSizeImage);
-        file.seekg(header.bfOffBits);
-        file.read(reinterpret_cast<char*>(&data[0]), data.size());
+        value = static_cast<int>(is_negative ? -result : result);
 
-        if (!file) {
-            std::cerr << "ERROR: I/O error." << std::endl;
-            return false;
+        return true;
+    }
+}; // class MappingsIndex
+
+
+// What to do with an existing file being written.
+enum OverwritePolicy {
+    e_overwrite_ask,
+    e_overwrite_always,
+    e_overwrite_never,
+    e_overwrite_newer // only if older than the sources
+}; // enum OverwritePolicy
+
+// Names of existing files. A directory is scanned on the first check
+// of a file in it instead of probing every file.
+class ExistingFiles {
+public:
+    ExistingFiles() :
+        dirs_(),
+        files_(),
+        last_prefix_()
+    {
+    }
+
+    ~ExistingFiles()
+    {
+    }
+
+    bool includes(
+        const std::string& file_name)
+    {
+        size_t separator_pos = file_name.rfind(k_path_separator);
+        size_t prefix_size =
+            (separator_pos == std::string::npos ? 0 : separator_pos + 1);
+
+        // Consecutive files are usually in the same directory.
+        if (prefix_size != last_prefix_.size() ||
+            file_name.compare(0, prefix_size, last_prefix_) != 0)
+        {
+            last_prefix_.assign(file_name, 0, prefix_size);
+
+            if (dirs_.insert(last_prefix_).second)
+                scan(last_prefix_);
         }
 
-        int width = info_header.biWidth;
-        int height = ::abs(info_header.biHeight);
+        return files_.count(get_key(file_name)) != 0;
+    }
 
-        if (this->width != width || this->height != height) {
-            std::cerr <<
-                "ERROR: Mismatch dimensions of a new image and an original one." <<
+private:
+    typedef std::unordered_set<std::string> Names;
+
+    Names dirs_;
+    Names files_;
+    std::string last_prefix_; // a directory with a trailing separator
+
+    ExistingFiles(
+        const ExistingFiles& that);
+
+    ExistingFiles& operator=(
+        const ExistingFiles& that);
+
+    void scan(
+        const std::string& prefix)
+    {
+        std::string dir = prefix;
+
+        // Keep the separator of the root.
+        if (dir.size() > 1)
+            dir.erase(dir.size() - 1);
+
+        std::vector<std::string> names;
+
+        get_dir_entries(dir, names);
+
+        for (size_t i = 0; i < names.size(); ++i)
+            files_.insert(get_key(prefix + names[i]));
+    }
+
+#ifdef _WIN32
+    // The file system is case insensitive.
+    static std::string get_key(
+        const std::string& file_name)
+    {
+        return to_lowercase(file_name);
+    }
+#else
+    static const std::string& get_key(
+        const std::string& file_name)
+    {
+        return file_name;
+    }
+#endif // _WIN32
+}; // class ExistingFiles
+
+
+#ifndef UW2_GR_TOOL_NO_STATS
+// Counters and timers of phases of a run (see --stats).
+// May be updated from several threads at once.
+class Stats {
+public:
+    enum Phase {
+        e_phase_palette_loading,
+        e_phase_gr_loading,
+        e_phase_decoding,
+        e_phase_image_writing,
+        e_phase_image_reading,
+        e_phase_encoding,
+        e_phase_gr_saving,
+        e_phase_overwrite_testing,
+        e_phase_count
+    }; // enum Phase
+
+    enum Counter {
+        e_counter_bytes_in,
+        e_counter_bytes_out,
+        e_counter_count
+    }; // enum Counter
+
+    // Bucket 0 counts decoding times below 1 us, bucket N times
+    // in range [2^(N-1), 2^N) us, and the last bucket all longer times.
+    static const int k_bucket_count = 18;
+
+    Stats() :
+        is_enabled_()
+    {
+        for (int i = 0; i < e_phase_count; ++i) {
+            phase_calls_[i] = 0;
+            phase_times_[i] = 0;
+        }
+
+        for (int i = 0; i < e_counter_count; ++i)
+            counters_[i] = 0;
+
+        for (int i = 0; i < k_type_count; ++i) {
+            encoded_counts_[i] = 0;
+
+            for (int j = 0; j < k_bucket_count; ++j)
+                histograms_[i][j] = 0;
+        }
+    }
+
+    ~Stats()
+    {
+    }
+
+    // Nothing is collected until enabled.
+    void enable()
+    {
+        is_enabled_ = true;
+    }
+
+    bool is_enabled() const
+    {
+        return is_enabled_;
+    }
+
+    // Adds a call of a phase which took the time in nanoseconds.
+    // Decoding and encoding are counted per type of bitmap.
+    void add_time(
+        Phase phase,
+        int type,
+        long long time)
+    {
+        phase_calls_[phase].fetch_add(1, std::memory_order_relaxed);
+        phase_times_[phase].fetch_add(time, std::memory_order_relaxed);
+
+        int type_index = get_type_index(type);
+
+        if (type_index < 0)
+            return;
+
+        if (phase == e_phase_decoding) {
+            histograms_[type_index][get_bucket_index(time)].fetch_add(
+                1, std::memory_order_relaxed);
+        } else if (phase == e_phase_encoding)
+            encoded_counts_[type_index].fetch_add(
+                1, std::memory_order_relaxed);
+    }
+
+    void add(
+        Counter counter,
+        long long value)
+    {
+        if (is_enabled_)
+            counters_[counter].fetch_add(value, std::memory_order_relaxed);
+    }
+
+    void add_file_size(
+        Counter counter,
+        const std::string& file_name)
+    {
+        long long size;
+        long long mtime;
+
+        if (is_enabled_ && get_file_status(file_name, size, mtime))
+            add(counter, size);
+    }
+
+    void print(
+        std::ostream& stream) const
+    {
+        stream << std::endl << "Statistics:" << std::endl <<
+            std::left << std::setw(22) << "  Phase" << std::right <<
+            std::setw(10) << "Calls" <<
+            std::setw(14) << "Total, ms" <<
+            std::setw(14) << "Mean, us" << std::endl;
+
+        std::ios_base::fmtflags flags = stream.flags();
+        stream << std::fixed << std::setprecision(3);
+
+        for (int i = 0; i < e_phase_count; ++i) {
+            long long calls = phase_calls_[i];
+            double time = static_cast<double>(phase_times_[i]);
+
+            stream <<
+                "  " << std::left << std::setw(20) <<
+                    get_phase_name(static_cast<Phase>(i)) << std::right <<
+                std::setw(10) << calls <<
+                std::setw(14) << (time / 1000000.0) <<
+                std::setw(14) << (calls > 0 ? time / 1000.0 / calls : 0.0) <<
                 std::endl;
-            return false;
         }
 
-        bool is_top_bottom = (info_header.biHeight < 0);
-        int x = 0;
-        int y = is_top_bottom ? 0 : height - 1;
-        int max_y = is_top_bottom ? height : 0;
-        int y_step = is_top_bottom ? 1 : -1;
-
-        pixels.clear();
-        pixels.resize(width * height);
-
-        if (info_header.is_compressed()) {
-            // Decode RLE8
-
-            bool align = false;
-            int count = 0;
-            int src_offset = 0;
-            unsigned char pixel = 0;
-            RleState state = e_rle_repeat;
-
-            while (state != e_rle_finished) {
-                switch (state) {
-                case e_rle_repeat: {
-                    count = data[src_offset++];
-
-                    if (count == 0)
-                        state = e_rle_escape;
-                    else {
-                        align = ((count % 2) != 0);
-                        pixel = data[src_offset++];
-                        state = e_rle_repeat_write;
-                    }
-                    break;
-                }
-
-                case e_rle_repeat_write:
-                    pixels[(y * width) + x] = pixel;
-
-                    ++x;
-                    --count;
-
-                    if (count == 0)
-                        state = e_rle_repeat;
-                    break;
-
-                case e_rle_absolute_write:
-                    pixels[(y * width) + x] = data[src_offset++];
-
-                    ++x;
-                    --count;
-
-                    if (count == 0) {
-                        if (align)
-                            state = e_rle_align;
-                        else
-                            state = e_rle_repeat;
-                    }
-                    break;
-
-                case e_rle_escape:
-                    count = data[src_offset++];
-
-                    switch (count) {
-                    case 0:
-                        state = e_rle_repeat;
-                        break;
-
-                    case 1:
-                        state = e_rle_finished;
-                        break;
-
-                    case 2:
-                        x += data[src_offset++];
-                        y += y_step * data[src_offset++];
-                        state = e_rle_repeat;
-                        break;
-
-                    default:
-                        align = ((count % 2) != 0);
-                        state = e_rle_absolute_write;
-                        break;
-                    }
-
-                    break;
-
-                case e_rle_align:
-                    ++src_offset;
-                    state = e_rle_repeat;
-                    break;
-
-                case e_rle_finished:
-                    break;
-                }
-
-                if (x == width) {
-                    x = 0;
-                    y += y_step;
-                }
-            }
-        } else {
-            int stride = ((width + 3) / 4) * 4;
-            int src_offset = 0;
+        stream.flags(flags);
+
+        stream <<
+            "  Bytes in: " << counters_[e_counter_bytes_in] << std::endl <<
+            "  Bytes out: " << counters_[e_counter_bytes_out] << std::endl;
+
+        stream << "  Decoded bitmaps:";
+
+        for (int i = 0; i < k_type_count; ++i)
+            stream << " type " << k_types[i] << ": " << get_decoded_count(i);
 
-            while (y != max_y) {
-                unsigned char* line = &pixels[y * width];
+        stream << std::endl << "  Encoded bitmaps:";
 
-                std::uninitialized_copy(
-                    &data[src_offset],
-                    &data[src_offset] + width,
-                    line);
+        for (int i = 0; i < k_type_count; ++i)
+            stream << " type " << k_types[i] << ": " << encoded_counts_[i];
 
-                src_offset += stride;
+        stream << std::endl <<
+            "  Decoding time, us" << std::setw(9) << "type 4" <<
+            std::setw(10) << "type 8" << std::setw(10) << "type 10" <<
+            std::endl;
 
-                y += y_step;
+        for (int i = 0; i < k_bucket_count; ++i) {
+            if (histograms_[0][i] == 0 &&
+                histograms_[1][i] == 0 &&
+                histograms_[2][i] == 0)
+            {
+                continue;
             }
+
+            std::ostringstream range;
+
+            if (i == 0)
+                range << "< 1";
+            else if (i == (k_bucket_count - 1))
+                range << ">= " << get_bucket_min(i);
+            else if (i == 1)
+                range << "1";
+            else
+                range << get_bucket_min(i) << "-" << (get_bucket_min(i + 1) - 1);
+
+            stream << "    " << std::left << std::setw(15) << range.str() <<
+                std::right;
+
+            for (int j = 0; j < k_type_count; ++j)
+                stream << std::setw(j == 0 ? 8 : 10) << histograms_[j][i];
+
+            stream << std::endl;
+        }
+    }
+
+    void print_json(
+        std::ostream& stream) const
+    {
+        stream << std::setprecision(9) <<
+            "{" << std::endl <<
+            "  \"phases\": {" << std::endl;
+
+        for (int i = 0; i < e_phase_count; ++i) {
+            std::string name =
+                to_lowercase(get_phase_name(static_cast<Phase>(i)));
+            std::replace(name.begin(), name.end(), ' ', '_');
+
+            stream << "    \"" << name << "\": {" <<
+                "\"calls\": " << phase_calls_[i] << ", " <<
+                "\"seconds\": " << (phase_times_[i] / 1000000000.0) << "}" <<
+                (i + 1 < e_phase_count ? "," : "") << std::endl;
         }
 
-        type = 4;
-        this->width = width;
-        this->height = height;
-        this->special = special;
-        data_size = width * height;
-        aux_palette = NULL;
+        stream << "  }," << std::endl <<
+            "  \"bytes_in\": " << counters_[e_counter_bytes_in] << "," <<
+                std::endl <<
+            "  \"bytes_out\": " << counters_[e_counter_bytes_out] << "," <<
+                std::endl;
+
+        stream << "  \"decoded_bitmaps\": {";
 
-        return true;
+        for (int i = 0; i < k_type_count; ++i) {
+            stream << (i > 0 ? ", " : "") << "\"" << k_types[i] << "\": " <<
+                get_decoded_count(i);
+        }
+
+        stream << "}," << std::endl << "  \"encoded_bitmaps\": {";
+
+        for (int i = 0; i < k_type_count; ++i) {
+            stream << (i > 0 ? ", " : "") << "\"" << k_types[i] << "\": " <<
+                encoded_counts_[i];
+        }
+
+        stream << "}," << std::endl << "  \"decoding_bucket_min_us\": [";
+
+        for (int i = 0; i < k_bucket_count; ++i)
+            stream << (i > 0 ? ", " : "") << get_bucket_min(i);
+
+        stream << "]," << std::endl << "  \"decoding_histograms\": {" <<
+            std::endl;
+
+        for (int i = 0; i < k_type_count; ++i) {
+            stream << "    \"" << k_types[i] << "\": [";
+
+            for (int j = 0; j < k_bucket_count; ++j)
+                stream << (j > 0 ? ", " : "") << histograms_[i][j];
+
+            stream << "]" << (i + 1 < k_type_count ? "," : "") << std::endl;
+        }
+
+        stream << "  }" << std::endl << "}" << std::endl;
+    }
+
+private:
+    static const int k_type_count = 3;
+    static const int k_types[k_type_count];
+
+    typedef std::atomic<long long> Value;
+
+    bool is_enabled_;
+    Value phase_calls_[e_phase_count];
+    Value phase_times_[e_phase_count];
+    Value counters_[e_counter_count];
+    Value encoded_counts_[k_type_count];
+    Value histograms_[k_type_count][k_bucket_count];
+
+    Stats(
+        const Stats& that);
+
+    Stats& operator=(
+        const Stats& that);
+
+    static const char* get_phase_name(
+        Phase phase)
+    {
+        switch (phase) {
+        case e_phase_palette_loading:
+            return "palette loading";
+        case e_phase_gr_loading:
+            return "GR loading";
+        case e_phase_decoding:
+            return "decoding";
+        case e_phase_image_writing:
+            return "image writing";
+        case e_phase_image_reading:
+            return "image reading";
+        case e_phase_encoding:
+            return "encoding";
+        case e_phase_gr_saving:
+            return "GR saving";
+        case e_phase_overwrite_testing:
+            return "overwrite testing";
+        default:
+            return "";
+        }
+    }
+
+    static int get_type_index(
+        int type)
+    {
+        for (int i = 0; i < k_type_count; ++i) {
+            if (k_types[i] == type)
+                return i;
+        }
+
+        return -1;
+    }
+
+    static int get_bucket_index(
+        long long time)
+    {
+        long long microseconds = time / 1000;
+        int index = 0;
+
+        while (microseconds > 0 && index < (k_bucket_count - 1)) {
+            microseconds >>= 1;
+            ++index;
+        }
+
+        return index;
     }
 
-    bool is_empty() const
+    static long long get_bucket_min(
+        int index)
     {
-        return pixels.empty();
+        return index > 0 ? (1LL << (index - 1)) : 0;
     }
 
-    bool is_compressed() const
+    long long get_decoded_count(
+        int type_index) const
     {
-        return type != 4;
+        long long count = 0;
+
+        for (int i = 0; i < k_bucket_count; ++i)
+            count += histograms_[type_index][i];
+
+        return count;
     }
+}; // class Stats
+
+const int Stats::k_types[Stats::k_type_count] = { 4, 8, 10 };
 
-    int get_size_in_bytes() const
+
+// Adds the lifetime of the object to a phase.
+class StatsTimer {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    StatsTimer(
+        Stats& stats,
+        Stats::Phase phase) :
+            stats_(stats),
+            phase_(phase),
+            type_(),
+            start_time_()
     {
-        if (is_compressed())
-            return (data_size + 1) / 2;
-        else
-            return data_size;
+        if (stats_.is_enabled())
+            start_time_ = Clock::now();
     }
 
-private:
-    enum RleState {
-        e_rle_repeat,
-        e_rle_repeat_write,
-        e_rle_absolute_write,
-        e_rle_escape,
-        e_rle_align,
-        e_rle_finished
-    }; // enum RleState
-}; // class Bitmap
+    ~StatsTimer()
+    {
+        if (!stats_.is_enabled())
+            return;
+
+        long long time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            Clock::now() - start_time_).count();
+
+        stats_.add_time(phase_, type_, time);
+    }
 
-typedef std::vector<Bitmap> Bitmaps;
-typedef Bitmaps::iterator BitmapsIt;
-typedef Bitmaps::const_iterator BitmapsCIt;
+    // Sets a type of the bitmap being decoded or encoded.
+    void set_type(
+        int type)
+    {
+        type_ = type;
+    }
 
-typedef std::vector<Palette> Palettes;
+private:
+    Stats& stats_;
+    Stats::Phase phase_;
+    int type_;
+    Clock::time_point start_time_;
+
+    StatsTimer(
+        const StatsTimer& that);
+
+    StatsTimer& operator=(
+        const StatsTimer& that);
+}; // class StatsTimer
+
+#define UW2_GR_TOOL_STATS_TIMER(name, phase) \
+    StatsTimer name(g_stats, Stats::phase)
+#define UW2_GR_TOOL_STATS_SET_TYPE(name, type) \
+    name.set_type(type)
+#define UW2_GR_TOOL_STATS_ADD(counter, value) \
+    g_stats.add(Stats::counter, value)
+#define UW2_GR_TOOL_STATS_ADD_FILE_SIZE(counter, file_name) \
+    g_stats.add_file_size(Stats::counter, file_name)
+#else
+#define UW2_GR_TOOL_STATS_TIMER(name, phase) static_cast<void>(0)
+#define UW2_GR_TOOL_STATS_SET_TYPE(name, type) static_cast<void>(0)
+#define UW2_GR_TOOL_STATS_ADD(counter, value) static_cast<void>(0)
+#define UW2_GR_TOOL_STATS_ADD_FILE_SIZE(counter, file_name) \
+    static_cast<void>(0)
+#endif // UW2_GR_TOOL_NO_STATS
 
 
 // Globals.
 //
 
-const int k_max_file_size = 1 * 1024 * 1024;
-const int k_max_palette_count = 8;
 const std::string k_mappings_file_name_suffix = "_mappings.txt";
+const std::string k_binary_mappings_file_name_suffix = "_mappings.bin";
+const std::string k_atlas_file_name_suffix = "_atlas.txt";
+const std::string k_stamps_file_name_suffix = "_stamps.txt";
+
+// Fits the largest bitmap many times over.
+const int k_atlas_page_size = 1024;
 
 
-bool g_is_panels;
 std::string g_original_file_name;
 std::string g_original_base_name_lc;
 std::string g_command;
@@ -1112,12 +1336,33 @@ std::string g_in_file_name;
 std::string g_out_file_name;
 std::string g_in_dir;
 std::string g_out_dir;
+std::string g_in_root;
+std::string g_out_root;
+int g_thread_count = 1;
+ImageFormat g_image_format = e_format_bmp;
+bool g_is_atlas;
+bool g_is_forced;
+bool g_is_binary_mappings;
+OverwritePolicy g_overwrite_policy = e_overwrite_ask;
+ExistingFiles g_existing_files;
+long long g_sources_mtime;
+FileStamp g_gr_stamp;
+FileStamps g_file_stamps;
+std::vector<std::string> g_stamped_image_names;
+IndexedBitmapStamps g_bitmap_stamps;
+long long g_file_stamps_mtime;
+std::vector<std::string> g_atlas_pages;
+AtlasEntries g_atlas_entries;
 Mappings g_mappings;
-Bitmaps g_bitmaps;
-PaletteMap g_palette_map;
-Palettes g_palettes;
-AuxPalettes g_aux_palettes;
+MappingsIndex g_mappings_index;
+const Resource* g_resource;
+PaletteSet g_palette_set;
+GrArchive g_archive;
 std::string g_user_answer;
+#ifndef UW2_GR_TOOL_NO_STATS
+Stats g_stats;
+std::string g_json_stats_file_name; // empty for a table
+#endif // UW2_GR_TOOL_NO_STATS
 
 
 bool compare_ci_partialy(
@@ -1142,26 +1387,82 @@ bool compare_ci_partialy(
     return i == size;
 }
 
+// Adds a source of files being written for --overwrite=newer.
+void add_source_file(
+    const std::string& file_name)
+{
+    if (g_overwrite_policy != e_overwrite_newer)
+        return;
+
+    long long size;
+    long long mtime;
+
+    if (get_file_status(file_name, size, mtime))
+        g_sources_mtime = std::max(g_sources_mtime, mtime);
+}
+
+// Sets g_user_answer for a file being written: empty, "yes" or "all"
+// to write it, "no" to skip it, "cancel" to stop.
 void test_file_for_overwrite(
     const std::string& file_name)
 {
     if (g_user_answer == "all" || g_user_answer == "cancel")
         return;
 
-    if (!is_file_exists(file_name))
+    // An answer applies to one file only.
+    g_user_answer.clear();
+
+    if (g_overwrite_policy == e_overwrite_always)
+        return;
+
+    bool is_exists;
+
+    {
+        UW2_GR_TOOL_STATS_TIMER(timer, e_phase_overwrite_testing);
+        is_exists = g_existing_files.includes(file_name);
+    }
+
+    if (!is_exists)
+        return;
+
+    if (g_overwrite_policy == e_overwrite_never)
+        g_user_answer = "no";
+    else if (g_overwrite_policy == e_overwrite_newer) {
+        long long size;
+        long long mtime;
+
+        if (get_file_status(file_name, size, mtime) &&
+            mtime >= g_sources_mtime)
+        {
+            g_user_answer = "no";
+        }
+    }
+
+    if (g_user_answer == "no") {
+        std::cout << "Skipping existing file \"" << file_name << "\"." <<
+            std::endl;
+        return;
+    }
+
+    if (g_overwrite_policy != e_overwrite_ask)
         return;
 
     std::string answer;
 
-    for (bool done = false; !done; ) {
+    while (g_user_answer.empty()) {
         std::cout << "File \"" << file_name <<
             "\" already exist. Overwrite? (all/yes/no/cancel) ";
-        std::cin >> answer;
 
-        if (answer.empty())
-            continue;
+        if (!(std::cin >> answer)) {
+            std::cout << std::endl;
+            std::cerr <<
+                "ERROR: No answer. Use --overwrite to answer in advance." <<
+                std::endl;
+            g_user_answer = "cancel";
+            break;
+        }
 
-        to_lowercase(answer);
+        answer = to_lowercase(answer);
 
         if (compare_ci_partialy(answer, "all"))
             g_user_answer = "all";
@@ -1173,489 +1474,1511 @@ void test_file_for_overwrite(
             g_user_answer = "cancel";
             std::cout << "Canceled by user." << std::endl;
         }
-
-        if (!g_user_answer.empty())
-            break;
     }
 }
 
-void initialize_palette_map(
-    PaletteMap& palette_map)
-{
-    palette_map["3DWIN.GR"] = 0;
-    palette_map["ANIMO.GR"] = 0;
-    palette_map["ARMOR_F.GR"] = 0;
-    palette_map["ARMOR_M.GR"] = 0;
-    palette_map["BODIES.GR"] = 0;
-    palette_map["BUTTONS.GR"] = 0;
-    palette_map["CHAINS.GR"] = 0;
-    palette_map["CHARHEAD.GR"] = 0;
-    palette_map["CHRBTNS.GR"] = 3;
-    palette_map["COMPASS.GR"] = 0;
-    palette_map["CONVERSE.GR"] = 0;
-    palette_map["CURSORS.GR"] = 0;
-    palette_map["DOORS.GR"] = 0;
-    palette_map["DRAGONS.GR"] = 0;
-    palette_map["EYES.GR"] = 0;
-    palette_map["FLASKS.GR"] = 0;
-    palette_map["GEMPT.GR"] = 0;
-    palette_map["GENHEAD.GR"] = 0;
-    palette_map["GHED.GR"] = 0;
-    palette_map["HEADS.GR"] = 0;
-    palette_map["INV.GR"] = 0;
-    palette_map["LFTI.GR"] = 0;
-    palette_map["OBJECTS.GR"] = 0;
-    palette_map["OPBTN.GR"] = 2;
-    palette_map["OPTB.GR"] = 0;
-    palette_map["OPTBTNS.GR"] = 0;
-    palette_map["PANELS.GR"] = 0;
-    palette_map["POWER.GR"] = 0;
-    palette_map["QUESTION.GR"] = 0;
-    palette_map["SCRLEDGE.GR"] = 0;
-    palette_map["SPELLS.GR"] = 0;
-    palette_map["TMFLAT.GR"] = 0;
-    palette_map["TMOBJ.GR"] = 0;
-    palette_map["VIEWS.GR"] = 0;
-    palette_map["WEAP.GR"] = 0;
-}
-
-bool load_palettes(
-    const std::string& path,
-    Palettes& palettes,
-    AuxPalettes& aux_palettes)
+// Loads mappings from the binary file unless the text one is newer,
+// and brings the other file in line with the loaded one.
+bool load_mappings(
+    const std::string& text_file_name,
+    const std::string& binary_file_name)
 {
-    std::string file_name;
-
-    //
-    file_name = combine_path(path, "PALS.DAT");
-    std::cout << "Loading palettes from \"" << file_name << "\"." << std::endl;
-
-    std::ifstream file(
-        file_name.c_str(),
-        std::ios_base::in | std::ios_base::binary);
-
-    if (!file) {
-        std::cerr << "ERROR: Failed to open." << std::endl;
-        return false;
-    }
-
-    palettes.resize(k_max_palette_count);
+    long long text_size;
+    long long text_mtime;
+    long long binary_size;
+    long long binary_mtime;
+
+    bool has_text = get_file_status(text_file_name, text_size, text_mtime);
+    bool has_binary =
+        get_file_status(binary_file_name, binary_size, binary_mtime);
+
+    // The text file may be edited by hand, so it is only created
+    // if missing; the binary one follows the text one.
+    if (has_binary && (!has_text || binary_mtime >= text_mtime)) {
+        if (!g_mappings_index.load_from_binary(binary_file_name))
+            return false;
 
-    for (int i = 0; i < k_max_palette_count; ++i) {
-        palettes[i].resize(768);
-        file.read(reinterpret_cast<char*>(&palettes[i][0]), 768);
+        if (!has_text && !g_mappings_index.save_to_text(text_file_name))
+            return false;
+    } else {
+        if (!g_mappings_index.load_from_text(text_file_name))
+            return false;
 
-        if (!file) {
-            std::cerr << "ERROR: I/O error." << std::endl;
+        if ((has_binary || g_is_binary_mappings) &&
+            !g_mappings_index.save_to_binary(binary_file_name))
+        {
             return false;
         }
     }
 
-    //
-    file_name = combine_path(path, "ALLPALS.DAT");
-    std::cout << "Loading auxiliary palettes from \"" <<
-        file_name << "\"." << std::endl;
-
-    std::ifstream aux_file(
-        file_name.c_str(),
-        std::ios_base::in | std::ios_base::binary);
+    return true;
+}
 
-    if (!aux_file) {
-        std::cerr << "ERROR: Failed to open." << std::endl;
-        return false;
-    }
+bool load_gr_file(
+    const std::string& file_name)
+{
+    std::cout << "Loading \"" << file_name << "\"." << std::endl;
 
-    aux_file.read(reinterpret_cast<char*>(aux_palettes), 32 * 16);
+    UW2_GR_TOOL_STATS_TIMER(timer, e_phase_gr_loading);
+    UW2_GR_TOOL_STATS_ADD_FILE_SIZE(e_counter_bytes_in, file_name);
 
-    if (!aux_file) {
-        std::cerr << "ERROR: I/O error." << std::endl;
-        return false;
-    }
+    g_sources_mtime = 0;
+    add_source_file(file_name);
 
-    return true;
+    return g_archive.open(file_name, *g_resource, g_palette_set);
 }
 
-bool load_mappings(
+bool save_gr_file(
     const std::string& file_name)
 {
-    std::cout << "Loading mappings from \"" << file_name << "\"" << std::endl;
-
-    std::ifstream file(file_name.c_str());
+    test_file_for_overwrite(file_name);
 
-    if (!file) {
-        std::cerr << "ERROR: Failed to open." << std::endl;
+    if (g_user_answer == "no" || g_user_answer == "cancel")
         return false;
-    }
 
-    g_mappings.clear();
+    std::cout << "Saving to \"" << file_name << "\"." << std::endl;
 
-    while (!file.eof()) {
-        int bitmap_index;
-        std::string bitmap_file_name;
+    UW2_GR_TOOL_STATS_TIMER(timer, e_phase_gr_saving);
 
-        file >> bitmap_index;
+    if (!g_archive.save(file_name))
+        return false;
 
-        if (!file) {
-            if (!file.eof()) {
-                std::cerr << "ERROR: Invalid bitmap index value." << std::endl;
-                return false;
-            } else
-                return true;
-        }
+    UW2_GR_TOOL_STATS_ADD_FILE_SIZE(e_counter_bytes_out, file_name);
 
-        if (bitmap_index < 0) {
-            std::cerr << "ERROR: Negative bitmap index." << std::endl;
+    return true;
+}
+
+bool load_palettes()
+{
+    UW2_GR_TOOL_STATS_TIMER(timer, e_phase_palette_loading);
+
+    return g_palette_set.load(g_path_to_data);
+}
+
+bool make_file_stamp(
+    const std::string& file_name,
+    FileStamp& stamp)
+{
+    return
+        get_file_status(file_name, stamp.size, stamp.mtime) &&
+        hash_file(file_name, stamp.hash);
+}
+
+// Saves stamps of the .GR file, of images extracted from it and
+// of regions of the images the bitmaps went to, so unchanged bitmaps
+// may be skipped on rebuild.
+//
+// Stamps file:
+//   gr <size> <hash>
+//   image <name> <size> <mtime> <hash>
+//   bitmap <bitmap index> <image index> <x> <y> <width> <height>
+bool save_file_stamps(
+    const std::vector<const char*>& image_names,
+    const std::vector<FileStamp>& image_stamps,
+    const BitmapStamps& bitmap_stamps)
+{
+    std::string file_name = combine_path(
+        g_out_dir, g_original_base_name_lc + k_stamps_file_name_suffix);
+
+    FileStamp stamp;
+
+    if (!make_file_stamp(g_in_file_name, stamp)) {
+        std::cerr << "ERROR: Failed to read \"" <<
+            g_in_file_name << "\"." << std::endl;
+        return false;
+    }
+
+    std::ofstream file(file_name.c_str());
+
+    if (!file) {
+        std::cerr << "ERROR: Failed to open \"" <<
+            file_name << "\"." << std::endl;
+        return false;
+    }
+
+    file << std::hex << std::setfill('0');
+
+    file << "gr " << std::dec << stamp.size << ' ' <<
+        std::hex << std::setw(16) << stamp.hash << std::endl;
+
+    for (size_t i = 0; i < image_names.size(); ++i) {
+        const FileStamp& image_stamp = image_stamps[i];
+
+        file << "image " << image_names[i] << ' ' << std::dec <<
+            image_stamp.size << ' ' << image_stamp.mtime << ' ' <<
+            std::hex << std::setw(16) << image_stamp.hash << std::endl;
+    }
+
+    file << std::dec;
+
+    for (size_t i = 0; i < bitmap_stamps.size(); ++i) {
+        const BitmapStamp& bitmap_stamp = bitmap_stamps[i];
+
+        file << "bitmap " << bitmap_stamp.bitmap_index << ' ' <<
+            bitmap_stamp.image_index << ' ' <<
+            bitmap_stamp.x << ' ' << bitmap_stamp.y << ' ' <<
+            bitmap_stamp.width << ' ' << bitmap_stamp.height << std::endl;
+    }
+
+    if (!file) {
+        std::cerr << "ERROR: I/O error." << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// Stamps saved images by reading them back.
+bool save_file_stamps(
+    const std::vector<std::string>& image_names,
+    const BitmapStamps& bitmap_stamps)
+{
+    std::vector<const char*> names(image_names.size());
+    std::vector<FileStamp> stamps(image_names.size());
+
+    for (size_t i = 0; i < image_names.size(); ++i) {
+        std::string image_file_name = combine_path(g_out_dir, image_names[i]);
+
+        if (!make_file_stamp(image_file_name, stamps[i])) {
+            std::cerr << "ERROR: Failed to read \"" <<
+                image_file_name << "\"." << std::endl;
+            return false;
+        }
+
+        names[i] = image_names[i].c_str();
+    }
+
+    return save_file_stamps(names, stamps, bitmap_stamps);
+}
+
+// Loads stamps of a directory if they are of the same .GR file.
+// Without them every image is treated as changed.
+void load_file_stamps(
+    const std::string& dir)
+{
+    g_file_stamps.clear();
+    g_stamped_image_names.clear();
+    g_bitmap_stamps.clear();
+
+    if (g_is_forced)
+        return;
+
+    std::string file_name = combine_path(
+        dir, g_original_base_name_lc + k_stamps_file_name_suffix);
+
+    std::ifstream file(file_name.c_str());
+    long long size;
+
+    if (!file || !get_file_status(file_name, size, g_file_stamps_mtime))
+        return;
+
+    std::string tag;
+
+    file >> tag >> std::dec >> g_gr_stamp.size >>
+        std::hex >> g_gr_stamp.hash;
+
+    if (!file || tag != "gr")
+        return;
+
+    FileStamp stamp;
+
+    if (!make_file_stamp(g_in_file_name, stamp) ||
+        stamp.size != g_gr_stamp.size ||
+        stamp.hash != g_gr_stamp.hash)
+    {
+        std::cout << "Stamps are of another file; rebuilding all bitmaps." <<
+            std::endl;
+        return;
+    }
+
+    FileStamps file_stamps;
+    std::vector<std::string> image_names;
+    IndexedBitmapStamps bitmap_stamps;
+
+    // Stamps of an unknown layout are ignored as a whole.
+    while (file >> tag) {
+        if (tag == "image") {
+            std::string image_name;
+
+            file >> image_name >> std::dec >> stamp.size >> stamp.mtime >>
+                std::hex >> stamp.hash;
+
+            if (!file)
+                return;
+
+            file_stamps[image_name] = stamp;
+            image_names.push_back(image_name);
+        } else if (tag == "bitmap") {
+            BitmapStamp bitmap_stamp;
+
+            file >> std::dec >> bitmap_stamp.bitmap_index >>
+                bitmap_stamp.image_index >> bitmap_stamp.x >>
+                bitmap_stamp.y >> bitmap_stamp.width >> bitmap_stamp.height;
+
+            if (!file ||
+                bitmap_stamp.image_index < 0 ||
+                bitmap_stamp.image_index >=
+                    static_cast<int>(image_names.size()))
+            {
+                return;
+            }
+
+            bitmap_stamps[bitmap_stamp.bitmap_index] = bitmap_stamp;
+        } else
+            return;
+    }
+
+    if (!file.eof())
+        return;
+
+    g_file_stamps.swap(file_stamps);
+    g_stamped_image_names.swap(image_names);
+    g_bitmap_stamps.swap(bitmap_stamps);
+}
+
+// Returns true if an image in the directory of the stamps has the same
+// content as when it was stamped. Hashes it only if the time
+// of modification differs or is too close to the time the stamps were
+// saved to tell.
+bool is_image_unchanged(
+    const std::string& dir,
+    const std::string& image_name)
+{
+    FileStampsCIt i = g_file_stamps.find(image_name);
+
+    if (i == g_file_stamps.end())
+        return false;
+
+    std::string file_name = combine_path(dir, image_name);
+    FileStamp stamp;
+
+    if (!get_file_status(file_name, stamp.size, stamp.mtime) ||
+        stamp.size != i->second.size)
+    {
+        return false;
+    }
+
+    if (stamp.mtime == i->second.mtime && stamp.mtime < g_file_stamps_mtime)
+        return true;
+
+    return hash_file(file_name, stamp.hash) && stamp.hash == i->second.hash;
+}
+
+// Returns true if a bitmap was extracted to the same region
+// of the same image.
+bool is_bitmap_stamped(
+    int bitmap_index,
+    const std::string& image_name,
+    int x,
+    int y,
+    int width,
+    int height)
+{
+    IndexedBitmapStampsCIt i = g_bitmap_stamps.find(bitmap_index);
+
+    if (i == g_bitmap_stamps.end())
+        return false;
+
+    const BitmapStamp& stamp = i->second;
+
+    return
+        g_stamped_image_names[stamp.image_index] == image_name &&
+        stamp.x == x &&
+        stamp.y == y &&
+        stamp.width == width &&
+        stamp.height == height;
+}
+
+bool save_atlas(
+    const std::string& file_name)
+{
+    std::ofstream file(file_name.c_str());
+
+    std::cout << "Saving atlas index to \"" << file_name << "\"." << std::endl;
+
+    if (!file) {
+        std::cerr << "ERROR: Failed to open." << std::endl;
+        return false;
+    }
+
+    file << "pages " << g_atlas_pages.size() << std::endl;
+
+    for (size_t i = 0; i < g_atlas_pages.size(); ++i)
+        file << i << ' ' << g_atlas_pages[i] << std::endl;
+
+    file << "bitmaps " << g_atlas_entries.size() << std::endl;
+
+    for (AtlasEntriesCIt i = g_atlas_entries.begin();
+        i != g_atlas_entries.end(); ++i)
+    {
+        const Bitmap& bitmap = g_archive.get_bitmap(i->bitmap_index);
+
+        int aux_palette_index = -1;
+
+        if (bitmap.aux_palette)
+            aux_palette_index = bitmap.aux_palette - g_palette_set.get_aux_palettes();
+
+        file << i->bitmap_index << ' ' << i->page_index << ' ' <<
+            i->x << ' ' << i->y << ' ' <<
+            i->width << ' ' << i->height << ' ' <<
+            bitmap.type << ' ' << aux_palette_index << std::endl;
+    }
+
+    if (!file) {
+        std::cerr << "ERROR: I/O error." << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// Loads an atlas index; also fills mappings of bitmaps to pages.
+bool load_atlas(
+    const std::string& file_name)
+{
+    std::cout << "Loading atlas index from \"" << file_name << "\"" << std::endl;
+
+    std::ifstream file(file_name.c_str());
+
+    if (!file) {
+        std::cerr << "ERROR: Failed to open." << std::endl;
+        return false;
+    }
+
+    g_mappings.clear();
+    g_atlas_pages.clear();
+    g_atlas_entries.clear();
+
+    std::string tag;
+    int page_count = -1;
+
+    file >> tag >> page_count;
+
+    if (!file || tag != "pages" || page_count < 0) {
+        std::cerr << "ERROR: Invalid number of pages." << std::endl;
+        return false;
+    }
+
+    for (int i = 0; i < page_count; ++i) {
+        int page_index = -1;
+        std::string page_file_name;
+
+        file >> page_index >> page_file_name;
+
+        if (!file || page_index != i) {
+            std::cerr << "ERROR: Invalid page " << i << '.' << std::endl;
             return false;
         }
 
-        file >> bitmap_file_name;
+        g_atlas_pages.push_back(page_file_name);
+    }
+
+    int entry_count = -1;
+
+    file >> tag >> entry_count;
+
+    if (!file || tag != "bitmaps" || entry_count < 0) {
+        std::cerr << "ERROR: Invalid number of bitmaps." << std::endl;
+        return false;
+    }
+
+    for (int i = 0; i < entry_count; ++i) {
+        AtlasEntry entry;
+        int type;
+        int aux_palette_index;
+
+        // The type and the auxiliary palette are informative only.
+        file >> entry.bitmap_index >> entry.page_index >>
+            entry.x >> entry.y >> entry.width >> entry.height >>
+            type >> aux_palette_index;
 
         if (!file) {
-            std::cerr << "ERROR: Invalid bitmap file name." << std::endl;
+            std::cerr << "ERROR: Invalid entry " << i << '.' << std::endl;
+            return false;
+        }
+
+        if (entry.bitmap_index < 0) {
+            std::cerr << "ERROR: Negative bitmap index." << std::endl;
+            return false;
+        }
+
+        if (entry.page_index < 0 || entry.page_index >= page_count) {
+            std::cerr << "ERROR: Page index is out of range: " <<
+                entry.page_index << '.' << std::endl;
             return false;
         }
 
-        if (g_mappings.find(bitmap_index) != g_mappings.end()) {
+        if (entry.x < 0 || entry.y < 0 ||
+            entry.width <= 0 || entry.height <= 0)
+        {
+            std::cerr << "ERROR: Invalid rectangle of bitmap " <<
+                entry.bitmap_index << '.' << std::endl;
+            return false;
+        }
+
+        if (g_mappings.find(entry.bitmap_index) != g_mappings.end()) {
             std::cerr << "ERROR: Duplicating bitmap index: " <<
-                bitmap_index << '.' << std::endl;
+                entry.bitmap_index << '.' << std::endl;
+            return false;
+        }
+
+        g_mappings[entry.bitmap_index] = g_atlas_pages[entry.page_index];
+        g_atlas_entries.push_back(entry);
+    }
+
+    return true;
+}
+
+// A task on a bitmap which keeps its messages to print them
+// in order of bitmaps.
+class BitmapTask : public Task {
+public:
+    std::string file_name;
+    const char* message; // printed along with the file name
+    std::ostringstream err;
+    bool is_succeed;
+
+    BitmapTask() :
+        message(),
+        is_succeed()
+    {
+    }
+}; // class BitmapTask
+
+typedef std::deque<BitmapTask*> BitmapTasks;
+typedef std::vector<BitmapTask*> IdleBitmapTasks;
+
+// Exports a bitmap to an image file and stamps the file.
+// The task is reused for next bitmaps, so its buffers
+// stop growing after the largest bitmap.
+class ExportTask : public BitmapTask {
+public:
+    Bitmap bitmap;
+    Buffer buffer; // pixels of a file which is not mapped
+    ImageFormat format;
+    ImageScratch scratch;
+    FileStamp* stamp;
+
+    ExportTask() :
+        format(e_format_bmp),
+        stamp()
+    {
+        message = "Exporting a bitmap to";
+    }
+
+    virtual void run()
+    {
+        is_succeed = false;
+
+        {
+            UW2_GR_TOOL_STATS_TIMER(timer, e_phase_decoding);
+            UW2_GR_TOOL_STATS_SET_TYPE(timer, bitmap.type);
+            bitmap.decode(scratch.image);
+        }
+
+        {
+            UW2_GR_TOOL_STATS_TIMER(timer, e_phase_image_writing);
+
+            if (!scratch.image.save_to_file(
+                file_name, format, *bitmap.palette, scratch, err))
+            {
+                return;
+            }
+        }
+
+        const Buffer& file = scratch.file;
+
+        UW2_GR_TOOL_STATS_ADD(e_counter_bytes_out, file.size());
+
+        // The contents are at hand, so there is no need
+        // to read the file back.
+        stamp->size = static_cast<long long>(file.size());
+        stamp->hash = hash_data(&file[0], file.size());
+
+        long long size;
+
+        if (!get_file_status(file_name, size, stamp->mtime)) {
+            err << "ERROR: Failed to read \"" << file_name << "\"." <<
+                std::endl;
+            return;
+        }
+
+        is_succeed = true;
+    }
+}; // class ExportTask
+
+// Imports a bitmap from an image file and compresses it.
+class ImportTask : public BitmapTask {
+public:
+    Bitmap* bitmap;
+    Bitmap::Special special;
+    const AuxPaletteIndex* aux_palette_index;
+
+    ImportTask() :
+        bitmap(),
+        special(Bitmap::e_default),
+        aux_palette_index()
+    {
+        message = "Importing bitmap from";
+    }
+
+    virtual void run()
+    {
+        IndexedImage image;
+
+        {
+            UW2_GR_TOOL_STATS_TIMER(timer, e_phase_image_reading);
+
+            if (!image.load_from_file(
+                file_name, k_max_width, k_max_height, err))
+            {
+                return;
+            }
+        }
+
+        UW2_GR_TOOL_STATS_ADD_FILE_SIZE(e_counter_bytes_in, file_name);
+
+        if (!bitmap->check_import_dimensions(image.width, image.height, err))
+            return;
+
+        UW2_GR_TOOL_STATS_TIMER(timer, e_phase_encoding);
+
+        bitmap->import_from_region(
+            image, 0, 0, special, aux_palette_index);
+
+        UW2_GR_TOOL_STATS_SET_TYPE(timer, bitmap->type);
+
+        is_succeed = true;
+    }
+}; // class ImportTask
+
+// Imports a bitmap from a region of an atlas page.
+class RegionImportTask : public BitmapTask {
+public:
+    Bitmap* bitmap;
+    const IndexedImage* image;
+    int x;
+    int y;
+    Bitmap::Special special;
+    const AuxPaletteIndex* aux_palette_index;
+
+    RegionImportTask() :
+        bitmap(),
+        image(),
+        x(),
+        y(),
+        special(Bitmap::e_default),
+        aux_palette_index()
+    {
+    }
+
+    virtual void run()
+    {
+        UW2_GR_TOOL_STATS_TIMER(timer, e_phase_encoding);
+
+        bitmap->import_from_region(
+            *image, x, y, special, aux_palette_index);
+
+        UW2_GR_TOOL_STATS_SET_TYPE(timer, bitmap->type);
+
+        is_succeed = true;
+    }
+}; // class RegionImportTask
+
+// Waits for the oldest task and prints its messages. The task
+// is put to the idle ones for reuse if specified or deleted.
+bool retire_bitmap_task(
+    WorkerPool& pool,
+    BitmapTasks& tasks,
+    IdleBitmapTasks* idle_tasks = NULL)
+{
+    BitmapTask* task = tasks.front();
+    tasks.pop_front();
+
+    pool.wait(task);
+
+    if (task->message) {
+        std::cout << task->message << " \"" << task->file_name << "\"." <<
+            std::endl;
+    }
+
+    if (task->err.tellp() > 0) {
+        std::cerr << task->err.str();
+        task->err.str(std::string());
+    }
+
+    bool result = task->is_succeed;
+
+    if (idle_tasks)
+        idle_tasks->push_back(task);
+    else
+        delete task;
+
+    return result;
+}
+
+// Posts a task; retires the oldest ones to keep the queue short.
+bool post_bitmap_task(
+    WorkerPool& pool,
+    BitmapTasks& tasks,
+    BitmapTask* task,
+    IdleBitmapTasks* idle_tasks = NULL)
+{
+    pool.post(task);
+    tasks.push_back(task);
+
+    size_t max_task_count = 2 * pool.get_thread_count();
+    bool result = true;
+
+    while (tasks.size() > max_task_count) {
+        if (!retire_bitmap_task(pool, tasks, idle_tasks))
+            result = false;
+    }
+
+    return result;
+}
+
+// Retires all tasks.
+bool finish_bitmap_tasks(
+    WorkerPool& pool,
+    BitmapTasks& tasks,
+    IdleBitmapTasks* idle_tasks = NULL)
+{
+    bool result = true;
+
+    while (!tasks.empty()) {
+        if (!retire_bitmap_task(pool, tasks, idle_tasks))
+            result = false;
+    }
+
+    return result;
+}
+
+// Appends a number padded with zeros to four digits.
+void append_padded_number(
+    int value,
+    std::string& string)
+{
+    char digits[16];
+    int count = 0;
+
+    do {
+        digits[count++] = static_cast<char>('0' + (value % 10));
+        value /= 10;
+    } while (value > 0);
+
+    while (count < 4)
+        digits[count++] = '0';
+
+    while (count > 0)
+        string += digits[--count];
+}
+
+bool extract_gr_file()
+{
+    if (!load_gr_file(g_in_file_name))
+        return false;
+
+    if (!create_dirs_along_the_path(g_out_dir))
+        return false;
+
+    std::string mappings_file_name = combine_path(
+        g_out_dir, g_original_base_name_lc + k_mappings_file_name_suffix);
+
+    int bitmap_count = g_archive.get_bitmap_count();
+
+    // Per-run storage reserved up front, so a bitmap does not
+    // allocate memory: file names are built in place, mapped names
+    // go to the pool of the index and tasks are reused.
+    std::string path_prefix =
+        combine_path(g_out_dir, g_original_base_name_lc + '_');
+    size_t name_offset =
+        path_prefix.size() - (g_original_base_name_lc.size() + 1);
+    std::string extension = get_image_extension(g_image_format);
+
+    MappingsIndex::Records records;
+    Buffer pool;
+    std::vector<FileStamp> stamps(bitmap_count);
+    std::vector<int> exported_records;
+
+    records.reserve(bitmap_count);
+    pool.reserve(
+        bitmap_count * (path_prefix.size() - name_offset +
+        8 + extension.size() + 1));
+    exported_records.reserve(bitmap_count);
+
+    // A single thread exports bitmaps by itself.
+    WorkerPool worker_pool(g_thread_count > 1 ? g_thread_count : 0);
+    BitmapTasks tasks;
+    IdleBitmapTasks idle_tasks;
+    std::string bitmap_file_name;
+    bool result = true;
+
+    for (int i = 0; i < bitmap_count && result; ++i) {
+        const Bitmap& bitmap = g_archive.get_bitmap(i);
+
+        if (bitmap.is_empty())
+            continue;
+
+        bitmap_file_name = path_prefix;
+        append_padded_number(i, bitmap_file_name);
+        bitmap_file_name += extension;
+
+        test_file_for_overwrite(bitmap_file_name);
+
+        if (g_user_answer.empty() ||
+            g_user_answer == "all" ||
+            g_user_answer == "yes")
+        {
+            ExportTask* task;
+
+            if (idle_tasks.empty())
+                task = new ExportTask();
+            else {
+                task = static_cast<ExportTask*>(idle_tasks.back());
+                idle_tasks.pop_back();
+            }
+
+            task->file_name = bitmap_file_name;
+            task->format = g_image_format;
+            task->stamp = &stamps[records.size()];
+
+            if (!g_archive.fetch_bitmap(i, task->buffer)) {
+                delete task;
+                result = false;
+                break;
+            }
+
+            task->bitmap = bitmap;
+            g_archive.release_bitmap(i);
+
+            if (!post_bitmap_task(worker_pool, tasks, task, &idle_tasks))
+                result = false;
+
+            exported_records.push_back(static_cast<int>(records.size()));
+        } else if (g_user_answer == "cancel")
+            result = false;
+
+        records.push_back(
+            MappingsIndex::Record(i, static_cast<int>(pool.size())));
+        pool.insert(
+            pool.end(),
+            bitmap_file_name.begin() + name_offset,
+            bitmap_file_name.end());
+        pool.push_back(0);
+    }
+
+    if (!finish_bitmap_tasks(worker_pool, tasks, &idle_tasks))
+        result = false;
+
+    for (size_t i = 0; i < idle_tasks.size(); ++i)
+        delete idle_tasks[i];
+
+    if (!result)
+        return false;
+
+    g_mappings_index.build(records, pool);
+
+    test_file_for_overwrite(mappings_file_name);
+
+    if (g_user_answer.empty() ||
+        g_user_answer == "all" ||
+        g_user_answer == "yes")
+    {
+        if (!g_mappings_index.save_to_text(mappings_file_name))
             return false;
+
+        // Keep an existing binary file in line with the text one.
+        std::string binary_mappings_file_name = combine_path(
+            g_out_dir,
+            g_original_base_name_lc + k_binary_mappings_file_name_suffix);
+
+        if ((g_is_binary_mappings ||
+            is_file_exists(binary_mappings_file_name)) &&
+            !g_mappings_index.save_to_binary(binary_mappings_file_name))
+        {
+            return false;
+        }
+    } else if (g_user_answer == "cancel")
+            return false;
+
+    // Images which were kept keep their previous stamps
+    // if they did not change since.
+    load_file_stamps(g_out_dir);
+
+    std::vector<const char*> image_names;
+    std::vector<FileStamp> image_stamps;
+    BitmapStamps bitmap_stamps;
+
+    image_names.reserve(records.size());
+    image_stamps.reserve(records.size());
+    bitmap_stamps.reserve(records.size());
+
+    size_t exported_index = 0;
+
+    for (size_t i = 0; i < records.size(); ++i) {
+        int bitmap_index = records[i].first;
+        const Bitmap& bitmap = g_archive.get_bitmap(bitmap_index);
+        const char* image_name =
+            g_mappings_index.get_file_name(static_cast<int>(i));
+
+        if (exported_index < exported_records.size() &&
+            exported_records[exported_index] == static_cast<int>(i))
+        {
+            image_stamps.push_back(stamps[i]);
+            ++exported_index;
+        } else if (
+            is_bitmap_stamped(
+                bitmap_index, image_name, 0, 0,
+                bitmap.width, bitmap.height) &&
+            is_image_unchanged(g_out_dir, image_name))
+        {
+            image_stamps.push_back(g_file_stamps[image_name]);
+        } else
+            continue;
+
+        image_names.push_back(image_name);
+
+        BitmapStamp bitmap_stamp;
+        bitmap_stamp.bitmap_index = bitmap_index;
+        bitmap_stamp.image_index = static_cast<int>(image_names.size() - 1);
+        bitmap_stamp.width = bitmap.width;
+        bitmap_stamp.height = bitmap.height;
+        bitmap_stamps.push_back(bitmap_stamp);
+    }
+
+    if (!save_file_stamps(image_names, image_stamps, bitmap_stamps))
+        return false;
+
+    std::cerr << "Extracted " << g_mappings_index.get_count() <<
+        " bitmaps." << std::endl;
+
+    return true;
+}
+
+bool replace_gr_file()
+{
+    if (!load_gr_file(g_in_file_name))
+        return false;
+
+    std::string mappings_file_name = combine_path(
+        g_in_dir, g_original_base_name_lc + k_mappings_file_name_suffix);
+
+    std::string binary_mappings_file_name = combine_path(
+        g_in_dir,
+        g_original_base_name_lc + k_binary_mappings_file_name_suffix);
+
+    if (!load_mappings(mappings_file_name, binary_mappings_file_name))
+        return false;
+
+    add_source_file(mappings_file_name);
+    add_source_file(binary_mappings_file_name);
+
+    load_file_stamps(g_in_dir);
+
+    int bitmap_count = static_cast<int>(g_archive.get_bitmap_count());
+
+    // Compressed bitmaps use only the first palette.
+    const AuxPaletteIndex* aux_palette_index = NULL;
+
+    if (!g_resource->is_panels && g_resource->palette_index == 0)
+        aux_palette_index = &g_palette_set.get_aux_palette_index();
+
+    // Each task imports into its own bitmap, so the file
+    // is laid out by save_gr_file as after a serial run.
+    WorkerPool pool(g_thread_count > 1 ? g_thread_count : 0);
+    BitmapTasks tasks;
+    int reused_count = 0;
+    bool result = true;
+
+    for (int i = 0; i < g_mappings_index.get_count() && result; ++i) {
+        int bitmap_index = g_mappings_index.get_bitmap_index(i);
+        const char* bitmap_file_name = g_mappings_index.get_file_name(i);
+
+        if (bitmap_index >= bitmap_count) {
+            std::cerr << "ERROR: Bitmap index is out of range: " <<
+                bitmap_index << '.' << std::endl;
+            result = false;
+            break;
+        }
+
+        add_source_file(combine_path(g_in_dir, bitmap_file_name));
+
+        const Bitmap& bitmap = g_archive.get_bitmap(bitmap_index);
+
+        // Keep original data of the bitmap if it is still
+        // in the image it was extracted to.
+        if (is_bitmap_stamped(
+            bitmap_index, bitmap_file_name, 0, 0,
+            bitmap.width, bitmap.height) &&
+            is_image_unchanged(g_in_dir, bitmap_file_name))
+        {
+            ++reused_count;
+            continue;
         }
 
-        g_mappings[bitmap_index] = bitmap_file_name;
+        ImportTask* task = new ImportTask();
+        task->file_name = combine_path(g_in_dir, bitmap_file_name);
+        task->bitmap = &g_archive.get_bitmap(bitmap_index);
+        task->aux_palette_index = aux_palette_index;
+
+        if (g_resource->is_panels) {
+            if (bitmap_index < (bitmap_count - 1))
+                task->special = Bitmap::e_panel;
+            else
+                task->special = Bitmap::e_last_panel;
+        }
+
+        if (!post_bitmap_task(pool, tasks, task))
+            result = false;
     }
 
-    if (g_mappings.empty()) {
-        std::cerr << "ERROR: No records." << std::endl;
+    if (!finish_bitmap_tasks(pool, tasks))
+        result = false;
+
+    if (!result)
         return false;
+
+    if (reused_count > 0) {
+        std::cout << "Unchanged bitmaps: " << reused_count << '.' <<
+            std::endl;
     }
 
+    if (!save_gr_file(g_out_file_name))
+        return false;
+
     return true;
 }
 
-bool load_gr_file(
-    const std::string& file_name)
+// Orders bitmaps for packing: taller and wider ones go first.
+class AtlasOrder {
+public:
+    bool operator()(
+        int a,
+        int b) const
+    {
+        const Bitmap& bitmap_a = g_archive.get_bitmap(a);
+        const Bitmap& bitmap_b = g_archive.get_bitmap(b);
+
+        if (bitmap_a.height != bitmap_b.height)
+            return bitmap_a.height > bitmap_b.height;
+
+        if (bitmap_a.width != bitmap_b.width)
+            return bitmap_a.width > bitmap_b.width;
+
+        return a < b;
+    }
+}; // class AtlasOrder
+
+class AtlasEntryOrder {
+public:
+    bool operator()(
+        const AtlasEntry& a,
+        const AtlasEntry& b) const
+    {
+        return a.bitmap_index < b.bitmap_index;
+    }
+}; // class AtlasEntryOrder
+
+// Packs all bitmaps into atlas pages.
+bool extract_gr_atlas()
 {
-    std::cout << "Loading \"" << file_name << "\"." << std::endl;
+    if (!load_gr_file(g_in_file_name))
+        return false;
+
+    if (!create_dirs_along_the_path(g_out_dir))
+        return false;
+
+    g_mappings.clear();
+    g_atlas_pages.clear();
+    g_atlas_entries.clear();
+
+    std::vector<int> order;
+
+    for (int i = 0; i < g_archive.get_bitmap_count(); ++i) {
+        if (!g_archive.get_bitmap(i).is_empty())
+            order.push_back(i);
+    }
+
+    std::sort(order.begin(), order.end(), AtlasOrder());
+
+    AtlasPacker packer(k_atlas_page_size);
+
+    for (size_t i = 0; i < order.size(); ++i) {
+        const Bitmap& bitmap = g_archive.get_bitmap(order[i]);
+
+        AtlasEntry entry;
+        entry.bitmap_index = order[i];
+        entry.width = bitmap.width;
+        entry.height = bitmap.height;
+        entry.page_index =
+            packer.add(bitmap.width, bitmap.height, entry.x, entry.y);
+
+        g_atlas_entries.push_back(entry);
+    }
+
+    std::sort(
+        g_atlas_entries.begin(), g_atlas_entries.end(), AtlasEntryOrder());
+
+    const Palette& palette =
+        g_palette_set.get_palette(g_resource->palette_index);
+
+    IndexedImage bitmap_image;
+    std::vector<std::string> image_names;
+
+    // Indices of saved pages in the stamps.
+    std::vector<int> image_indices(packer.get_page_count(), -1);
+    std::vector<bool> kept_pages(packer.get_page_count());
+
+    for (int i = 0; i < packer.get_page_count(); ++i) {
+        std::ostringstream oss;
+        oss << g_original_base_name_lc << "_atlas_" <<
+            std::setfill('0') << std::setw(2) << i <<
+            get_image_extension(g_image_format);
+
+        std::string page_name = oss.str();
+        std::string page_file_name = combine_path(g_out_dir, page_name);
+
+        g_atlas_pages.push_back(page_name);
+
+        test_file_for_overwrite(page_file_name);
+
+        if (g_user_answer == "cancel")
+            return false;
+
+        if (g_user_answer == "no") {
+            kept_pages[i] = true;
+            continue;
+        }
 
-    std::ifstream file(
-        file_name.c_str(),
-        std::ios_base::in | std::ios_base::binary | std::ios_base::ate);
+        IndexedImage image;
+        packer.get_page_size(i, image.width, image.height);
+        image.pixels.resize(image.width * image.height);
 
-    if (!file) {
-        std::cerr << "ERROR: Failed to open." << std::endl;
-        return false;
-    }
+        for (AtlasEntriesCIt j = g_atlas_entries.begin();
+            j != g_atlas_entries.end(); ++j)
+        {
+            if (j->page_index != i)
+                continue;
 
-    std::ifstream::pos_type file_size = file.tellg();
+            {
+                UW2_GR_TOOL_STATS_TIMER(timer, e_phase_decoding);
+                UW2_GR_TOOL_STATS_SET_TYPE(
+                    timer, g_archive.get_bitmap(j->bitmap_index).type);
 
-    if (file_size == std::ifstream::pos_type(0)) {
-        std::cerr << "ERROR: Empty file." << std::endl;
-        return false;
-    }
+                if (!g_archive.decode_bitmap(j->bitmap_index, bitmap_image))
+                    return false;
+            }
 
-    if (file_size > k_max_file_size) {
-        std::cerr << "ERROR: File is too big." << std::endl;
-        return false;
-    }
+            const Buffer& pixels = bitmap_image.pixels;
 
-    file.seekg(0);
+            for (int k = 0; k < j->height; ++k) {
+                std::copy(
+                    pixels.begin() + (k * j->width),
+                    pixels.begin() + ((k + 1) * j->width),
+                    image.pixels.begin() +
+                        ((j->y + k) * image.width) + j->x);
+            }
+        }
 
-    Buffer buffer(static_cast<size_t>(file_size));
+        std::cout << "Exporting an atlas page to \"" <<
+            page_file_name << "\"." << std::endl;
 
-    file.read(
-        reinterpret_cast<char*>(&buffer[0]),
-        static_cast<size_t>(file_size));
+        {
+            UW2_GR_TOOL_STATS_TIMER(timer, e_phase_image_writing);
 
-    if (!file) {
-        std::cerr << "ERROR: I/O error." << std::endl;
-        return false;
-    }
+            if (!image.save_to_file(
+                page_file_name, g_image_format, palette, std::cerr))
+            {
+                return false;
+            }
+        }
 
-    int gr_type = buffer[0];
+        UW2_GR_TOOL_STATS_ADD_FILE_SIZE(e_counter_bytes_out, page_file_name);
 
-    if (gr_type != 1) {
-        std::cerr << "ERROR: Invalid type: " << gr_type << "\"." <<
-            std::endl;
-        return false;
+        image_indices[i] = static_cast<int>(image_names.size());
+        image_names.push_back(page_name);
     }
 
-    int bitmap_count =
-        *reinterpret_cast<const unsigned short*>(&buffer[1]);
-
-    if (bitmap_count == 0) {
-        std::cerr << "ERROR: No bitmaps." << std::endl;
-        return false;
+    for (AtlasEntriesCIt i = g_atlas_entries.begin();
+        i != g_atlas_entries.end(); ++i)
+    {
+        g_mappings[i->bitmap_index] = g_atlas_pages[i->page_index];
     }
 
-    g_bitmaps.resize(bitmap_count);
-    std::vector<int> offsets(bitmap_count + 1);
+    std::string atlas_file_name = combine_path(
+        g_out_dir, g_original_base_name_lc + k_atlas_file_name_suffix);
 
-    for (int i = 0; i < bitmap_count + 1; ++i)
-        offsets[i] = *reinterpret_cast<const unsigned long*>(
-            &buffer[3 + (4 * i)]);
+    test_file_for_overwrite(atlas_file_name);
 
-    for (int i = 0; i < bitmap_count; ++i) {
-        Bitmap& bitmap = g_bitmaps[i];
+    if (g_user_answer.empty() ||
+        g_user_answer == "all" ||
+        g_user_answer == "yes")
+    {
+        if (!save_atlas(atlas_file_name))
+            return false;
+    } else if (g_user_answer == "cancel")
+            return false;
 
-        int data_size = offsets[i + 1] - offsets[i];
+    // Pages which were kept keep stamps of their regions
+    // if they did not change since.
+    load_file_stamps(g_out_dir);
 
-        if (data_size == 0) {
-            bitmap.special = Bitmap::e_none;
-            bitmap.width = 0;
-            bitmap.height = 0;
-            Buffer().swap(bitmap.pixels);
-            bitmap.aux_palette = NULL;
-            continue;
+    for (int i = 0; i < packer.get_page_count(); ++i) {
+        if (kept_pages[i] && is_image_unchanged(g_out_dir, g_atlas_pages[i])) {
+            image_indices[i] = static_cast<int>(image_names.size());
+            image_names.push_back(g_atlas_pages[i]);
         }
+    }
 
-        Bitmap::Special special = Bitmap::e_default;
-
-        if (g_is_panels) {
-            if (i == (bitmap_count - 1))
-                special = Bitmap::e_last_panel;
-            else
-                special = Bitmap::e_panel;
-        }
+    BitmapStamps bitmap_stamps;
 
-        int palette_index = g_palette_map[g_original_file_name];
-        Palette& palette = g_palettes[palette_index];
+    for (AtlasEntriesCIt i = g_atlas_entries.begin();
+        i != g_atlas_entries.end(); ++i)
+    {
+        if (image_indices[i->page_index] < 0)
+            continue;
 
-        if (!bitmap.load_from_gr(
-            &buffer[offsets[i]],
-            special,
-            &palette,
-            g_aux_palettes))
+        if (kept_pages[i->page_index] &&
+            !is_bitmap_stamped(
+                i->bitmap_index, g_atlas_pages[i->page_index],
+                i->x, i->y, i->width, i->height))
         {
-            return false;
+            continue;
         }
 
-        if (bitmap.type != 4 && palette_index != 0) {
-            std::cerr <<
-                "ERROR: Non zero palette index for compressed bitmap." <<
-                std::endl;
-            return false;
-        }
+        BitmapStamp bitmap_stamp;
+        bitmap_stamp.bitmap_index = i->bitmap_index;
+        bitmap_stamp.image_index = image_indices[i->page_index];
+        bitmap_stamp.x = i->x;
+        bitmap_stamp.y = i->y;
+        bitmap_stamp.width = i->width;
+        bitmap_stamp.height = i->height;
+        bitmap_stamps.push_back(bitmap_stamp);
     }
 
+    if (!save_file_stamps(image_names, bitmap_stamps))
+        return false;
+
+    std::cerr << "Extracted " << g_mappings.size() << " bitmaps into " <<
+        g_atlas_pages.size() << " atlas pages." << std::endl;
+
     return true;
 }
 
-bool save_gr_file(
-    const std::string& file_name)
+// Replaces bitmaps with regions of atlas pages.
+bool replace_gr_atlas()
 {
-    test_file_for_overwrite(file_name);
+    if (!load_gr_file(g_in_file_name))
+        return false;
 
-    if (g_user_answer == "no" || g_user_answer == "cancel")
+    std::string atlas_file_name = combine_path(
+        g_in_dir, g_original_base_name_lc + k_atlas_file_name_suffix);
+
+    if (!load_atlas(atlas_file_name))
         return false;
 
-    std::cout << "Saving to \"" << file_name << "\"." << std::endl;
+    add_source_file(atlas_file_name);
 
-    std::ofstream file(
-        file_name.c_str(),
-        std::ios_base::out | std::ios_base::binary);
+    load_file_stamps(g_in_dir);
 
-    if (!file) {
-        std::cerr << "ERROR: Failed to open." << std::endl;
-        return false;
-    }
+    int bitmap_count = static_cast<int>(g_archive.get_bitmap_count());
 
-    size_t bitmap_count = g_bitmaps.size();
-    size_t offset_count = bitmap_count + 1;
-    std::vector<unsigned long> offsets(offset_count);
-    unsigned long offset = static_cast<unsigned long>(3 + (4 * offset_count));
-    offsets[0] = offset;
+    // Compressed bitmaps use only the first palette.
+    const AuxPaletteIndex* aux_palette_index = NULL;
 
-    for (size_t i = 0; i < bitmap_count; ++i) {
-        const Bitmap& bitmap = g_bitmaps[i];
+    if (!g_resource->is_panels && g_resource->palette_index == 0)
+        aux_palette_index = &g_palette_set.get_aux_palette_index();
 
-        if (!bitmap.is_empty()) {
-            unsigned long size =
-                static_cast<unsigned long>(bitmap.get_size_in_bytes());
+    std::vector<IndexedImage> images(g_atlas_pages.size());
+    std::vector<bool> loaded_pages(g_atlas_pages.size());
+    std::vector<bool> reused_entries(g_atlas_entries.size());
 
-            if (!g_is_panels) {
-                // type, width, height
-                size += 1 + 1 + 1;
+    for (size_t i = 0; i < g_atlas_pages.size(); ++i)
+        add_source_file(combine_path(g_in_dir, g_atlas_pages[i]));
 
-                if (bitmap.is_compressed())
-                    ++size; // aux. palette index
+    // A bitmap keeps its original data if it is still in the same
+    // region of an unchanged page; a page is loaded for the others.
+    for (size_t i = 0; i < g_atlas_pages.size(); ++i) {
+        bool is_unchanged = is_image_unchanged(g_in_dir, g_atlas_pages[i]);
 
-                // image size
-                size += 2;
-            }
+        for (size_t j = 0; j < g_atlas_entries.size(); ++j) {
+            const AtlasEntry& entry = g_atlas_entries[j];
+
+            if (entry.page_index != static_cast<int>(i))
+                continue;
 
-            offset += size;
+            reused_entries[j] = is_unchanged && is_bitmap_stamped(
+                entry.bitmap_index, g_atlas_pages[i],
+                entry.x, entry.y, entry.width, entry.height);
+
+            if (!reused_entries[j])
+                loaded_pages[i] = true;
+        }
+
+        // A changed page is checked even if no bitmap is taken from it.
+        if (!is_unchanged)
+            loaded_pages[i] = true;
+
+        if (!loaded_pages[i])
+            continue;
+
+        std::string page_file_name = combine_path(g_in_dir, g_atlas_pages[i]);
+
+        std::cout << "Loading atlas page from \"" <<
+            page_file_name << "\"." << std::endl;
+
+        UW2_GR_TOOL_STATS_TIMER(timer, e_phase_image_reading);
+
+        if (!images[i].load_from_file(
+            page_file_name, k_atlas_page_size, k_atlas_page_size, std::cerr))
+        {
+            return false;
         }
 
-        offsets[i + 1] = offset;
+        UW2_GR_TOOL_STATS_ADD_FILE_SIZE(e_counter_bytes_in, page_file_name);
     }
 
-    // type
-    write_value(static_cast<unsigned char>(1), file);
+    for (AtlasEntriesCIt i = g_atlas_entries.begin();
+        i != g_atlas_entries.end(); ++i)
+    {
+        const IndexedImage& image = images[i->page_index];
+
+        if (i->bitmap_index >= bitmap_count) {
+            std::cerr << "ERROR: Bitmap index is out of range: " <<
+                i->bitmap_index << '.' << std::endl;
+            return false;
+        }
 
-    // image count
-    write_value(static_cast<unsigned short>(bitmap_count), file);
+        if (!g_archive.get_bitmap(i->bitmap_index).check_import_dimensions(
+            i->width, i->height, std::cerr))
+        {
+            return false;
+        }
 
-    // image offsets
-    for (size_t i = 0; i < offset_count; ++i)
-        write_value(offsets[i], file);
+        if (loaded_pages[i->page_index] &&
+            ((i->x + i->width) > image.width ||
+                (i->y + i->height) > image.height))
+        {
+            std::cerr << "ERROR: Bitmap " << i->bitmap_index <<
+                " is outside of its atlas page." << std::endl;
+            return false;
+        }
+    }
 
-    // images
-    for (BitmapsCIt i = g_bitmaps.begin(); i != g_bitmaps.end(); ++i) {
-        const Bitmap& bitmap = *i;
+    WorkerPool pool(g_thread_count > 1 ? g_thread_count : 0);
+    BitmapTasks tasks;
+    int reused_count = 0;
+    bool result = true;
 
-        if (bitmap.is_empty())
+    for (AtlasEntriesCIt i = g_atlas_entries.begin();
+        i != g_atlas_entries.end() && result; ++i)
+    {
+        if (reused_entries[i - g_atlas_entries.begin()]) {
+            ++reused_count;
             continue;
+        }
 
-        if (!g_is_panels) {
-            write_value(static_cast<unsigned char>(bitmap.type), file);
-            write_value(static_cast<unsigned char>(bitmap.width), file);
-            write_value(static_cast<unsigned char>(bitmap.height), file);
-
-            if (bitmap.is_compressed()) {
-                int aux_palette_index = bitmap.aux_palette - g_aux_palettes;
-                write_value(static_cast<unsigned char>(aux_palette_index), file);
-            }
+        RegionImportTask* task = new RegionImportTask();
+        task->bitmap = &g_archive.get_bitmap(i->bitmap_index);
+        task->image = &images[i->page_index];
+        task->x = i->x;
+        task->y = i->y;
+        task->aux_palette_index = aux_palette_index;
 
-            write_value(static_cast<unsigned short>(bitmap.data_size), file);
+        if (g_resource->is_panels) {
+            if (i->bitmap_index < (bitmap_count - 1))
+                task->special = Bitmap::e_panel;
+            else
+                task->special = Bitmap::e_last_panel;
         }
 
-        file.write(
-            reinterpret_cast<const char*>(&bitmap.pixels[0]),
-            bitmap.data_size);
+        result = post_bitmap_task(pool, tasks, task);
     }
 
-    if (!file) {
-        std::cerr << "ERROR: I/O error." << std::endl;
+    if (!finish_bitmap_tasks(pool, tasks) || !result)
         return false;
+
+    if (reused_count > 0) {
+        std::cout << "Unchanged bitmaps: " << reused_count << '.' <<
+            std::endl;
     }
 
+    if (!save_gr_file(g_out_file_name))
+        return false;
+
     return true;
 }
 
-bool save_mappings(
+// Sets the current .GR file.
+void set_gr_file(
     const std::string& file_name)
 {
-    std::ofstream file(file_name.c_str());
-
-    std::cout << "Saving mappings to \"" << file_name << "\"." << std::endl;
+    g_in_file_name = file_name;
 
-    if (!file) {
-        std::cerr << "ERROR: Failed to open." << std::endl;
-        return false;
-    }
+    g_original_file_name =
+        to_uppercase(extract_file_name(g_in_file_name));
 
-    for (MappingsCIt i = g_mappings.begin(); i != g_mappings.end(); ++i)
-        file << i->first << ' ' << i->second << std::endl;
+    g_original_base_name_lc = to_lowercase(
+        extract_file_name_without_extension(g_original_file_name));
 
-    return true;
+    g_resource = find_resource(g_original_file_name);
 }
 
-bool extract_gr_file()
+// Returns a path to a resource in the data directory, spelled in
+// upper or lower case, or an empty string if there is none.
+std::string find_data_file(
+    const std::string& name)
 {
-    if (!load_gr_file(g_in_file_name))
-        return false;
+    std::string path = combine_path(g_path_to_data, name);
 
-    if (!create_dirs_along_the_path(g_out_dir))
-        return false;
+    if (is_file_exists(path))
+        return path;
 
-    std::ostringstream oss;
+    path = combine_path(g_path_to_data, to_lowercase(name));
 
-    g_mappings.clear();
+    if (is_file_exists(path))
+        return path;
 
-    std::string mappings_file_name = combine_path(
-        g_out_dir, g_original_base_name_lc + k_mappings_file_name_suffix);
+    return std::string();
+}
 
-    for (size_t i = 0; i < g_bitmaps.size(); ++i) {
-        const Bitmap& bitmap = g_bitmaps[i];
+class BatchResult {
+public:
+    std::string file_name;
+    std::string status;
+}; // class BatchResult
 
-        if (bitmap.is_empty())
-            continue;
+typedef std::vector<BatchResult> BatchResults;
 
-        oss.clear();
-        oss.str(std::string());
-        oss << std::setfill('0') << std::setw(4) << i;
-        std::string map_name =
-            g_original_base_name_lc + '_' + oss.str() + ".bmp";
-        std::string bitmap_file_name = combine_path(g_out_dir, map_name);
+// Extracts or replaces all known .GR files of the data directory.
+bool process_data_dir()
+{
+    bool is_extraction = (g_command == "E");
+    bool result = true;
+    BatchResults results;
 
-        test_file_for_overwrite(bitmap_file_name);
+    for (int i = 0; i < get_resource_count(); ++i) {
+        BatchResult batch_result;
+        batch_result.file_name = get_resource(i).file_name;
 
-        if (g_user_answer.empty() ||
-            g_user_answer == "all" ||
-            g_user_answer == "yes")
-        {
-            if (!g_bitmaps[i].export_to_bmp(bitmap_file_name))
-                return false;
-        } else if (g_user_answer == "cancel")
-            return false;
+        std::string path = find_data_file(batch_result.file_name);
 
-        g_mappings[i] = map_name;
-    }
+        if (path.empty()) {
+            batch_result.status = "not found";
+            results.push_back(batch_result);
+            continue;
+        }
 
-    test_file_for_overwrite(mappings_file_name);
+        std::cout << std::endl;
 
-    if (g_user_answer.empty() ||
-        g_user_answer == "all" ||
-        g_user_answer == "yes")
-    {
-        if (!save_mappings(mappings_file_name))
-            return false;
-    } else if (g_user_answer == "cancel")
-            return false;
+        set_gr_file(path);
 
-    std::cerr << "Extracted " << g_mappings.size() << " bitmaps." << std::endl;
+        bool is_succeed;
 
-    return true;
-}
+        if (is_extraction) {
+            g_out_dir = combine_path(g_out_root, g_original_base_name_lc);
 
-bool replace_gr_file()
-{
-    if (!load_gr_file(g_in_file_name))
-        return false;
+            if (g_is_atlas)
+                is_succeed = extract_gr_atlas();
+            else
+                is_succeed = extract_gr_file();
+        } else {
+            g_in_dir = combine_path(g_in_root, g_original_base_name_lc);
+
+            std::string mappings_file_name = combine_path(
+                g_in_dir,
+                g_original_base_name_lc + (g_is_atlas ?
+                    k_atlas_file_name_suffix : k_mappings_file_name_suffix));
+
+            std::string binary_mappings_file_name = combine_path(
+                g_in_dir,
+                g_original_base_name_lc + k_binary_mappings_file_name_suffix);
+
+            if (!is_file_exists(mappings_file_name) &&
+                (g_is_atlas || !is_file_exists(binary_mappings_file_name)))
+            {
+                batch_result.status = "no mappings";
+                results.push_back(batch_result);
+                continue;
+            }
 
-    std::string list_path =
-        combine_path(g_in_dir, g_original_base_name_lc + "_mappings.txt");
+            g_out_file_name =
+                combine_path(g_out_root, extract_file_name(path));
 
-    if (!load_mappings(list_path))
-        return false;
+            if (g_is_atlas)
+                is_succeed = replace_gr_atlas();
+            else
+                is_succeed = replace_gr_file();
+        }
 
-    int bitmap_count = static_cast<int>(g_bitmaps.size());
+        if (is_succeed) {
+            size_t bitmap_count = g_mappings.size();
 
-    for (MappingsCIt i = g_mappings.begin(); i != g_mappings.end(); ++i) {
-        int bitmap_index = i->first;
+            if (!g_is_atlas)
+                bitmap_count = g_mappings_index.get_count();
 
-        if (bitmap_index >= bitmap_count) {
-            std::cerr << "ERROR: Bitmap index is out of range: " <<
-                bitmap_index << '.' << std::endl;
-            return false;
+            std::ostringstream oss;
+            oss << bitmap_count << " bitmaps";
+            batch_result.status = oss.str();
+        } else {
+            batch_result.status = "FAILED";
+            result = false;
         }
 
-        Bitmap& bitmap = g_bitmaps[bitmap_index];
-        std::string bitmap_path = combine_path(g_in_dir, i->second);
+        results.push_back(batch_result);
 
-        Bitmap::Special special = Bitmap::e_default;
+        if (g_user_answer == "cancel")
+            break;
+    }
 
-        if (g_is_panels) {
-            if (bitmap_index < (bitmap_count - 1))
-                special = Bitmap::e_panel;
-            else
-                special = Bitmap::e_last_panel;
-        }
+    std::cout << std::endl << "Summary:" << std::endl;
 
-        if (!bitmap.import_from_bmp(bitmap_path, special))
-            return false;
+    for (BatchResults::const_iterator i = results.begin();
+        i != results.end(); ++i)
+    {
+        std::cout << "  " << std::left << std::setfill(' ') <<
+            std::setw(12) << i->file_name << ' ' << i->status << std::endl;
     }
 
-    if (!save_gr_file(g_out_file_name))
-        return false;
-
-    return true;
+    return result;
 }
 
 void usage()
 {
     std::cout <<
-        "Usage: uw2_gr_tool <cmd> arg1 arg2 ..." << std::endl <<
+        "Usage: uw2_gr_tool [options] <cmd> arg1 arg2 ..." << std::endl <<
+        "  Options:" << std::endl <<
+        "    -j <count>" << std::endl <<
+        "      Number of threads to export or import bitmaps with (1 by default," << std::endl <<
+        "      0 - one per processor)." << std::endl <<
+        "    --format=<bmp|bmp-rle8|png>" << std::endl <<
+        "      Format of extracted bitmaps (bmp by default). Bitmaps are imported" << std::endl <<
+        "      according to extension of their files. RLE8 compressed BMP files" << std::endl <<
+        "      leave out trailing pixels of color 0 of lines and of the image." << std::endl <<
+        "    --atlas" << std::endl <<
+        "      Extract all bitmaps of a file into a few atlas pages (up to 1024x1024)" << std::endl <<
+        "      with an index <name>_atlas.txt instead of mappings, or replace" << std::endl <<
+        "      bitmaps with regions of such pages." << std::endl <<
+        "    --force" << std::endl <<
+        "      Replace all bitmaps. By default bitmaps which still map to the same" << std::endl <<
+        "      image (or atlas region) whose content did not change since" << std::endl <<
+        "      extraction (see <name>_stamps.txt) keep their original data." << std::endl <<
+        "    --binary-mappings" << std::endl <<
+        "      Also save mappings into a binary file <name>_mappings.bin which" << std::endl <<
+        "      loads faster. Once it exists, the binary file is used unless" << std::endl <<
+        "      the text one is newer, in which case the binary file is rewritten" << std::endl <<
+        "      from the text one. A missing text file is recreated from the binary" << std::endl <<
+        "      one; an existing text file is never rewritten." << std::endl <<
+        "    --overwrite=<ask|always|never|newer>" << std::endl <<
+        "      What to do with existing files (ask by default): ask whether" << std::endl <<
+        "      to overwrite them, overwrite them, keep them, or overwrite only" << std::endl <<
+        "      files older than the files they are made from." << std::endl <<
+        "    --stats[=table|=json=<file>]" << std::endl <<
+        "      Print time spent in each phase (palette loading, .GR parsing," << std::endl <<
+        "      decoding, image writing, etc.), bytes read and written, bitmaps" << std::endl <<
+        "      of each type and a histogram of decoding time per bitmap, or save" << std::endl <<
+        "      them into a file in JSON format." << std::endl <<
         "  1) extraction:" << std::endl <<
         "     e <in_file> <out_dir>" << std::endl <<
         "       Extracts all bitmaps from file <in_file> into a directory <out_dir>," << std::endl <<
@@ -1667,32 +2990,153 @@ void usage()
         "     Replaces bitmaps in file <in_file> with a new ones using mappings" << std::endl <<
         "     file in directory <in_dir> and saves it under a new file name <out_file>." << std::endl <<
         "     Path to bitmaps in mappings file is relative to directory <in_dir>." << std::endl <<
+        "  3) batch extraction:" << std::endl <<
+        "     E <data_dir> <out_root>" << std::endl <<
+        "     Extracts all known files of directory <data_dir>; bitmaps of each file" << std::endl <<
+        "     go into a subdirectory of <out_root> named after the file (e.g. objects)." << std::endl <<
+        "  4) batch replacing:" << std::endl <<
+        "     R <data_dir> <in_root> <out_dir>" << std::endl <<
+        "     Rebuilds every file of directory <data_dir> which has a subdirectory" << std::endl <<
+        "     with mappings in <in_root> and saves it into directory <out_dir>." << std::endl <<
         std::endl <<
         "  Format of the file with mappings:" << std::endl <<
         "    <bitmap_index> <file_name_without_path>" << std::endl <<
         "    ..." << std::endl <<
         std::endl <<
+        "  Format of the atlas index:" << std::endl <<
+        "    pages <page_count>" << std::endl <<
+        "    <page_index> <file_name_without_path>" << std::endl <<
+        "    ..." << std::endl <<
+        "    bitmaps <bitmap_count>" << std::endl <<
+        "    <bitmap_index> <page_index> <x> <y> <width> <height> <type> <aux_palette>" << std::endl <<
+        "    ..." << std::endl <<
+        "    Type and auxiliary palette (-1 if none) are informative only." << std::endl <<
+        std::endl <<
         "  Notes:" << std::endl <<
-        "  1) For extraction directory <in_file> must contain the following files:" << std::endl <<
+        "  1) Directory of <in_file> or <data_dir> must contain the following files:" << std::endl <<
         "     ALLPALS.DAT and PALS.DAT." << std::endl <<
         "  2) Supported BMP formats: 8 bit uncompressed or 8 bit RLE compressed." << std::endl <<
+        "     Supported PNG formats: 8 bit indexed, not interlaced." << std::endl <<
         "  3) BMP file name in mappings file should not" << std::endl <<
         "     contain any whitespaces (space, tab, .etc)." << std::endl
     ;
 }
 
 
-} // namespace
+// Parses options in front of a command and skips them.
+bool parse_options(
+    int& argc,
+    char**& argv)
+{
+    while (argc > 1 && argv[1][0] == '-') {
+        std::string option = argv[1];
+        std::string value;
+        int count = 1;
+
+        if (option.compare(0, 2, "-j") == 0) {
+            if (option.size() > 2)
+                value = option.substr(2);
+            else if (argc > 2) {
+                value = argv[2];
+                count = 2;
+            }
 
+            char* end = NULL;
+            long thread_count = std::strtol(value.c_str(), &end, 10);
 
-int main(
+            if (value.empty() || *end != '\0' ||
+                thread_count < 0 || thread_count > 256)
+            {
+                std::cerr << "ERROR: Invalid thread count \"" <<
+                    value << "\"." << std::endl;
+                return false;
+            }
+
+            if (thread_count == 0) {
+                thread_count = std::thread::hardware_concurrency();
+
+                if (thread_count == 0)
+                    thread_count = 1;
+            }
+
+            g_thread_count = static_cast<int>(thread_count);
+        } else if (option == "--atlas")
+            g_is_atlas = true;
+        else if (option == "--force")
+            g_is_forced = true;
+        else if (option == "--binary-mappings")
+            g_is_binary_mappings = true;
+        else if (option.compare(0, 12, "--overwrite=") == 0) {
+            value = option.substr(12);
+
+            if (value == "ask")
+                g_overwrite_policy = e_overwrite_ask;
+            else if (value == "always")
+                g_overwrite_policy = e_overwrite_always;
+            else if (value == "never")
+                g_overwrite_policy = e_overwrite_never;
+            else if (value == "newer")
+                g_overwrite_policy = e_overwrite_newer;
+            else {
+                std::cerr << "ERROR: Unsupported overwrite policy \"" <<
+                    value << "\"." << std::endl;
+                return false;
+            }
+        } else if (option == "--stats" ||
+            option == "--stats=table" ||
+            option.compare(0, 13, "--stats=json=") == 0)
+        {
+#ifndef UW2_GR_TOOL_NO_STATS
+            if (option == "--stats=json=") {
+                std::cerr << "ERROR: No file for statistics." << std::endl;
+                return false;
+            }
+
+            g_stats.enable();
+
+            if (option.compare(0, 13, "--stats=json=") == 0)
+                g_json_stats_file_name = option.substr(13);
+            else
+                g_json_stats_file_name.clear();
+#else
+            std::cerr << "ERROR: Statistics are not supported by this build." <<
+                std::endl;
+            return false;
+#endif // UW2_GR_TOOL_NO_STATS
+        }
+        else if (option.compare(0, 9, "--format=") == 0) {
+            value = option.substr(9);
+
+            if (value == "bmp")
+                g_image_format = e_format_bmp;
+            else if (value == "bmp-rle8")
+                g_image_format = e_format_bmp_rle8;
+            else if (value == "png")
+                g_image_format = e_format_png;
+            else {
+                std::cerr << "ERROR: Unsupported image format \"" <<
+                    value << "\"." << std::endl;
+                return false;
+            }
+        } else {
+            std::cerr << "ERROR: Unknown option \"" <<
+                option << "\"." << std::endl;
+            return false;
+        }
+
+        argv[count] = argv[0];
+        argv += count;
+        argc -= count;
+    }
+
+    return true;
+}
+
+// Runs a command and returns an exit code.
+int run_command(
     int argc,
     char* argv[])
 {
-    std::cout << "\"Ultima Underworld II\" GR extracter/rebuilder." << std::endl <<
-    "Copyright (C) 2014, Boris I. Bendovsky <bibendovsky@hotmail.com>" <<
-        std::endl << std::endl;
-
     if (argc < 3) {
         usage();
         return 1;
@@ -1707,12 +3151,14 @@ int main(
         return 1;
     }
 
-    if (g_command[0] != 'e' && g_command[0] != 'r') {
+    if (g_command != "e" && g_command != "r" &&
+        g_command != "E" && g_command != "R")
+    {
         std::cerr << "ERROR: Invalid command." << std::endl;
         return 1;
     }
 
-    if (g_command == "e") {
+    if (g_command == "e" || g_command == "E") {
         if (argc != 4) {
             usage();
             return 1;
@@ -1725,47 +3171,109 @@ int main(
     }
 
     //
-    g_in_file_name = normalize_path(argv[2]);
+    if (g_command == "E" || g_command == "R") {
+        g_path_to_data = normalize_path(argv[2]);
 
-    g_original_file_name =
-        to_uppercase(extract_file_name(g_in_file_name));
+        if (!load_palettes())
+            return 2;
 
-    g_original_base_name_lc = to_lowercase(
-        extract_file_name_without_extension(g_original_file_name));
+        if (g_command == "E")
+            g_out_root = normalize_path(argv[3]);
+        else {
+            g_in_root = normalize_path(argv[3]);
+            g_out_root = normalize_path(argv[4]);
+
+            if (!create_dirs_along_the_path(g_out_root))
+                return 2;
+        }
+
+        if (!process_data_dir())
+            return 2;
 
-    g_is_panels = (g_original_file_name == "PANELS.GR");
+        return 0;
+    }
 
-    initialize_palette_map(g_palette_map);
+    //
+    set_gr_file(normalize_path(argv[2]));
 
-    if (g_palette_map.find(g_original_file_name) == g_palette_map.end()) {
+    if (!g_resource) {
         std::cerr << "ERROR: UW2 does not have resource \"" <<
             g_original_file_name << "\"." << std::endl;
-        return false;
+        return 1;
     }
 
     g_path_to_data = extract_dir(g_in_file_name);
 
-    if (!load_palettes(
-        g_path_to_data,
-        g_palettes,
-        g_aux_palettes))
-    {
+    if (!load_palettes())
         return 2;
-    }
 
     //
     if (g_command == "e") {
         g_out_dir = normalize_path(argv[3]);
 
-        if (!extract_gr_file())
-            return 2;
+        if (g_is_atlas) {
+            if (!extract_gr_atlas())
+                return 2;
+        } else {
+            if (!extract_gr_file())
+                return 2;
+        }
     } else {
         g_in_dir = normalize_path(argv[3]);
         g_out_file_name = normalize_path(argv[4]);
 
-        if (!replace_gr_file())
-            return 2;
+        if (g_is_atlas) {
+            if (!replace_gr_atlas())
+                return 2;
+        } else {
+            if (!replace_gr_file())
+                return 2;
+        }
     }
 
     return 0;
 }
+
+} // namespace
+
+
+int main(
+    int argc,
+    char* argv[])
+{
+    std::cout << "\"Ultima Underworld II\" GR extracter/rebuilder." << std::endl <<
+    "Copyright (C) 2014, Boris I. Bendovsky <bibendovsky@hotmail.com>" <<
+        std::endl << std::endl;
+
+    if (!parse_options(argc, argv))
+        return 1;
+
+    int result = run_command(argc, argv);
+
+#ifndef UW2_GR_TOOL_NO_STATS
+    if (g_stats.is_enabled()) {
+        if (g_json_stats_file_name.empty())
+            g_stats.print(std::cout);
+        else {
+            // Messages of the run go to the standard output,
+            // so the report is kept apart.
+            std::ostringstream stream;
+            g_stats.print_json(stream);
+
+            std::string json = stream.str();
+
+            if (!write_file(
+                g_json_stats_file_name,
+                reinterpret_cast<const unsigned char*>(json.c_str()),
+                json.size()))
+            {
+                std::cerr << "ERROR: Failed to write statistics to \"" <<
+                    g_json_stats_file_name << "\"." << std::endl;
+                result = 1;
+            }
+        }
+    }
+#endif // UW2_GR_TOOL_NO_STATS
+
+    return result;
+}